@@ -1,19 +1,41 @@
 target_sources(Lute.Runtime PRIVATE
+    runtime/include/lute/metrics.h
     runtime/include/lute/options.h
     runtime/include/lute/ref.h
     runtime/include/lute/require.h
     runtime/include/lute/runtime.h
+    runtime/include/lute/trace.h
 
+    runtime/src/metrics.cpp
     runtime/src/options.cpp
     runtime/src/ref.cpp
     runtime/src/require.cpp
     runtime/src/runtime.cpp
+    runtime/src/trace.cpp
 )
 
 target_sources(Lute.Fs PRIVATE
+    fs/include/lute/atomicwrite.h
+    fs/include/lute/batch.h
+    fs/include/lute/directory.h
     fs/include/lute/fs.h
+    fs/include/lute/map.h
+    fs/include/lute/stat.h
+    fs/include/lute/stream.h
+    fs/include/lute/walk.h
+    fs/include/lute/watch.h
+    fs/include/lute/writer.h
 
+    fs/src/atomicwrite.cpp
+    fs/src/batch.cpp
+    fs/src/directory.cpp
     fs/src/fs.cpp
+    fs/src/map.cpp
+    fs/src/stat.cpp
+    fs/src/stream.cpp
+    fs/src/walk.cpp
+    fs/src/watch.cpp
+    fs/src/writer.cpp
 )
 
 target_sources(Lute.Luau PRIVATE
@@ -23,9 +45,19 @@ target_sources(Lute.Luau PRIVATE
 )
 
 target_sources(Lute.Net PRIVATE
+    net/include/lute/client.h
     net/include/lute/net.h
+    net/include/lute/request.h
+    net/include/lute/server.h
+    net/include/lute/tcp.h
+    net/include/lute/udp.h
 
+    net/src/client.cpp
     net/src/net.cpp
+    net/src/request.cpp
+    net/src/server.cpp
+    net/src/tcp.cpp
+    net/src/udp.cpp
 )
 
 target_sources(Lute.Task PRIVATE
@@ -10,12 +10,14 @@
 
 #include "lute/fs.h"
 #include "lute/luau.h"
+#include "lute/metrics.h"
 #include "lute/net.h"
 #include "lute/options.h"
 #include "lute/ref.h"
 #include "lute/require.h"
 #include "lute/runtime.h"
 #include "lute/task.h"
+#include "lute/trace.h"
 #include "lute/vm.h"
 
 #include "tc.h"
@@ -151,6 +153,9 @@ static void displayHelp(const char* argv0)
     printf("Available options:\n");
     printf("  -h, --help: Display this usage message.\n");
     printf("  --check: Run a strict typecheck of the Luau program.\n");
+    printf("  --trace=<file>: Record async operations and scheduler activity as a Chrome trace-event JSON file.\n");
+    printf("  --metrics=<ms>: Print scheduler metrics of every runtime to stderr as JSON lines at the given interval.\n");
+    printf("  --io-uring: Submit file system requests through io_uring instead of the threadpool (Linux only).\n");
     printf("  --: declare start of arguments to be passed to the Luau program\n");
 }
 
@@ -171,6 +176,8 @@ int main(int argc, char** argv)
 
     int program_args = argc;
     bool runTypecheck = false;
+    std::string traceFile;
+    int metricsInterval = 0;
 
     for (int i = 1; i < argc; i++)
     {
@@ -190,6 +197,25 @@ int main(int argc, char** argv)
             program_args = i + 1;
             break;
         }
+        else if (strncmp(argv[i], "--trace=", 8) == 0)
+        {
+            traceFile = argv[i] + 8;
+        }
+        else if (strncmp(argv[i], "--metrics=", 10) == 0)
+        {
+            metricsInterval = atoi(argv[i] + 10);
+
+            if (metricsInterval <= 0)
+            {
+                fprintf(stderr, "Error: --metrics expects a positive interval in milliseconds.\n\n");
+                displayHelp(argv[0]);
+                return 1;
+            }
+        }
+        else if (strcmp(argv[i], "--io-uring") == 0)
+        {
+            Runtime::enableIoUring();
+        }
         else if (argv[i][0] == '-')
         {
             fprintf(stderr, "Error: Unrecognized option '%s'.\n\n", argv[i]);
@@ -239,10 +265,24 @@ int main(int argc, char** argv)
         return 1;
     }
 
-    Runtime runtime;
+    if (!traceFile.empty())
+    {
+        if (!trace::start(traceFile))
+        {
+            fprintf(stderr, "Error: cannot open trace file '%s'.\n", traceFile.c_str());
+            return 1;
+        }
+
+        trace::setThreadName("runtime (main)");
+    }
+
+    Runtime runtime("main");
 
     lua_State* L = setupState(runtime);
 
+    if (metricsInterval > 0)
+        metrics::startPeriodicDump(metricsInterval);
+
     int failed = 0;
 
     for (size_t i = 0; i < files.size(); ++i)
@@ -250,5 +290,8 @@ int main(int argc, char** argv)
         failed += !runFile(runtime, files[i].c_str(), L);
     }
 
+    metrics::stopPeriodicDump();
+    trace::stop();
+
     return failed ? 1 : 0;
 }
@@ -8,8 +8,8 @@
 static const std::string kLuteDefinitions = R"LUTE_TYPES(
 -- Net api
 declare net: {
-    get: (string) -> string,
-    getAsync: (string) -> string,
+    get: (string) -> buffer,
+    getAsync: (string) -> buffer,
 }
 -- fs api
 declare class file end
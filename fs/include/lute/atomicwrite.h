@@ -0,0 +1,16 @@
+#pragma once
+
+struct lua_State;
+
+namespace fs
+{
+
+/* Takes path: string, data: string | buffer and an optional options table {fsync: boolean?}
+   Yields until the contents of 'path' have been replaced as a whole: the data is written to a temporary file next to it,
+   which is renamed over 'path', so readers and crashes see either the old or the new contents
+   With 'fsync' (the default) the data and the rename are durable once it returns
+   Atomic writes made while a previous group is being committed are committed together and share their fsyncs
+ */
+int writeatomic(lua_State* L);
+
+} // namespace fs
@@ -0,0 +1,23 @@
+#pragma once
+
+struct lua_State;
+
+namespace fs
+{
+
+/* Takes paths: {string} and an optional options table {buffers: boolean?}
+   Yields until every file has been read, returns an array of strings (or buffers) with false for files which failed
+   The open, stat, read and close requests of the files are kept in flight together on the runtime loop,
+   so with io_uring enabled they are submitted through the ring instead of the threadpool
+ */
+int readfiles(lua_State* L);
+
+/* Takes paths: {string} and contents: {string | buffer}
+   Yields until every file has been replaced by its contents, returns an array of booleans telling which writes succeeded
+ */
+int writefiles(lua_State* L);
+
+/* Returns "io_uring" when the runtime loop was set up to submit fs requests through io_uring, "threadpool" otherwise */
+int iobackend(lua_State* L);
+
+} // namespace fs
@@ -0,0 +1,13 @@
+#pragma once
+
+struct lua_State;
+
+namespace fs
+{
+
+/* Takes path: string and an optional options table {batchSize: number?, arrays: boolean?}
+   Yields until the directory is open and returns a handle which reads its entries in batches of 'batchSize'
+ */
+int opendir(lua_State* L);
+
+} // namespace fs
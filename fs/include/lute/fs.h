@@ -3,6 +3,16 @@
 #include "lua.h"
 #include "lualib.h"
 
+#include "lute/atomicwrite.h"
+#include "lute/batch.h"
+#include "lute/directory.h"
+#include "lute/map.h"
+#include "lute/stat.h"
+#include "lute/stream.h"
+#include "lute/walk.h"
+#include "lute/watch.h"
+#include "lute/writer.h"
+
 // open the library as a standard global luau library
 int luaopen_fs(lua_State* L);
 // open the library as a table on top of the stack
@@ -13,26 +23,72 @@ namespace fs
 
 // TODO: add the ability to open as bytes
 /* Takes  path: string, a mode: 'r|a|w|x|+' (defaulting to r when omitted)
-   Returns a table representing a handle to the file the state of a file {fd : number, error : ...}
+   Returns a FileHandle userdata with read, readtobuffer, write, positional read and write, flush and close methods, closed when collected
  */
 int open(lua_State* L);
 
 /* Reads a file into a string. Takes a file handle obtained from openfile */
 int read(lua_State* L);
 
-/* Writes a string to a file without closing it*/
+/* Reads a file into a buffer. Takes a file handle obtained from openfile */
+int readtobuffer(lua_State* L);
+
+/* Writes a string or a buffer to a file without closing it*/
 int write(lua_State* L);
 
+/* Takes a file handle, buf: buffer, bufOffset: number?, len: number?, fileOffset: number?
+   Reads up to 'len' bytes at 'fileOffset' into the buffer, at the current position when 'fileOffset' is omitted
+   Returns the number of bytes read, which is only short at the end of the file
+ */
+int readinto(lua_State* L);
+
+/* Takes a file handle, buf: buffer, bufOffset: number?, len: number?, fileOffset: number?
+   Writes 'len' bytes of the buffer at 'fileOffset', at the current position when 'fileOffset' is omitted
+ */
+int writefrom(lua_State* L);
+
+/* Vectored versions of readinto and writefrom, take a file handle, an array of buffers and fileOffset: number? */
+int readvinto(lua_State* L);
+int writevfrom(lua_State* L);
+
+/* Writes out data held back by small writes to a file handle */
+int flush(lua_State* L);
+
 /* takes a file handle into a string and then closes it */
 int close(lua_State* L);
 
 /* reads a whole file into a string and then closes it */
 int readfiletostring(lua_State* L);
-/* writes a st */
+/* reads a whole file into a buffer and then closes it */
+int readfiletobuffer(lua_State* L);
+/* writes a string or a buffer to a file, replacing its contents */
 int writestringtofile(lua_State* L);
 
-/* Reads a file without blocking */
+/* Reads a whole file by path, or the rest of a file handle, into a string without blocking */
 int readasync(lua_State* L);
+/* Reads a whole file by path, or the rest of a file handle, into a buffer without blocking */
+int readtobufferasync(lua_State* L);
+
+/* Async versions of the functions above, they yield until the operation completes on the threadpool */
+int openasync(lua_State* L);
+int writeasync(lua_State* L);
+int flushasync(lua_State* L);
+int closeasync(lua_State* L);
+int removeasync(lua_State* L);
+int mkdirasync(lua_State* L);
+int rmdirasync(lua_State* L);
+int typeasync(lua_State* L);
+int writestringtofileasync(lua_State* L);
+
+/* Takes src: string, dst: string and an optional options table {reflink: boolean | 'force', progress: ((copied, total) -> ())?}
+   Copies a file without passing its contents through Luau, sharing the blocks of the source when a reflink is possible
+ */
+int copy(lua_State* L);
+
+/* Takes in, out (file handles or descriptors), offset: number?, len: number? and progress: ((sent, total) -> ())?
+   Copies 'len' bytes (defaulting to the rest of the file) from 'offset' in 'in' to 'out' in the kernel, returns the byte count
+ */
+int sendfile(lua_State* L);
 
 /* Removes a file */
 int fs_remove(lua_State* L);
@@ -49,24 +105,68 @@ int type(lua_State* L);
 /* Lists the contents of a directory */
 int listdir(lua_State* L);
 
+/* Returns the descriptor of the open file handle at 'idx' with its buffered writes flushed, or -1 for other values
+   Lets other libraries read and write files opened by fs directly
+ */
+int toFileDescriptor(lua_State* L, int idx);
+
 static const luaL_Reg lib[] = {
     /* Manual control apis - you are responsible for calling close / open*/
     {"open", open},
     {"read", read},
+    {"readtobuffer", readtobuffer},
     {"write", write},
+    {"readinto", readinto},
+    {"writefrom", writefrom},
+    {"readvinto", readvinto},
+    {"writevfrom", writevfrom},
+    {"flush", flush},
     {"close", close},
 
     {"remove", fs_remove},
 
     {"type", type},
+    {"stat", stat},
+    {"statmany", statmany},
+    {"statcache", statcache},
+    {"readfiles", readfiles},
+    {"writefiles", writefiles},
+    {"iobackend", iobackend},
 
     {"mkdir", fs_mkdir},
     {"listdir", listdir},
+    {"opendir", opendir},
+    {"walk", walk},
+    {"watch", watch},
     {"rmdir", fs_rmdir},
 
     {"readfiletostring", readfiletostring},
+    {"readfiletobuffer", readfiletobuffer},
     {"writestringtofile", writestringtofile},
+    {"writeatomic", writeatomic},
     {"readasync", readasync},
+
+    /* Async apis - these yield the calling coroutine, so that slow disks don't stall the runtime */
+    {"openasync", openasync},
+    {"readtobufferasync", readtobufferasync},
+    {"writeasync", writeasync},
+    {"flushasync", flushasync},
+    {"closeasync", closeasync},
+    {"removeasync", removeasync},
+    {"typeasync", typeasync},
+    {"mkdirasync", mkdirasync},
+    {"rmdirasync", rmdirasync},
+    {"writestringtofileasync", writestringtofileasync},
+    {"copy", copy},
+    {"sendfile", sendfile},
+
+    /* Memory mapped access - the returned mapping is read in place without copying the file */
+    {"map", map},
+
+    /* Streaming reads - the file is read ahead in fixed size chunks */
+    {"stream", stream},
+    /* Buffered writes - small writes are batched together and written on the threadpool */
+    {"writer", writer},
     {NULL, NULL},
 };
 
@@ -0,0 +1,13 @@
+#pragma once
+
+struct lua_State;
+
+namespace fs
+{
+
+/* Takes path: string, mode: 'r|w' (defaulting to r) and an optional access hint: 'normal|sequential|random|willneed'
+   Returns a handle to a memory mapping of the whole file which is read from (and written to in 'w' mode) in place
+ */
+int map(lua_State* L);
+
+} // namespace fs
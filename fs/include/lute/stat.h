@@ -0,0 +1,33 @@
+#pragma once
+
+#include "uv.h"
+
+struct lua_State;
+
+namespace fs
+{
+
+/* Stats 'path', answering from the metadata cache when it is enabled
+   Returns 0 and fills 'statbuf' on success, otherwise a libuv error code
+ */
+int statPath(const char* path, uv_stat_t* statbuf);
+
+/* Takes path: string
+   Returns a table with the type, size, mode and access, modification, change and birth times (in seconds) of the path
+ */
+int stat(lua_State* L);
+
+/* Takes paths: {string}
+   Yields until every path has been stat'ed on the threadpool, returns an array of stat tables with false for paths which failed
+ */
+int statmany(lua_State* L);
+
+/* Takes enabled: boolean?
+   Enables or disables (and clears) the process-wide metadata cache used by stat, statmany and type
+   Entries are dropped once the watcher thread sees the directory holding them change, so a stat right after a change can
+   still return the old metadata, and renames of their ancestor directories are not observed
+   Returns a table with the counters of the cache
+ */
+int statcache(lua_State* L);
+
+} // namespace fs
@@ -0,0 +1,14 @@
+#pragma once
+
+struct lua_State;
+
+namespace fs
+{
+
+/* Takes path: string and an optional options table {chunkSize: number?, readahead: number?}
+   Returns a stream reading the file in chunks, with up to 'readahead' chunk reads in flight on the threadpool
+   Memory use is bounded by chunkSize * readahead regardless of the file size
+ */
+int stream(lua_State* L);
+
+} // namespace fs
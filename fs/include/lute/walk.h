@@ -0,0 +1,14 @@
+#pragma once
+
+struct lua_State;
+
+namespace fs
+{
+
+/* Takes root: string and an optional options table {glob: string?, maxDepth: number?, followLinks: boolean?, batchSize: number?}
+   Returns a walker which traverses the tree on the threadpool and hands back matching entries in batches
+   A glob without '/' is matched against entry names, otherwise against the path relative to the root
+ */
+int walk(lua_State* L);
+
+} // namespace fs
@@ -0,0 +1,14 @@
+#pragma once
+
+struct lua_State;
+
+namespace fs
+{
+
+/* Takes path: string and an optional options table {recursive: boolean?, debounce: number?}
+   Returns a watcher whose 'next' method yields until a burst of changes has been quiet for 'debounce' milliseconds
+   and returns the changes as an array of {path: string, event: "rename" | "change"}, with one entry per changed path
+ */
+int watch(lua_State* L);
+
+} // namespace fs
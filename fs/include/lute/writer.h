@@ -0,0 +1,13 @@
+#pragma once
+
+struct lua_State;
+
+namespace fs
+{
+
+/* Takes path: string and an optional options table {bufferSize: number?, append: boolean?}
+   Returns a writer which collects strings and buffers in memory and writes them out in batches on the threadpool
+ */
+int writer(lua_State* L);
+
+} // namespace fs
@@ -0,0 +1,371 @@
+#include "lute/atomicwrite.h"
+
+#include "lua.h"
+#include "lualib.h"
+#include "uv.h"
+
+#include "lute/ref.h"
+#include "lute/runtime.h"
+
+#include <algorithm>
+#include <atomic>
+#include <cerrno>
+#include <filesystem>
+#include <map>
+#include <memory>
+#include <string>
+#include <utility>
+#include <vector>
+
+#ifdef __linux__
+#include <unistd.h>
+#endif
+
+namespace fs
+{
+
+static const char* kCommitQueueKey = "fs.commitqueue";
+
+// Files of a group on the same file system are flushed with a single syncfs once there are this many of them
+constexpr size_t kSyncfsThreshold = 4;
+
+struct AtomicWrite
+{
+    std::string path;
+    bool fsync = true;
+
+    // The data is written straight from the Luau object, which is pinned until the group is released on the loop thread
+    const char* data = nullptr;
+    size_t size = 0;
+    std::shared_ptr<Ref> pinned;
+
+    ResumeToken token;
+
+    std::string temporary;
+    uv_file fd = -1;
+    uint64_t device = 0;
+    std::string error;
+};
+
+using CommitGroup = std::vector<AtomicWrite>;
+
+// Atomic writes of a runtime, at most one group is committed at a time and the next one collects writes meanwhile
+struct CommitQueue
+{
+    Runtime* runtime = nullptr;
+
+    CommitGroup pending;
+    bool committing = false;
+    bool scheduled = false;
+};
+
+using CommitQueuePtr = std::shared_ptr<CommitQueue>;
+
+static std::atomic<uint64_t> temporaryCounter = 0;
+
+static std::string temporaryPath(const std::string& path)
+{
+    std::filesystem::path target(path);
+
+    std::string name = "." + target.filename().string() + ".tmp." + std::to_string(uv_os_getpid()) + "." +
+                       std::to_string(temporaryCounter.fetch_add(1));
+
+    return (target.parent_path() / name).string();
+}
+
+static std::string directoryOf(const std::string& path)
+{
+    std::string dir = std::filesystem::path(path).parent_path().string();
+    return dir.empty() ? "." : dir;
+}
+
+static int writeAll(uv_file fd, const char* data, size_t size)
+{
+    size_t total = 0;
+
+    while (total < size)
+    {
+        uv_buf_t iov = uv_buf_init(const_cast<char*>(data) + total, unsigned(std::min(size - total, size_t(INT32_MAX))));
+
+        uv_fs_t req;
+        int written = uv_fs_write(nullptr, &req, fd, &iov, 1, -1, nullptr);
+        uv_fs_req_cleanup(&req);
+
+        if (written < 0)
+            return written;
+
+        total += written;
+    }
+
+    return 0;
+}
+
+static void fail(AtomicWrite& write, const char* action, int err)
+{
+    if (write.error.empty())
+        write.error = std::string("Error ") + action + " " + write.path + ": " + uv_strerror(err);
+}
+
+static void closeFile(AtomicWrite& write)
+{
+    if (write.fd < 0)
+        return;
+
+    uv_fs_t req;
+    int err = uv_fs_close(nullptr, &req, write.fd, nullptr);
+    uv_fs_req_cleanup(&req);
+
+    write.fd = -1;
+
+    if (err < 0)
+        fail(write, "writing", err);
+}
+
+// Writes the data of every file of the group to its temporary file, the files stay open until they are flushed
+static void writeTemporary(AtomicWrite& write)
+{
+    // Replacements keep the permissions of the file they replace
+    int mode = 0666;
+
+    uv_fs_t req;
+
+    if (uv_fs_stat(nullptr, &req, write.path.c_str(), nullptr) == 0)
+        mode = int(req.statbuf.st_mode & 07777);
+
+    uv_fs_req_cleanup(&req);
+
+    write.temporary = temporaryPath(write.path);
+
+    int fd = uv_fs_open(nullptr, &req, write.temporary.c_str(), UV_FS_O_WRONLY | UV_FS_O_CREAT | UV_FS_O_EXCL, mode, nullptr);
+    uv_fs_req_cleanup(&req);
+
+    if (fd < 0)
+    {
+        write.temporary.clear();
+        return fail(write, "creating a temporary file for", fd);
+    }
+
+    write.fd = fd;
+
+    if (int err = writeAll(fd, write.data, write.size))
+        return fail(write, "writing", err);
+
+    if (uv_fs_fstat(nullptr, &req, fd, nullptr) == 0)
+        write.device = req.statbuf.st_dev;
+
+    uv_fs_req_cleanup(&req);
+}
+
+static void fsyncFile(AtomicWrite& write)
+{
+    uv_fs_t req;
+    int err = uv_fs_fsync(nullptr, &req, write.fd, nullptr);
+    uv_fs_req_cleanup(&req);
+
+    if (err < 0)
+        fail(write, "flushing", err);
+}
+
+// Flushes the temporary files, sharing one syncfs between the files of a device when the group is large enough
+static void flushTemporary(CommitGroup& group)
+{
+    std::map<uint64_t, std::vector<AtomicWrite*>> devices;
+
+    for (AtomicWrite& write : group)
+    {
+        if (write.fsync && write.fd >= 0 && write.error.empty())
+            devices[write.device].push_back(&write);
+    }
+
+    for (auto& [_, writes] : devices)
+    {
+#ifdef __linux__
+        if (writes.size() >= kSyncfsThreshold)
+        {
+            if (syncfs(writes.front()->fd) != 0)
+            {
+                int err = uv_translate_sys_error(errno);
+
+                for (AtomicWrite* write : writes)
+                    fail(*write, "flushing", err);
+            }
+
+            continue;
+        }
+#endif
+
+        for (AtomicWrite* write : writes)
+            fsyncFile(*write);
+    }
+}
+
+static void fsyncDirectory(const std::string& dir, std::vector<AtomicWrite*>& writes)
+{
+#ifndef _WIN32
+    uv_fs_t req;
+    int fd = uv_fs_open(nullptr, &req, dir.c_str(), UV_FS_O_RDONLY, 0, nullptr);
+    uv_fs_req_cleanup(&req);
+
+    int err = fd;
+
+    if (fd >= 0)
+    {
+        err = uv_fs_fsync(nullptr, &req, fd, nullptr);
+        uv_fs_req_cleanup(&req);
+
+        uv_fs_close(nullptr, &req, fd, nullptr);
+        uv_fs_req_cleanup(&req);
+    }
+
+    if (err < 0)
+    {
+        for (AtomicWrite* write : writes)
+            fail(*write, "flushing the directory of", err);
+    }
+#endif
+}
+
+// Runs on the threadpool
+static void commitGroup(CommitGroup& group)
+{
+    for (AtomicWrite& write : group)
+        writeTemporary(write);
+
+    flushTemporary(group);
+
+    for (AtomicWrite& write : group)
+        closeFile(write);
+
+    std::map<std::string, std::vector<AtomicWrite*>> directories;
+
+    for (AtomicWrite& write : group)
+    {
+        uv_fs_t req;
+
+        if (write.error.empty())
+        {
+            int err = uv_fs_rename(nullptr, &req, write.temporary.c_str(), write.path.c_str(), nullptr);
+            uv_fs_req_cleanup(&req);
+
+            if (err < 0)
+                fail(write, "replacing", err);
+        }
+
+        if (!write.error.empty())
+        {
+            if (!write.temporary.empty())
+            {
+                uv_fs_unlink(nullptr, &req, write.temporary.c_str(), nullptr);
+                uv_fs_req_cleanup(&req);
+            }
+
+            continue;
+        }
+
+        // The rename is only durable once the directory holding the file is flushed, once for all of its files
+        if (write.fsync)
+            directories[directoryOf(write.path)].push_back(&write);
+    }
+
+    for (auto& [dir, writes] : directories)
+        fsyncDirectory(dir, writes);
+}
+
+static void submitGroup(const CommitQueuePtr& queue)
+{
+    if (queue->committing || queue->pending.empty())
+        return;
+
+    queue->committing = true;
+
+    auto group = std::make_shared<CommitGroup>(std::move(queue->pending));
+    queue->pending.clear();
+
+    Runtime* runtime = queue->runtime;
+
+    runtime->runInWorkQueue([queue, group] {
+        commitGroup(*group);
+
+        for (AtomicWrite& write : *group)
+        {
+            if (write.error.empty())
+                write.token->complete([](lua_State*) {
+                    return 0;
+                });
+            else
+                write.token->fail(write.error);
+        }
+
+        // Writes which arrived while this group was committed go out together as the next group
+        queue->runtime->schedule([queue] {
+            queue->committing = false;
+            submitGroup(queue);
+        });
+    });
+}
+
+static CommitQueuePtr& getCommitQueue(lua_State* L)
+{
+    lua_getfield(L, LUA_REGISTRYINDEX, kCommitQueueKey);
+
+    if (lua_isnil(L, -1))
+    {
+        lua_pop(L, 1);
+
+        CommitQueuePtr* queue = (CommitQueuePtr*)lua_newuserdatadtor(L, sizeof(CommitQueuePtr), [](void* userdata) {
+            ((CommitQueuePtr*)userdata)->~CommitQueuePtr();
+        });
+
+        new (queue) CommitQueuePtr(std::make_shared<CommitQueue>());
+        (*queue)->runtime = getRuntime(L);
+
+        lua_pushvalue(L, -1);
+        lua_setfield(L, LUA_REGISTRYINDEX, kCommitQueueKey);
+    }
+
+    CommitQueuePtr& queue = *(CommitQueuePtr*)lua_touserdata(L, -1);
+    lua_pop(L, 1);
+
+    return queue;
+}
+
+int writeatomic(lua_State* L)
+{
+    AtomicWrite write;
+    write.path = luaL_checkstring(L, 1);
+
+    if (lua_isbuffer(L, 2))
+        write.data = (const char*)lua_tobuffer(L, 2, &write.size);
+    else
+        write.data = luaL_checklstring(L, 2, &write.size);
+
+    if (!lua_isnoneornil(L, 3))
+    {
+        luaL_checktype(L, 3, LUA_TTABLE);
+
+        lua_getfield(L, 3, "fsync");
+        write.fsync = lua_isnil(L, -1) || lua_toboolean(L, -1);
+        lua_pop(L, 1);
+    }
+
+    write.pinned = std::make_shared<Ref>(L, 2);
+    write.token = getResumeToken(L);
+
+    CommitQueuePtr& queue = getCommitQueue(L);
+    queue->pending.push_back(std::move(write));
+
+    // Other writes made before the loop comes around join the same group
+    if (!queue->committing && !queue->scheduled)
+    {
+        queue->scheduled = true;
+
+        queue->runtime->schedule([queue = queue] {
+            queue->scheduled = false;
+            submitGroup(queue);
+        });
+    }
+
+    return lua_yield(L, 0);
+}
+
+} // namespace fs
@@ -0,0 +1,378 @@
+#include "lute/batch.h"
+
+#include "lua.h"
+#include "lualib.h"
+#include "uv.h"
+
+#include "lute/ref.h"
+#include "lute/runtime.h"
+
+#include <algorithm>
+#include <cstring>
+#include <memory>
+#include <string>
+#include <utility>
+#include <vector>
+
+namespace fs
+{
+
+// Files worked on at the same time, small enough that their requests fit in the libuv ring and don't run out of descriptors
+constexpr size_t kMaxFilesInFlight = 32;
+// Read size used when a file turns out to be larger than fstat reported, or has no size (like pipes)
+constexpr size_t kReadGrowth = 64 * 1024;
+
+enum class FileStep
+{
+    Open,
+    Stat,
+    Read,
+    Write,
+    Close,
+};
+
+struct FileBatch
+{
+    uv_loop_t* loop = nullptr;
+    ResumeToken token;
+
+    bool writing = false;
+    bool asBuffer = false;
+
+    std::vector<std::string> paths;
+
+    // Contents of writes point into the Luau strings and buffers, which are kept alive by the pinned table
+    std::shared_ptr<Ref> pinned;
+    std::vector<std::pair<const char*, size_t>> contents;
+
+    std::vector<std::vector<char>> data;
+    std::vector<int> errors;
+
+    size_t next = 0;
+    size_t active = 0;
+    size_t finished = 0;
+};
+
+using FileBatchPtr = std::shared_ptr<FileBatch>;
+
+// One file of a batch, stepping through its requests from the loop callbacks
+struct FileRequest
+{
+    uv_fs_t req;
+    FileBatchPtr batch;
+    size_t index = 0;
+
+    FileStep step = FileStep::Open;
+    uv_file fd = -1;
+    int err = 0;
+
+    std::vector<char> data;
+    size_t done = 0;
+};
+
+static void startFiles(const FileBatchPtr& batch);
+static void onStep(uv_fs_t* req);
+
+static void completeBatch(const FileBatchPtr& batch)
+{
+    batch->token->complete([batch](lua_State* L) {
+        size_t count = batch->paths.size();
+
+        lua_createtable(L, int(count), 0);
+
+        for (size_t i = 0; i < count; i++)
+        {
+            if (batch->errors[i] != 0)
+            {
+                lua_pushboolean(L, false);
+            }
+            else if (batch->writing)
+            {
+                lua_pushboolean(L, true);
+            }
+            else
+            {
+                std::vector<char>& data = batch->data[i];
+
+                if (batch->asBuffer)
+                {
+                    void* buffer = lua_newbuffer(L, data.size());
+
+                    if (!data.empty())
+                        memcpy(buffer, data.data(), data.size());
+                }
+                else
+                {
+                    lua_pushlstring(L, data.data(), data.size());
+                }
+
+                data = {};
+            }
+
+            lua_rawseti(L, -2, int(i + 1));
+        }
+
+        return 1;
+    });
+}
+
+static void finishFile(FileRequest* request)
+{
+    FileBatchPtr batch = std::move(request->batch);
+
+    batch->errors[request->index] = request->err;
+
+    if (!batch->writing && request->err == 0)
+        batch->data[request->index] = std::move(request->data);
+
+    delete request;
+
+    batch->active--;
+    batch->finished++;
+
+    if (batch->finished == batch->paths.size())
+        completeBatch(batch);
+    else
+        startFiles(batch);
+}
+
+// Submits the next request of a file, the file is finished right away if the request can't be submitted
+static void submit(FileRequest* request)
+{
+    FileBatch& batch = *request->batch;
+    uv_fs_t* req = &request->req;
+
+    int err = 0;
+
+    switch (request->step)
+    {
+    case FileStep::Open:
+    {
+        int flags = batch.writing ? UV_FS_O_WRONLY | UV_FS_O_CREAT | UV_FS_O_TRUNC : UV_FS_O_RDONLY;
+        err = uv_fs_open(batch.loop, req, batch.paths[request->index].c_str(), flags, 0666, onStep);
+        break;
+    }
+    case FileStep::Stat:
+        err = uv_fs_fstat(batch.loop, req, request->fd, onStep);
+        break;
+    case FileStep::Read:
+    {
+        if (request->done == request->data.size())
+            request->data.resize(request->data.size() + kReadGrowth);
+
+        uv_buf_t buf = uv_buf_init(request->data.data() + request->done, unsigned(request->data.size() - request->done));
+        err = uv_fs_read(batch.loop, req, request->fd, &buf, 1, int64_t(request->done), onStep);
+        break;
+    }
+    case FileStep::Write:
+    {
+        auto [source, size] = batch.contents[request->index];
+
+        uv_buf_t buf = uv_buf_init(const_cast<char*>(source) + request->done, unsigned(size - request->done));
+        err = uv_fs_write(batch.loop, req, request->fd, &buf, 1, int64_t(request->done), onStep);
+        break;
+    }
+    case FileStep::Close:
+        err = uv_fs_close(batch.loop, req, request->fd, onStep);
+        break;
+    }
+
+    if (err < 0)
+    {
+        if (request->err == 0)
+            request->err = err;
+
+        if (request->step != FileStep::Close && request->fd >= 0)
+        {
+            request->step = FileStep::Close;
+            submit(request);
+            return;
+        }
+
+        finishFile(request);
+    }
+}
+
+static void onStep(uv_fs_t* req)
+{
+    FileRequest* request = (FileRequest*)req->data;
+    FileBatch& batch = *request->batch;
+
+    ssize_t result = req->result;
+    uint64_t size = req->statbuf.st_size;
+
+    uv_fs_req_cleanup(req);
+
+    // Failures skip straight to closing the file
+    if (result < 0)
+    {
+        if (request->err == 0)
+            request->err = int(result);
+
+        if (request->step == FileStep::Open || request->step == FileStep::Close)
+        {
+            finishFile(request);
+            return;
+        }
+
+        request->step = FileStep::Close;
+        submit(request);
+        return;
+    }
+
+    switch (request->step)
+    {
+    case FileStep::Open:
+        request->fd = uv_file(result);
+        request->step = batch.writing ? FileStep::Write : FileStep::Stat;
+
+        if (batch.writing && batch.contents[request->index].second == 0)
+            request->step = FileStep::Close;
+        break;
+    case FileStep::Stat:
+        // One byte more than the file size lets the first read reach the end of the file
+        request->data.resize(size + 1);
+        request->step = FileStep::Read;
+        break;
+    case FileStep::Read:
+        request->done += result;
+
+        // Short reads mean the end of the file was reached
+        if (result == 0 || request->done < request->data.size())
+        {
+            request->data.resize(request->done);
+            request->step = FileStep::Close;
+        }
+        break;
+    case FileStep::Write:
+        request->done += result;
+
+        if (request->done == batch.contents[request->index].second)
+            request->step = FileStep::Close;
+        break;
+    case FileStep::Close:
+        finishFile(request);
+        return;
+    }
+
+    submit(request);
+}
+
+static void startFiles(const FileBatchPtr& batch)
+{
+    while (batch->active < kMaxFilesInFlight && batch->next < batch->paths.size())
+    {
+        FileRequest* request = new FileRequest();
+        request->req.data = request;
+        request->batch = batch;
+        request->index = batch->next++;
+
+        batch->active++;
+
+        submit(request);
+    }
+}
+
+static FileBatchPtr checkPaths(lua_State* L, int idx)
+{
+    luaL_checktype(L, idx, LUA_TTABLE);
+
+    auto batch = std::make_shared<FileBatch>();
+
+    size_t count = lua_objlen(L, idx);
+    batch->paths.reserve(count);
+
+    for (size_t i = 0; i < count; i++)
+    {
+        lua_rawgeti(L, idx, int(i + 1));
+
+        if (!lua_isstring(L, -1))
+            luaL_argerror(L, idx, "expected an array of paths");
+
+        batch->paths.push_back(lua_tostring(L, -1));
+        lua_pop(L, 1);
+    }
+
+    batch->data.resize(count);
+    batch->errors.resize(count);
+
+    return batch;
+}
+
+static int runBatch(lua_State* L, FileBatchPtr batch)
+{
+    if (batch->paths.empty())
+    {
+        lua_createtable(L, 0, 0);
+        return 1;
+    }
+
+    batch->loop = &getRuntime(L)->loop;
+    batch->token = getResumeToken(L);
+
+    startFiles(batch);
+
+    return lua_yield(L, 0);
+}
+
+int readfiles(lua_State* L)
+{
+    FileBatchPtr batch = checkPaths(L, 1);
+
+    if (!lua_isnoneornil(L, 2))
+    {
+        luaL_checktype(L, 2, LUA_TTABLE);
+
+        lua_getfield(L, 2, "buffers");
+        batch->asBuffer = lua_toboolean(L, -1);
+        lua_pop(L, 1);
+    }
+
+    return runBatch(L, std::move(batch));
+}
+
+int writefiles(lua_State* L)
+{
+    FileBatchPtr batch = checkPaths(L, 1);
+    luaL_checktype(L, 2, LUA_TTABLE);
+
+    size_t count = batch->paths.size();
+    luaL_argcheck(L, lua_objlen(L, 2) == int(count), 2, "expected as many contents as paths");
+
+    batch->writing = true;
+    batch->contents.reserve(count);
+
+    // The writes point into the strings and buffers themselves, so those are pinned rather than the caller's table
+    lua_createtable(L, int(count), 0);
+
+    for (size_t i = 0; i < count; i++)
+    {
+        lua_rawgeti(L, 2, int(i + 1));
+
+        size_t len = 0;
+        const char* data = nullptr;
+
+        if (lua_isbuffer(L, -1))
+            data = (const char*)lua_tobuffer(L, -1, &len);
+        else if (lua_type(L, -1) == LUA_TSTRING)
+            data = lua_tolstring(L, -1, &len);
+        else
+            luaL_argerror(L, 2, "expected an array of strings or buffers");
+
+        batch->contents.emplace_back(data, len);
+        lua_rawseti(L, -2, int(i + 1));
+    }
+
+    batch->pinned = std::make_shared<Ref>(L, -1);
+    lua_pop(L, 1);
+
+    return runBatch(L, std::move(batch));
+}
+
+int iobackend(lua_State* L)
+{
+    lua_pushstring(L, getRuntime(L)->ioUring ? "io_uring" : "threadpool");
+    return 1;
+}
+
+} // namespace fs
@@ -0,0 +1,339 @@
+#include "lute/directory.h"
+
+#include "lua.h"
+#include "lualib.h"
+#include "uv.h"
+
+#include "lute/runtime.h"
+
+#include <memory>
+#include <string>
+#include <utility>
+#include <vector>
+
+namespace fs
+{
+
+extern const char* UV_DIRENT_TYPES[];
+
+static const char* kDirectoryType = "Directory";
+
+constexpr int kDefaultDirectoryBatchSize = 256;
+
+struct DirectoryState
+{
+    ~DirectoryState()
+    {
+        if (dir)
+        {
+            uv_fs_t closeReq;
+            uv_fs_closedir(nullptr, &closeReq, dir, nullptr);
+            uv_fs_req_cleanup(&closeReq);
+        }
+    }
+
+    uv_dir_t* dir = nullptr;
+    std::vector<uv_dirent_t> entries;
+
+    // Return names and types as two arrays instead of a table per entry
+    bool arrays = false;
+    bool reading = false;
+
+    // Entries read ahead by the 'entries' iterator
+    std::vector<std::pair<std::string, uv_dirent_type_t>> pending;
+    size_t cursor = 0;
+};
+
+using DirectoryPtr = std::shared_ptr<DirectoryState>;
+
+struct DirectoryRequest
+{
+    ResumeToken token;
+    DirectoryPtr state;
+    std::string path;
+};
+
+static DirectoryPtr& checkDirectory(lua_State* L, int idx)
+{
+    DirectoryPtr& state = *(DirectoryPtr*)luaL_checkudata(L, idx, kDirectoryType);
+
+    if (!state->dir)
+        luaL_error(L, "directory is closed");
+
+    if (state->reading)
+        luaL_error(L, "directory is already being read by another coroutine");
+
+    return state;
+}
+
+// Pushes the entries of a finished readdir request, as {name, type} tables or as parallel name and type arrays
+static int pushEntries(lua_State* L, const DirectoryState& state, int count)
+{
+    if (count == 0)
+    {
+        lua_pushnil(L);
+        return 1;
+    }
+
+    if (state.arrays)
+    {
+        lua_createtable(L, count, 0);
+
+        for (int i = 0; i < count; i++)
+        {
+            lua_pushstring(L, state.entries[i].name);
+            lua_rawseti(L, -2, i + 1);
+        }
+
+        lua_createtable(L, count, 0);
+
+        for (int i = 0; i < count; i++)
+        {
+            lua_pushstring(L, UV_DIRENT_TYPES[state.entries[i].type]);
+            lua_rawseti(L, -2, i + 1);
+        }
+
+        return 2;
+    }
+
+    lua_createtable(L, count, 0);
+
+    for (int i = 0; i < count; i++)
+    {
+        lua_createtable(L, 0, 2);
+
+        lua_pushstring(L, state.entries[i].name);
+        lua_setfield(L, -2, "name");
+
+        lua_pushstring(L, UV_DIRENT_TYPES[state.entries[i].type]);
+        lua_setfield(L, -2, "type");
+
+        lua_rawseti(L, -2, i + 1);
+    }
+
+    return 1;
+}
+
+static void prepareRead(DirectoryState& state)
+{
+    state.dir->dirents = state.entries.data();
+    state.dir->nentries = state.entries.size();
+}
+
+/* Yields until the next batch of entries is read, returns nil once the directory has been read to the end */
+static int directoryRead(lua_State* L)
+{
+    DirectoryPtr& state = checkDirectory(L, 1);
+
+    prepareRead(*state);
+
+    uv_fs_t* req = new uv_fs_t();
+    req->data = new DirectoryRequest{getResumeToken(L), state, {}};
+
+    state->reading = true;
+
+    int err = uv_fs_readdir(&getRuntime(L)->loop, req, state->dir, [](uv_fs_t* req) {
+        DirectoryRequest* request = (DirectoryRequest*)req->data;
+
+        if (req->result < 0)
+        {
+            request->token->fail(uv_strerror(int(req->result)));
+
+            uv_fs_req_cleanup(req);
+            request->state->reading = false;
+
+            delete request;
+            delete req;
+            return;
+        }
+
+        // Entry names belong to the request and the cleanup goes through the directory, so the directory stays
+        // marked as being read until they are pushed, which keeps other coroutines from closing or reading it
+        request->token->complete([req](lua_State* L) {
+            DirectoryRequest* request = (DirectoryRequest*)req->data;
+
+            int results = pushEntries(L, *request->state, int(req->result));
+
+            uv_fs_req_cleanup(req);
+            request->state->reading = false;
+
+            delete request;
+            delete req;
+
+            return results;
+        });
+    });
+
+    if (err < 0)
+    {
+        state->reading = false;
+
+        DirectoryRequest* request = (DirectoryRequest*)req->data;
+        request->token->fail(uv_strerror(err));
+
+        delete request;
+        delete req;
+    }
+
+    return lua_yield(L, 0);
+}
+
+static int entriesIterator(lua_State* L)
+{
+    DirectoryPtr& state = checkDirectory(L, lua_upvalueindex(1));
+
+    if (state->cursor == state->pending.size())
+    {
+        state->pending.clear();
+        state->cursor = 0;
+
+        // Iterators can't yield, so the next batch is read synchronously
+        prepareRead(*state);
+
+        uv_fs_t readReq;
+        int count = uv_fs_readdir(nullptr, &readReq, state->dir, nullptr);
+
+        for (int i = 0; i < count; i++)
+            state->pending.emplace_back(state->entries[i].name, state->entries[i].type);
+
+        uv_fs_req_cleanup(&readReq);
+
+        if (count < 0)
+            luaL_error(L, "Error reading directory: %s", uv_strerror(count));
+
+        if (count == 0)
+            return 0;
+    }
+
+    auto& [name, type] = state->pending[state->cursor++];
+
+    lua_pushlstring(L, name.data(), name.size());
+    lua_pushstring(L, UV_DIRENT_TYPES[type]);
+    return 2;
+}
+
+static int directoryEntries(lua_State* L)
+{
+    checkDirectory(L, 1);
+
+    lua_pushvalue(L, 1);
+    lua_pushcclosure(L, entriesIterator, "entries", 1);
+    return 1;
+}
+
+static int directoryClose(lua_State* L)
+{
+    DirectoryPtr& state = *(DirectoryPtr*)luaL_checkudata(L, 1, kDirectoryType);
+
+    if (state->reading)
+        luaL_error(L, "directory is being read by another coroutine");
+
+    if (state->dir)
+    {
+        uv_fs_t closeReq;
+        uv_fs_closedir(nullptr, &closeReq, state->dir, nullptr);
+        uv_fs_req_cleanup(&closeReq);
+
+        state->dir = nullptr;
+    }
+
+    return 0;
+}
+
+static void pushDirectoryMetatable(lua_State* L)
+{
+    if (luaL_newmetatable(L, kDirectoryType))
+    {
+        lua_createtable(L, 0, 3);
+
+        lua_pushcfunction(L, directoryRead, "read");
+        lua_setfield(L, -2, "read");
+
+        lua_pushcfunction(L, directoryEntries, "entries");
+        lua_setfield(L, -2, "entries");
+
+        lua_pushcfunction(L, directoryClose, "close");
+        lua_setfield(L, -2, "close");
+
+        lua_setreadonly(L, -1, 1);
+        lua_setfield(L, -2, "__index");
+
+        lua_pushstring(L, kDirectoryType);
+        lua_setfield(L, -2, "__type");
+
+        lua_setreadonly(L, -1, 1);
+    }
+}
+
+int opendir(lua_State* L)
+{
+    std::string path = luaL_checkstring(L, 1);
+
+    int batchSize = kDefaultDirectoryBatchSize;
+    bool arrays = false;
+
+    if (!lua_isnoneornil(L, 2))
+    {
+        luaL_checktype(L, 2, LUA_TTABLE);
+
+        lua_getfield(L, 2, "batchSize");
+        if (!lua_isnil(L, -1))
+            batchSize = luaL_checkinteger(L, -1);
+        lua_pop(L, 1);
+
+        lua_getfield(L, 2, "arrays");
+        arrays = lua_toboolean(L, -1);
+        lua_pop(L, 1);
+
+        luaL_argcheck(L, batchSize > 0, 2, "batchSize must be positive");
+    }
+
+    auto state = std::make_shared<DirectoryState>();
+    state->entries.resize(batchSize);
+    state->arrays = arrays;
+
+    uv_fs_t* req = new uv_fs_t();
+    req->data = new DirectoryRequest{getResumeToken(L), state, path};
+
+    int err = uv_fs_opendir(&getRuntime(L)->loop, req, path.c_str(), [](uv_fs_t* req) {
+        DirectoryRequest* request = (DirectoryRequest*)req->data;
+
+        if (req->result < 0)
+            request->token->fail("Error opening directory " + request->path + ": " + uv_strerror(int(req->result)));
+        else
+            request->state->dir = (uv_dir_t*)req->ptr;
+
+        if (req->result >= 0)
+        {
+            request->token->complete([state = std::move(request->state)](lua_State* L) {
+                DirectoryPtr* result = (DirectoryPtr*)lua_newuserdatadtor(L, sizeof(DirectoryPtr), [](void* userdata) {
+                    ((DirectoryPtr*)userdata)->~DirectoryPtr();
+                });
+
+                new (result) DirectoryPtr(state);
+
+                pushDirectoryMetatable(L);
+                lua_setmetatable(L, -2);
+
+                return 1;
+            });
+        }
+
+        uv_fs_req_cleanup(req);
+        delete request;
+        delete req;
+    });
+
+    if (err < 0)
+    {
+        DirectoryRequest* request = (DirectoryRequest*)req->data;
+        request->token->fail("Error opening directory " + path + ": " + uv_strerror(err));
+
+        delete request;
+        delete req;
+    }
+
+    return lua_yield(L, 0);
+}
+
+} // namespace fs
@@ -6,17 +6,22 @@
 
 #include "lute/runtime.h"
 
+#include <atomic>
 #include <cstdio>
 #include <cstring>
 #include <fcntl.h>
 #include <filesystem>
 #include <map>
 #include <memory>
+#include <mutex>
 #include <optional>
+#include <vector>
 #ifdef _WIN32
 #include <direct.h>
+#include <io.h>
 #else
 #include <sys/fcntl.h> // on mac we do this
+#include <unistd.h>
 #endif
 #include <sys/stat.h>
 #include <string>
@@ -109,133 +114,545 @@ std::optional<int> setFlags(const char* c, int* openFlags)
     return modeFlags;
 }
 
+// Userdata tags are shared by every library loaded into a VM, vm uses 1 for its cross-VM functions
+constexpr int kFileHandleTag = 2;
+
+// Writes smaller than this are collected in the handle and written together
+constexpr size_t kFileWriteBufferSize = 16 * 1024;
+
 struct FileHandle
 {
     ssize_t fileDescriptor = -1;
     int errcode = -1;
+    bool closed = false;
+
+    // Small writes are held here until it fills up, the file is read from or it is closed
+    std::vector<char> writeBuffer;
 };
 
-void setfield(lua_State* L, const char* index, int value)
+void createFileHandle(lua_State* L, FileHandle&& toCreate)
 {
-    lua_pushstring(L, index);
-    lua_pushinteger(L, value);
-    lua_settable(L, -3);
+    void* userdata = lua_newuserdatataggedwithmetatable(L, sizeof(FileHandle), kFileHandleTag);
+    new (userdata) FileHandle(std::move(toCreate));
 }
 
-void createFileHandle(lua_State* L, const FileHandle& toCreate)
+FileHandle& unpackFileHandle(lua_State* L)
 {
-    lua_newtable(L);
-    setfield(L, "fd", toCreate.fileDescriptor);
-    setfield(L, "err", toCreate.errcode);
+    FileHandle* file = (FileHandle*)lua_touserdatatagged(L, 1, kFileHandleTag);
+
+    if (!file)
+        luaL_typeerrorL(L, 1, "FileHandle");
+
+    if (file->closed)
+        luaL_errorL(L, "Error: file handle is closed\n");
+
+    return *file;
 }
 
-FileHandle unpackFileHandle(lua_State* L)
+static int writeFully(uv_file fd, const char* data, size_t size);
+
+static int flushFileHandle(FileHandle& file)
 {
-    FileHandle result;
+    if (file.writeBuffer.empty())
+        return 0;
 
-    luaL_checktype(L, 1, LUA_TTABLE);
-    lua_getfield(L, 1, "fd");
-    lua_getfield(L, 1, "err");
+    int err = writeFully(uv_file(file.fileDescriptor), file.writeBuffer.data(), file.writeBuffer.size());
+    file.writeBuffer.clear();
 
-    ssize_t fd = luaL_checkinteger(L, -2);
-    int err = luaL_checknumber(L, -1);
-    result.fileDescriptor = fd;
-    result.errcode = err;
+    return err;
+}
 
-    lua_pop(L, 2); // we got the args by value, so we can clean up the stack here
+// Writes out anything still buffered and closes the descriptor, returns the error of the final write if there was one
+static int closeFileHandle(FileHandle& file)
+{
+    int err = flushFileHandle(file);
 
-    return result;
+    uv_fs_t closeReq;
+    uv_fs_close(nullptr, &closeReq, uv_file(file.fileDescriptor), nullptr);
+    uv_fs_req_cleanup(&closeReq);
+
+    file.closed = true;
+    file.writeBuffer = {};
+
+    return err;
 }
 
 int close(lua_State* L)
 {
     lua_settop(L, 1);
-    FileHandle file = unpackFileHandle(L);
+    FileHandle& file = unpackFileHandle(L);
+
+    if (int err = closeFileHandle(file))
+        luaL_errorL(L, "Error writing to file with descriptor %zu: %s\n", file.fileDescriptor, uv_strerror(err));
 
-    uv_fs_t closeReq;
-    uv_fs_close(uv_default_loop(), &closeReq, file.fileDescriptor, nullptr);
     return 0;
 }
 
-static char readBuffer[1024];
-int read(lua_State* L)
+int flush(lua_State* L)
 {
-    memset(readBuffer, 0, sizeof(readBuffer));
-    // discard any extra arguments passed in
     lua_settop(L, 1);
-    FileHandle file = unpackFileHandle(L);
+    FileHandle& file = unpackFileHandle(L);
+
+    if (int err = flushFileHandle(file))
+        luaL_errorL(L, "Error writing to file with descriptor %zu: %s\n", file.fileDescriptor, uv_strerror(err));
+
+    return 0;
+}
+
+// Largest single read request, big enough that whole-file reads take a handful of syscalls
+constexpr size_t kMaxReadChunk = 256 * 1024 * 1024;
+// Read size used once the file is larger than fstat reported (or its size is unknown, like for pipes)
+constexpr size_t kReadChunk = 64 * 1024;
+
+// Bytes between the current position of 'fd' and the end of the file as reported by fstat, or 0 when it is unknown
+static size_t fileSizeHint(uv_file fd)
+{
+    uv_fs_t statReq;
+    int err = uv_fs_fstat(nullptr, &statReq, fd, nullptr);
+    size_t size = err == 0 && S_ISREG(statReq.statbuf.st_mode) ? size_t(statReq.statbuf.st_size) : 0;
+    uv_fs_req_cleanup(&statReq);
+
+#ifdef _WIN32
+    int64_t position = _lseeki64(fd, 0, SEEK_CUR);
+#else
+    int64_t position = lseek(fd, 0, SEEK_CUR);
+#endif
+
+    if (position < 0)
+        return size;
+
+    return size > uint64_t(position) ? size - size_t(position) : 0;
+}
+
+// Reads from the current position of 'fd' until 'size' bytes are read or the end of file is reached
+// Returns the number of bytes read or a libuv error code
+static ssize_t readFully(uv_file fd, char* data, size_t size)
+{
+    size_t total = 0;
+
+    while (total < size)
+    {
+        uv_buf_t iov = uv_buf_init(data + total, unsigned(std::min(size - total, kMaxReadChunk)));
+
+        uv_fs_t readReq;
+        ssize_t numBytesRead = uv_fs_read(nullptr, &readReq, fd, &iov, 1, -1, nullptr);
+        uv_fs_req_cleanup(&readReq);
+
+        if (numBytesRead < 0)
+            return numBytesRead;
+
+        if (numBytesRead == 0)
+            break;
+
+        total += numBytesRead;
+    }
+
+    return ssize_t(total);
+}
+
+// Reads the rest of the file into 'data', which is presized from fstat so that most files are read in a single request
+static ssize_t readToVector(uv_file fd, std::vector<char>& data)
+{
+    size_t hint = fileSizeHint(fd);
+    size_t used = 0;
 
-    int numBytesRead = 0;
-    uv_fs_t readReq;
-    uv_buf_t iov = uv_buf_init(readBuffer, sizeof(readBuffer));
-    // Output data
-    std::vector<char> resultData;
-    do
+    data.resize(hint);
+
+    for (;;)
     {
-        uv_fs_read(uv_default_loop(), &readReq, file.fileDescriptor, &iov, 1, -1, nullptr);
+        ssize_t numBytesRead = readFully(fd, data.data() + used, data.size() - used);
+
+        if (numBytesRead < 0)
+            return numBytesRead;
+
+        used += numBytesRead;
+
+        if (used < data.size())
+            break;
+
+        // The file was at least as large as expected, make room and check whether there is more
+        data.resize(data.size() + kReadChunk);
+    }
 
-        numBytesRead = readReq.result;
+    data.resize(used);
+    return ssize_t(used);
+}
+
+// Reads the rest of the file and pushes it as a string (or a buffer), reading straight into the Luau object
+// Returns 0 on success or a libuv error code, in which case the stack is left in an unspecified state
+static int pushFileContents(lua_State* L, uv_file fd, bool asBuffer)
+{
+    size_t hint = fileSizeHint(fd);
+
+    if (asBuffer)
+    {
+        char* data = (char*)lua_newbuffer(L, hint);
+        ssize_t numBytesRead = readFully(fd, data, hint);
 
         if (numBytesRead < 0)
+            return int(numBytesRead);
+
+        std::vector<char> tail;
+
+        if (size_t(numBytesRead) == hint)
+        {
+            // Probe for the end of file with a small read, only a file that grew since fstat needs the tail
+            char probe[4096];
+            ssize_t probeBytes = readFully(fd, probe, sizeof(probe));
+
+            if (probeBytes < 0)
+                return int(probeBytes);
+
+            if (probeBytes > 0)
+            {
+                tail.assign(probe, probe + probeBytes);
+
+                std::vector<char> rest;
+                ssize_t restBytes = readToVector(fd, rest);
+
+                if (restBytes < 0)
+                    return int(restBytes);
+
+                tail.insert(tail.end(), rest.begin(), rest.end());
+            }
+        }
+
+        if (size_t(numBytesRead) != hint || !tail.empty())
+        {
+            // The file changed size since fstat, move the data into a buffer of the right size
+            char* resized = (char*)lua_newbuffer(L, numBytesRead + tail.size());
+            memcpy(resized, data, numBytesRead);
+            memcpy(resized + numBytesRead, tail.data(), tail.size());
+            lua_remove(L, -2);
+        }
+
+        return 0;
+    }
+
+    luaL_Strbuf b;
+    char* data = luaL_buffinitsize(L, &b, hint);
+    ssize_t numBytesRead = readFully(fd, data, hint);
+
+    if (numBytesRead < 0)
+        return int(numBytesRead);
+
+    b.p += numBytesRead;
+
+    if (size_t(numBytesRead) == hint)
+    {
+        // Probe for the end of file separately, an exactly filled string buffer is turned into a string without a copy
+        char probe[4096];
+        ssize_t probeBytes = readFully(fd, probe, sizeof(probe));
+
+        if (probeBytes < 0)
+            return int(probeBytes);
+
+        if (probeBytes > 0)
+            luaL_addlstring(&b, probe, probeBytes);
+
+        // Whatever fstat didn't account for (pipes, procfs, a file which grew) is read straight into the buffer
+        while (probeBytes > 0)
         {
-            luaL_errorL(L, "Error reading: %s. Closing file.\n", uv_err_name(numBytesRead));
-            memset(readBuffer, 0, sizeof(readBuffer));
-            return 0;
+            char* more = luaL_prepbuffsize(&b, kReadChunk);
+            probeBytes = readFully(fd, more, kReadChunk);
+
+            if (probeBytes < 0)
+                return int(probeBytes);
+
+            b.p += probeBytes;
         }
+    }
+
+    luaL_pushresult(&b);
+    return 0;
+}
+
+int read(lua_State* L)
+{
+    // discard any extra arguments passed in
+    lua_settop(L, 1);
+    FileHandle& file = unpackFileHandle(L);
+
+    int err = flushFileHandle(file);
+
+    if (err == 0)
+        err = pushFileContents(L, file.fileDescriptor, false);
+
+    if (err)
+        luaL_errorL(L, "Error reading: %s. Closing file.\n", uv_err_name(err));
+
+    return 1;
+}
 
-        for (int i = 0; i < numBytesRead; i++)
-            resultData.push_back(readBuffer[i]);
+int readtobuffer(lua_State* L)
+{
+    lua_settop(L, 1);
+    FileHandle& file = unpackFileHandle(L);
 
-    } while (numBytesRead > 0);
+    int err = flushFileHandle(file);
 
-    lua_pushlstring(L, resultData.data(), resultData.size());
+    if (err == 0)
+        err = pushFileContents(L, file.fileDescriptor, true);
+
+    if (err)
+        luaL_errorL(L, "Error reading: %s. Closing file.\n", uv_err_name(err));
 
-    // Clean up the scratch space
-    memset(readBuffer, 0, sizeof(readBuffer));
     return 1;
 }
 
+// Accepts either a string or a buffer, neither is cut short by embedded zeros
+static const char* checkWriteData(lua_State* L, int idx, size_t* len)
+{
+    if (lua_isbuffer(L, idx))
+        return (const char*)lua_tobuffer(L, idx, len);
+
+    return luaL_checklstring(L, idx, len);
+}
+
+// Writes all of 'data' at the current position of 'fd' straight from the Luau object
+// Returns 0 on success or a libuv error code
+static int writeFully(uv_file fd, const char* data, size_t size)
+{
+    size_t total = 0;
+
+    while (total < size)
+    {
+        uv_buf_t iov = uv_buf_init(const_cast<char*>(data) + total, unsigned(std::min(size - total, kMaxReadChunk)));
+
+        uv_fs_t writeReq;
+        int bytesWritten = uv_fs_write(nullptr, &writeReq, fd, &iov, 1, -1, nullptr);
+        uv_fs_req_cleanup(&writeReq);
+
+        if (bytesWritten < 0)
+            return bytesWritten;
+
+        total += bytesWritten;
+    }
+
+    return 0;
+}
+
 int write(lua_State* L)
 {
-    char writeBuffer[4096];
+    FileHandle& file = unpackFileHandle(L);
+
+    size_t len = 0;
+    const char* data = checkWriteData(L, 2, &len);
+
+    int err = 0;
+
+    if (file.writeBuffer.size() + len > kFileWriteBufferSize)
+        err = flushFileHandle(file);
+
+    if (err == 0 && len >= kFileWriteBufferSize)
+        err = writeFully(file.fileDescriptor, data, len);
+    else if (err == 0)
+        file.writeBuffer.insert(file.writeBuffer.end(), data, data + len);
+
+    if (err)
+        luaL_errorL(L, "Error writing to file with descriptor %zu: %s\n", file.fileDescriptor, uv_strerror(err));
+
+    return 0;
+}
+
+// Most buffers a single vectored read or write accepts, their descriptions live on the stack
+constexpr int kMaxIoVecs = 64;
+
+// Checks the (buf, bufOffset?, len?) arguments starting at 'idx' and returns the described range of the buffer
+static uv_buf_t checkBufferRange(lua_State* L, int idx)
+{
+    size_t size = 0;
+    char* data = (char*)luaL_checkbuffer(L, idx, &size);
+
+    double offset = luaL_optnumber(L, idx + 1, 0);
+    luaL_argcheck(L, offset >= 0 && offset <= double(size), idx + 1, "offset is out of bounds");
+
+    double len = luaL_optnumber(L, idx + 2, double(size) - offset);
+    luaL_argcheck(L, len >= 0 && offset + len <= double(size), idx + 2, "length is out of bounds");
+
+    return uv_buf_init(data + size_t(offset), unsigned(len));
+}
+
+// File offsets are optional, -1 uses and advances the current position of the descriptor instead
+static int64_t checkFileOffset(lua_State* L, int idx)
+{
+    double offset = luaL_optnumber(L, idx, -1);
+    luaL_argcheck(L, offset >= -1, idx, "file offset must not be negative");
+
+    return int64_t(offset);
+}
+
+// Fills 'bufs' from an array of buffers, returns the number of entries
+static int checkBufferArray(lua_State* L, int idx, uv_buf_t (&bufs)[kMaxIoVecs])
+{
+    luaL_checktype(L, idx, LUA_TTABLE);
+
+    int count = lua_objlen(L, idx);
+    luaL_argcheck(L, count <= kMaxIoVecs, idx, "too many buffers");
+
+    for (int i = 0; i < count; i++)
+    {
+        lua_rawgeti(L, idx, i + 1);
+
+        if (!lua_isbuffer(L, -1))
+            luaL_argerror(L, idx, "expected an array of buffers");
+
+        size_t size = 0;
+        void* data = lua_tobuffer(L, -1, &size);
 
-    // Reset the write buffer
-    int wbSize = sizeof(writeBuffer);
-    memset(writeBuffer, 0, sizeof(writeBuffer));
-    FileHandle file = unpackFileHandle(L);
-    const char* stringToWrite = luaL_checkstring(L, 2);
+        bufs[i] = uv_buf_init((char*)data, unsigned(size));
 
-    // Set up the buffer to write
-    int numBytesLeftToWrite = strlen(stringToWrite);
-    int offset = 0;
-    do
+        // The buffer stays reachable through the array for the duration of the call
+        lua_pop(L, 1);
+    }
+
+    return count;
+}
+
+// Reads into 'bufs' until they are full or the end of the file is reached, returns the bytes read or a libuv error code
+static int64_t readVectored(uv_file fd, uv_buf_t* bufs, int count, int64_t offset)
+{
+    int64_t total = 0;
+
+    while (count > 0)
     {
-        // copy stringToWrite[0], numBytesLeftToWrite into write buffer
+        uv_fs_t readReq;
+        int bytesRead = uv_fs_read(nullptr, &readReq, fd, bufs, count, offset, nullptr);
+        uv_fs_req_cleanup(&readReq);
+
+        if (bytesRead < 0)
+            return bytesRead;
+
+        if (bytesRead == 0)
+            break;
+
+        total += bytesRead;
+
+        if (offset >= 0)
+            offset += bytesRead;
+
+        // Skip past the buffers which were filled and trim the one which was filled partially
+        while (count > 0 && size_t(bytesRead) >= bufs->len)
+        {
+            bytesRead -= int(bufs->len);
+            bufs++;
+            count--;
+        }
+
+        if (count > 0)
+        {
+            bufs->base += bytesRead;
+            bufs->len -= bytesRead;
+        }
+    }
+
+    return total;
+}
 
-        int sizeToWrite = std::min(wbSize, numBytesLeftToWrite);
-        memcpy(writeBuffer, stringToWrite + offset, sizeToWrite);
-        uv_buf_t iov = uv_buf_init(writeBuffer, sizeToWrite);
+// Writes all of 'bufs', returns the bytes written or a libuv error code
+static int64_t writeVectored(uv_file fd, uv_buf_t* bufs, int count, int64_t offset)
+{
+    int64_t total = 0;
+
+    // Empty buffers at the end would otherwise look like a short write
+    while (count > 0 && bufs[count - 1].len == 0)
+        count--;
 
+    while (count > 0)
+    {
         uv_fs_t writeReq;
-        int bytesWritten = 0;
-        uv_fs_write(uv_default_loop(), &writeReq, file.fileDescriptor, &iov, 1, -1, nullptr);
-        bytesWritten = writeReq.result;
+        int bytesWritten = uv_fs_write(nullptr, &writeReq, fd, bufs, count, offset, nullptr);
+        uv_fs_req_cleanup(&writeReq);
 
         if (bytesWritten < 0)
+            return bytesWritten;
+
+        total += bytesWritten;
+
+        if (offset >= 0)
+            offset += bytesWritten;
+
+        while (count > 0 && size_t(bytesWritten) >= bufs->len)
         {
-            // Error case.
-            luaL_errorL(L, "Error writing to file with descriptor %zu\n", file.fileDescriptor);
-            memset(writeBuffer, 0, sizeof(writeBuffer));
-            return 0;
+            bytesWritten -= int(bufs->len);
+            bufs++;
+            count--;
         }
 
+        if (count > 0)
+        {
+            bufs->base += bytesWritten;
+            bufs->len -= bytesWritten;
+        }
+    }
 
-        offset += bytesWritten;
-        numBytesLeftToWrite -= bytesWritten;
-    } while (numBytesLeftToWrite > 0);
+    return total;
+}
 
-    return 0;
+static int pushTransferResult(lua_State* L, FileHandle& file, int64_t result, const char* action)
+{
+    if (result < 0)
+        luaL_errorL(L, "Error %s file with descriptor %zu: %s\n", action, file.fileDescriptor, uv_strerror(int(result)));
+
+    lua_pushnumber(L, double(result));
+    return 1;
+}
+
+int readinto(lua_State* L)
+{
+    FileHandle& file = unpackFileHandle(L);
+
+    uv_buf_t buf = checkBufferRange(L, 2);
+    int64_t offset = checkFileOffset(L, 5);
+
+    // Reads have to see writes which are still held in the handle
+    if (int err = flushFileHandle(file))
+        return pushTransferResult(L, file, err, "writing to");
+
+    return pushTransferResult(L, file, readVectored(uv_file(file.fileDescriptor), &buf, 1, offset), "reading from");
 }
+
+int writefrom(lua_State* L)
+{
+    FileHandle& file = unpackFileHandle(L);
+
+    uv_buf_t buf = checkBufferRange(L, 2);
+    int64_t offset = checkFileOffset(L, 5);
+
+    if (int err = flushFileHandle(file))
+        return pushTransferResult(L, file, err, "writing to");
+
+    return pushTransferResult(L, file, writeVectored(uv_file(file.fileDescriptor), &buf, 1, offset), "writing to");
+}
+
+int readvinto(lua_State* L)
+{
+    FileHandle& file = unpackFileHandle(L);
+
+    uv_buf_t bufs[kMaxIoVecs];
+    int count = checkBufferArray(L, 2, bufs);
+    int64_t offset = checkFileOffset(L, 3);
+
+    if (int err = flushFileHandle(file))
+        return pushTransferResult(L, file, err, "writing to");
+
+    return pushTransferResult(L, file, readVectored(uv_file(file.fileDescriptor), bufs, count, offset), "reading from");
+}
+
+int writevfrom(lua_State* L)
+{
+    FileHandle& file = unpackFileHandle(L);
+
+    uv_buf_t bufs[kMaxIoVecs];
+    int count = checkBufferArray(L, 2, bufs);
+    int64_t offset = checkFileOffset(L, 3);
+
+    if (int err = flushFileHandle(file))
+        return pushTransferResult(L, file, err, "writing to");
+
+    return pushTransferResult(L, file, writeVectored(uv_file(file.fileDescriptor), bufs, count, offset), "writing to");
+}
+
 // Returns 0 on error, 1 otherwise
 std::optional<FileHandle> openHelper(lua_State* L, const char* path, const char* mode, int* openFlags)
 {
@@ -251,7 +668,10 @@ std::optional<FileHandle> openHelper(lua_State* L, const char* path, const char*
         return std::nullopt;
     }
 
-    return FileHandle{openReq.result, errcode};
+    FileHandle result;
+    result.fileDescriptor = openReq.result;
+    result.errcode = errcode;
+    return result;
 }
 
 int open(lua_State* L)
@@ -274,20 +694,13 @@ int open(lua_State* L)
     const char* mode = luaL_checkstring(L, 2);
     if (std::optional<FileHandle> result = openHelper(L, path, mode, &openFlags))
     {
-        createFileHandle(L, *result);
+        createFileHandle(L, std::move(*result));
         return 1;
     }
 
     return 0;
 }
 
-void cleanup(char* buffer, int size, const FileHandle& handle)
-{
-    memset(buffer, 0, size);
-    uv_fs_t closeReq;
-    uv_fs_close(uv_default_loop(), &closeReq, handle.fileDescriptor, nullptr);
-}
-
 int fs_remove(lua_State* L)
 {
     uv_fs_t unlink_req;
@@ -325,47 +738,38 @@ int fs_rmdir(lua_State* L) {
     return 0;
 }
 
-int type(lua_State* L)
+void pushTypeName(lua_State* L, uint64_t mode)
 {
-    const char* path = luaL_checkstring(L, 1);
-
-    uv_fs_t req;
-
-    int err = uv_fs_stat(uv_default_loop(), &req, path, nullptr);
-
-    if (err)
-        luaL_errorL(L, "%s", uv_strerror(err));
-
-    if (S_ISDIR(req.statbuf.st_mode))
+    if (S_ISDIR(mode))
     {
         lua_pushstring(L, UV_TYPENAME_DIR);
     }
-    else if (S_ISREG(req.statbuf.st_mode))
+    else if (S_ISREG(mode))
     {
         lua_pushstring(L, UV_TYPENAME_FILE);
     }
-    else if (S_ISCHR(req.statbuf.st_mode))
+    else if (S_ISCHR(mode))
     {
         lua_pushstring(L, UV_TYPENAME_CHAR);
     }
-    else if (S_ISLNK(req.statbuf.st_mode))
+    else if (S_ISLNK(mode))
     {
         lua_pushstring(L, UV_TYPENAME_LINK);
     }
 #ifdef S_ISBLK
-    else if (S_ISBLK(req.statbuf.st_mode))
+    else if (S_ISBLK(mode))
     {
         lua_pushstring(L, UV_TYPENAME_BLOCK);
     }
 #endif
 #ifdef S_ISFIFO
-    else if (S_ISFIFO(req.statbuf.st_mode))
+    else if (S_ISFIFO(mode))
     {
         lua_pushstring(L, UV_TYPENAME_FIFO);
     }
 #endif
 #ifdef S_ISSOCK
-    else if (S_ISSOCK(req.statbuf.st_mode))
+    else if (S_ISSOCK(mode))
     {
         lua_pushstring(L, UV_TYPENAME_SOCKET);
     }
@@ -374,9 +778,18 @@ int type(lua_State* L)
     {
         lua_pushstring(L, UV_TYPENAME_UNKNOWN);
     }
+}
+
+int type(lua_State* L)
+{
+    const char* path = luaL_checkstring(L, 1);
+
+    uv_stat_t statbuf;
 
+    if (int err = statPath(path, &statbuf))
+        luaL_errorL(L, "%s", uv_strerror(err));
 
-    uv_fs_req_cleanup(&req);
+    pushTypeName(L, statbuf.st_mode);
 
     return 1;
 }
@@ -389,7 +802,7 @@ int listdir(lua_State* L)
     req->data = new ResumeToken(getResumeToken(L));
 
     int err = uv_fs_scandir(
-        uv_default_loop(),
+        &getRuntime(L)->loop,
         req,
         path,
         0,
@@ -433,7 +846,7 @@ int listdir(lua_State* L)
     return lua_yield(L, 0);
 }
 
-int readfiletostring(lua_State* L)
+static int readWholeFile(lua_State* L, bool asBuffer)
 {
     const char* path = luaL_checkstring(L, 1);
     const char openMode[] = "r";
@@ -445,47 +858,39 @@ int readfiletostring(lua_State* L)
         return 0;
     }
 
-    memset(readBuffer, 0, sizeof(readBuffer));
     // discard any extra arguments passed in
     lua_settop(L, 1);
 
-    int numBytesRead = 0;
-    uv_fs_t readReq;
-    uv_buf_t iov = uv_buf_init(readBuffer, sizeof(readBuffer));
-    // Output data
-    std::vector<char> resultData;
-    do
-    {
-        uv_fs_read(uv_default_loop(), &readReq, handle->fileDescriptor, &iov, 1, -1, nullptr);
-
-        numBytesRead = readReq.result;
+    int err = pushFileContents(L, handle->fileDescriptor, asBuffer);
 
-        if (numBytesRead < 0)
-        {
-            luaL_errorL(L, "Error reading: %s. Closing file.\n", uv_err_name(numBytesRead));
-            cleanup(readBuffer, sizeof(readBuffer), *handle);
-            return 0;
-        }
+    uv_fs_t closeReq;
+    uv_fs_close(nullptr, &closeReq, handle->fileDescriptor, nullptr);
 
-        for (int i = 0; i < numBytesRead; i++)
-            resultData.push_back(readBuffer[i]);
+    if (err)
+        luaL_errorL(L, "Error reading: %s. Closing file.\n", uv_err_name(err));
 
-    } while (numBytesRead > 0);
+    return 1;
+}
 
-    lua_pushlstring(L, resultData.data(), resultData.size());
+int readfiletostring(lua_State* L)
+{
+    return readWholeFile(L, false);
+}
 
-    // Clean up the scratch space
-    cleanup(readBuffer, sizeof(readBuffer), *handle);
-    return 1;
+int readfiletobuffer(lua_State* L)
+{
+    return readWholeFile(L, true);
 }
 
 int writestringtofile(lua_State* L)
 {
-    char writeBuffer[4096];
-
     const char* path = luaL_checkstring(L, 1);
     const char openMode[] = "w+";
     int openFlags = 0x0000;
+
+    size_t len = 0;
+    const char* data = checkWriteData(L, 2, &len);
+
     std::optional<FileHandle> handle = openHelper(L, path, openMode, &openFlags);
     if (!handle)
     {
@@ -493,41 +898,14 @@ int writestringtofile(lua_State* L)
         return 0;
     }
 
-    int wbSize = sizeof(writeBuffer);
-    memset(writeBuffer, 0, sizeof(writeBuffer));
-    const char* stringToWrite = luaL_checkstring(L, 2);
-
-    // Set up the buffer to write
-    int numBytesLeftToWrite = strlen(stringToWrite);
-    int offset = 0;
-    uv_buf_t iov;
-    do
-    {
-        // copy stringToWrite[0], numBytesLeftToWrite into write buffer
+    int err = writeFully(handle->fileDescriptor, data, len);
 
-        int sizeToWrite = std::min(wbSize, numBytesLeftToWrite);
-        memcpy(writeBuffer, stringToWrite + offset, sizeToWrite);
-        iov = uv_buf_init(writeBuffer, sizeToWrite);
+    uv_fs_t closeReq;
+    uv_fs_close(nullptr, &closeReq, handle->fileDescriptor, nullptr);
 
-        uv_fs_t writeReq;
-        int bytesWritten = 0;
-        uv_fs_write(uv_default_loop(), &writeReq, handle->fileDescriptor, &iov, 1, -1, nullptr);
-        bytesWritten = writeReq.result;
+    if (err)
+        luaL_errorL(L, "Error writing to file %s: %s\n", path, uv_strerror(err));
 
-        if (bytesWritten < 0)
-        {
-            // Error case.
-            luaL_errorL(L, "Error writing to file with descriptor %zu\n", handle->fileDescriptor);
-            cleanup(writeBuffer, sizeof(writeBuffer), *handle);
-            return 0;
-        }
-
-
-        offset += bytesWritten;
-        numBytesLeftToWrite -= bytesWritten;
-    } while (numBytesLeftToWrite > 0);
-
-    cleanup(writeBuffer, sizeof(writeBuffer), *handle);
     return 0;
 }
 
@@ -539,6 +917,15 @@ struct ResumeCaptureInformation
     }
 
     ResumeToken token = nullptr;
+
+    // Pushes the results of a successful request when the coroutine is resumed
+    std::function<int(lua_State*, uv_fs_t*)> push;
+
+    // Data being written, held on to until the request is finished
+    std::shared_ptr<Ref> pinned;
+    std::vector<char> buffered;
+
+    uv_file fd = -1;
 };
 
 uv_fs_t* createRequest(lua_State* L)
@@ -553,97 +940,712 @@ ResumeCaptureInformation* getResumeInformation(uv_fs_t* req)
     return reinterpret_cast<ResumeCaptureInformation*>(req->data);
 }
 
+static void destroyRequest(uv_fs_t* req)
+{
+    uv_fs_req_cleanup(req);
+    delete getResumeInformation(req);
+    delete req;
+}
+
+// Callback of async requests, resumes the coroutine with the results or the error
+static void completeRequest(uv_fs_t* req)
+{
+    ResumeCaptureInformation* info = getResumeInformation(req);
+
+    if (req->result < 0)
+    {
+        info->token->fail(uv_strerror(int(req->result)));
+        destroyRequest(req);
+        return;
+    }
+
+    info->token->complete(
+        [req](lua_State* L)
+        {
+            ResumeCaptureInformation* info = getResumeInformation(req);
+            int results = info->push ? info->push(L, req) : 0;
+
+            destroyRequest(req);
+            return results;
+        }
+    );
+}
+
+// Yields until the request started with 'err' calls back, a request which failed to start resumes with the error right away
+static int yieldForRequest(lua_State* L, uv_fs_t* req, int err)
+{
+    if (err < 0)
+    {
+        getResumeInformation(req)->token->fail(uv_strerror(err));
+        destroyRequest(req);
+    }
+
+    return lua_yield(L, 0);
+}
+
+// Returns the file handle at 'idx' or nullptr when it is something else
+static FileHandle* toFileHandle(lua_State* L, int idx)
+{
+    FileHandle* file = (FileHandle*)lua_touserdatatagged(L, idx, kFileHandleTag);
+
+    if (file && file->closed)
+        luaL_errorL(L, "Error: file handle is closed\n");
+
+    return file;
+}
+
+int toFileDescriptor(lua_State* L, int idx)
+{
+    FileHandle* file = toFileHandle(L, idx);
+
+    if (!file)
+        return -1;
+
+    if (int err = flushFileHandle(*file))
+        luaL_errorL(L, "Error writing to file with descriptor %zu: %s\n", file->fileDescriptor, uv_strerror(err));
+
+    return int(file->fileDescriptor);
+}
+
+// Reads a whole file by path, or the rest of a file handle, on the threadpool
+static int readAsync(lua_State* L, bool asBuffer)
+{
+    FileHandle* file = toFileHandle(L, 1);
+    std::string path = file ? "" : luaL_checkstring(L, 1);
+
+    uv_file fd = file ? uv_file(file->fileDescriptor) : -1;
+    std::vector<char> buffered;
+
+    if (file)
+        buffered = std::move(file->writeBuffer);
+
+    ResumeToken token = getResumeToken(L);
+
+    // The whole open/read/close sequence runs on the threadpool, only the resume with the data touches the loop
+    token->runtime->runInWorkQueue(
+        [token, path = std::move(path), fd, buffered = std::move(buffered), asBuffer]
+        {
+            bool ownsFile = fd < 0;
+            uv_file readFd = fd;
+
+            if (ownsFile)
+            {
+                uv_fs_t openReq;
+                readFd = uv_fs_open(nullptr, &openReq, path.c_str(), O_RDONLY, 0, nullptr);
+                uv_fs_req_cleanup(&openReq);
+
+                if (readFd < 0)
+                {
+                    token->fail("Error opening file");
+                    return;
+                }
+            }
+
+            // Data held back by small writes to the handle goes out before reading on from its position
+            int err = writeFully(readFd, buffered.data(), buffered.size());
+
+            // Output data
+            std::vector<char> resultData;
+            ssize_t numBytesRead = err < 0 ? err : readToVector(readFd, resultData);
+
+            if (ownsFile)
+            {
+                uv_fs_t closeReq;
+                uv_fs_close(nullptr, &closeReq, readFd, nullptr);
+                uv_fs_req_cleanup(&closeReq);
+            }
+
+            if (numBytesRead < 0)
+            {
+                token->fail("Error reading file");
+                return;
+            }
+
+            // Push the result buffer onto the stack
+            token->complete(
+                [data = std::move(resultData), asBuffer](lua_State* L)
+                {
+                    if (asBuffer)
+                        memcpy(lua_newbuffer(L, data.size()), data.data(), data.size());
+                    else
+                        lua_pushlstring(L, data.data(), data.size());
+
+                    return 1;
+                }
+            );
+        }
+    );
+
+    return lua_yield(L, 0);
+}
+
 int readasync(lua_State* L)
+{
+    return readAsync(L, false);
+}
+
+int readtobufferasync(lua_State* L)
+{
+    return readAsync(L, true);
+}
+
+int openasync(lua_State* L)
 {
     const char* path = luaL_checkstring(L, 1);
+    const char* mode = luaL_optstring(L, 2, "r");
 
-    uv_fs_t* openReq = createRequest(L);
-    uv_fs_open(
-        uv_default_loop(),
-        openReq,
-        path,
-        O_RDONLY,
+    int openFlags = 0x0000;
+    std::optional<int> modeFlags = setFlags(mode, &openFlags);
+
+    if (!modeFlags)
+        luaL_errorL(L, "Error opening file %s: invalid mode '%s'\n", path, mode);
+
+    uv_fs_t* req = createRequest(L);
+
+    getResumeInformation(req)->push = [](lua_State* L, uv_fs_t* req)
+    {
+        FileHandle file;
+        file.fileDescriptor = req->result;
+        file.errcode = 0;
+
+        createFileHandle(L, std::move(file));
+        return 1;
+    };
+
+    int err = uv_fs_open(&getRuntime(L)->loop, req, path, openFlags, *modeFlags, completeRequest);
+    return yieldForRequest(L, req, err);
+}
+
+// Writes the data held back by small writes followed by 'data' in a single request, the Luau object is not copied
+static int writeAsync(lua_State* L, FileHandle& file, int dataIdx, uv_fs_cb cb)
+{
+    uv_fs_t* req = createRequest(L);
+    ResumeCaptureInformation* info = getResumeInformation(req);
+
+    info->fd = uv_file(file.fileDescriptor);
+    info->buffered = std::move(file.writeBuffer);
+
+    uv_buf_t bufs[2];
+    unsigned nbufs = 0;
+
+    if (!info->buffered.empty())
+        bufs[nbufs++] = uv_buf_init(info->buffered.data(), unsigned(info->buffered.size()));
+
+    if (dataIdx != 0)
+    {
+        size_t len = 0;
+        const char* data = checkWriteData(L, dataIdx, &len);
+
+        info->pinned = std::make_shared<Ref>(L, dataIdx);
+        bufs[nbufs++] = uv_buf_init(const_cast<char*>(data), unsigned(len));
+    }
+
+    int err = uv_fs_write(&getRuntime(L)->loop, req, info->fd, bufs, nbufs, -1, cb);
+    return yieldForRequest(L, req, err);
+}
+
+int writeasync(lua_State* L)
+{
+    FileHandle& file = unpackFileHandle(L);
+    checkWriteData(L, 2, nullptr);
+
+    return writeAsync(L, file, 2, completeRequest);
+}
+
+int flushasync(lua_State* L)
+{
+    FileHandle& file = unpackFileHandle(L);
+
+    if (file.writeBuffer.empty())
+        return 0;
+
+    return writeAsync(L, file, 0, completeRequest);
+}
+
+int closeasync(lua_State* L)
+{
+    FileHandle& file = unpackFileHandle(L);
+
+    // The handle is closed from now on, even if writing out the buffered data fails
+    file.closed = true;
+
+    if (file.writeBuffer.empty())
+    {
+        uv_fs_t* req = createRequest(L);
+
+        int err = uv_fs_close(&getRuntime(L)->loop, req, uv_file(file.fileDescriptor), completeRequest);
+        return yieldForRequest(L, req, err);
+    }
+
+    return writeAsync(
+        L,
+        file,
         0,
         [](uv_fs_t* req)
         {
             ResumeCaptureInformation* info = getResumeInformation(req);
-            int fd = req->result;
 
-            if (fd < 0)
+            if (req->result < 0)
             {
-                info->token->fail("Error opening file");
                 uv_fs_t closeReq;
-                uv_fs_close(uv_default_loop(), &closeReq, fd, nullptr);
-                uv_fs_req_cleanup(req);
-                delete (ResumeCaptureInformation*)req->data;
-                delete req;
+                uv_fs_close(nullptr, &closeReq, info->fd, nullptr);
+                uv_fs_req_cleanup(&closeReq);
+
+                completeRequest(req);
                 return;
             }
 
-            // Allocate the destination buffer for reading
-            char readBuffer[1024];
-            memset(readBuffer, 0, sizeof(readBuffer));
-            uv_buf_t iov = uv_buf_init(readBuffer, sizeof(readBuffer));
-            // Read data
-            int numBytesRead = 0;
-            uv_fs_t readReq;
-            // Output data
-            std::vector<char> resultData;
+            // Reuse the request to close the file once the data is written
+            uv_loop_t* loop = req->loop;
+            uv_fs_req_cleanup(req);
+
+            int err = uv_fs_close(loop, req, info->fd, completeRequest);
+
+            if (err < 0)
+            {
+                info->token->fail(uv_strerror(err));
+                destroyRequest(req);
+            }
+        }
+    );
+}
+
+int removeasync(lua_State* L)
+{
+    const char* path = luaL_checkstring(L, 1);
+
+    uv_fs_t* req = createRequest(L);
+
+    int err = uv_fs_unlink(&getRuntime(L)->loop, req, path, completeRequest);
+    return yieldForRequest(L, req, err);
+}
+
+int mkdirasync(lua_State* L)
+{
+    const char* path = luaL_checkstring(L, 1);
+    int mode = luaL_optinteger(L, 2, 0777);
+
+    uv_fs_t* req = createRequest(L);
+
+    int err = uv_fs_mkdir(&getRuntime(L)->loop, req, path, mode, completeRequest);
+    return yieldForRequest(L, req, err);
+}
+
+int rmdirasync(lua_State* L)
+{
+    const char* path = luaL_checkstring(L, 1);
+
+    uv_fs_t* req = createRequest(L);
+
+    int err = uv_fs_rmdir(&getRuntime(L)->loop, req, path, completeRequest);
+    return yieldForRequest(L, req, err);
+}
+
+int typeasync(lua_State* L)
+{
+    const char* path = luaL_checkstring(L, 1);
+
+    uv_fs_t* req = createRequest(L);
 
-            do
+    getResumeInformation(req)->push = [](lua_State* L, uv_fs_t* req)
+    {
+        pushTypeName(L, req->statbuf.st_mode);
+        return 1;
+    };
+
+    int err = uv_fs_stat(&getRuntime(L)->loop, req, path, completeRequest);
+    return yieldForRequest(L, req, err);
+}
+
+int writestringtofileasync(lua_State* L)
+{
+    std::string path = luaL_checkstring(L, 1);
+
+    size_t len = 0;
+    const char* data = checkWriteData(L, 2, &len);
+
+    int openFlags = 0x0000;
+    int modeFlags = *setFlags("w+", &openFlags);
+
+    ResumeToken token = getResumeToken(L);
+
+    // The data is written straight from the Luau object, which is pinned until the task is released on the loop thread
+    token->runtime->runInWorkQueue(
+        [token, path = std::move(path), pinned = std::make_shared<Ref>(L, 2), data, len, openFlags, modeFlags]
+        {
+            uv_fs_t openReq;
+            int fd = uv_fs_open(nullptr, &openReq, path.c_str(), openFlags, modeFlags, nullptr);
+            uv_fs_req_cleanup(&openReq);
+
+            if (fd < 0)
+            {
+                token->fail(uv_strerror(fd));
+                return;
+            }
+
+            int err = writeFully(fd, data, len);
+
+            uv_fs_t closeReq;
+            uv_fs_close(nullptr, &closeReq, fd, nullptr);
+            uv_fs_req_cleanup(&closeReq);
+
+            if (err < 0)
+                token->fail(uv_strerror(err));
+            else
+                token->complete([](lua_State* L) {
+                    return 0;
+                });
+        }
+    );
+
+    return lua_yield(L, 0);
+}
+
+// Large transfers are split into steps of this size, so that progress is reported between them
+constexpr int64_t kTransferChunk = 16 * 1024 * 1024;
+
+// Calls a Luau progress callback on the runtime thread, in a thread of its own so that it can't disturb waiting coroutines
+struct TransferProgress
+{
+    Runtime* runtime = nullptr;
+    std::shared_ptr<Ref> thread;
+    std::shared_ptr<Ref> callback;
+
+    // Set when the callback raised an error, which stops the transfer
+    std::atomic<bool> failed = false;
+    std::mutex mutex;
+    std::string error;
+};
+
+static std::shared_ptr<TransferProgress> createProgress(lua_State* L, int idx)
+{
+    auto progress = std::make_shared<TransferProgress>();
+    progress->runtime = getRuntime(L);
+    progress->callback = std::make_shared<Ref>(L, idx);
+
+    lua_newthread(L);
+    progress->thread = std::make_shared<Ref>(L, -1);
+    lua_pop(L, 1);
+
+    return progress;
+}
+
+static void reportProgress(const std::shared_ptr<TransferProgress>& progress, int64_t done, int64_t total)
+{
+    progress->runtime->schedule([progress, done, total] {
+        if (progress->failed)
+            return;
+
+        lua_State* GL = progress->runtime->GL;
+
+        progress->thread->push(GL);
+        lua_State* L = lua_tothread(GL, -1);
+        lua_pop(GL, 1);
+
+        progress->callback->push(L);
+        lua_pushnumber(L, double(done));
+        lua_pushnumber(L, double(total));
+
+        if (lua_pcall(L, 2, 0, 0) != LUA_OK)
+        {
+            std::unique_lock lock(progress->mutex);
+
+            const char* error = lua_tostring(L, -1);
+            progress->error = error ? error : "progress callback failed";
+            progress->failed = true;
+
+            lua_settop(L, 0);
+        }
+    });
+}
+
+// Moves 'len' bytes (or everything up to the end of the file when negative) from 'in' at 'offset' to the position of 'out'
+// The data is copied by the kernel with copy_file_range or sendfile where possible, returns the byte count or a libuv error
+static int64_t transfer(uv_file out, uv_file in, int64_t offset, int64_t len, int64_t total, const std::shared_ptr<TransferProgress>& progress)
+{
+    int64_t done = 0;
+
+    while (len < 0 || done < len)
+    {
+        if (progress && progress->failed)
+            return UV_ECANCELED;
+
+        size_t chunk = size_t(len < 0 ? kTransferChunk : std::min(kTransferChunk, len - done));
+
+        uv_fs_t sendReq;
+        int64_t sent = uv_fs_sendfile(nullptr, &sendReq, out, in, offset + done, chunk, nullptr);
+        uv_fs_req_cleanup(&sendReq);
+
+        if (sent < 0)
+            return sent;
+
+        if (sent == 0)
+            break;
+
+        done += sent;
+
+        if (progress)
+            reportProgress(progress, done, total);
+    }
+
+    return done;
+}
+
+static std::string transferError(const std::shared_ptr<TransferProgress>& progress, int64_t err)
+{
+    if (progress && progress->failed)
+    {
+        std::unique_lock lock(progress->mutex);
+        return progress->error;
+    }
+
+    return uv_strerror(int(err));
+}
+
+int copy(lua_State* L)
+{
+    std::string src = luaL_checkstring(L, 1);
+    std::string dst = luaL_checkstring(L, 2);
+
+    int flags = 0;
+    std::shared_ptr<TransferProgress> progress;
+
+    if (!lua_isnoneornil(L, 3))
+    {
+        luaL_checktype(L, 3, LUA_TTABLE);
+
+        lua_getfield(L, 3, "reflink");
+        if (lua_type(L, -1) == LUA_TSTRING && strcmp(lua_tostring(L, -1), "force") == 0)
+            flags |= UV_FS_COPYFILE_FICLONE_FORCE;
+        else if (lua_toboolean(L, -1))
+            flags |= UV_FS_COPYFILE_FICLONE;
+        lua_pop(L, 1);
+
+        lua_getfield(L, 3, "progress");
+        if (!lua_isnil(L, -1))
+        {
+            luaL_checktype(L, -1, LUA_TFUNCTION);
+            progress = createProgress(L, -1);
+        }
+        lua_pop(L, 1);
+    }
+
+    // Without progress reports libuv does the whole copy, trying a reflink first when asked to
+    if (!progress)
+    {
+        uv_fs_t* req = createRequest(L);
+
+        int err = uv_fs_copyfile(&getRuntime(L)->loop, req, src.c_str(), dst.c_str(), flags, completeRequest);
+        return yieldForRequest(L, req, err);
+    }
+
+    ResumeToken token = getResumeToken(L);
+
+    token->runtime->runInWorkQueue(
+        [token, src = std::move(src), dst = std::move(dst), flags, progress]
+        {
+            // A reflink shares the blocks of the source and completes in a single step
+            if (flags != 0)
             {
-                uv_fs_read(uv_default_loop(), &readReq, fd, &iov, 1, -1, nullptr);
-                numBytesRead = readReq.result;
+                uv_fs_t cloneReq;
+                int err = uv_fs_copyfile(nullptr, &cloneReq, src.c_str(), dst.c_str(), UV_FS_COPYFILE_FICLONE_FORCE, nullptr);
+                uv_fs_req_cleanup(&cloneReq);
 
-                if (numBytesRead < 0)
+                if (err == 0 || (flags & UV_FS_COPYFILE_FICLONE_FORCE))
                 {
-                    uv_fs_t closeReq;
-                    uv_fs_close(uv_default_loop(), &closeReq, fd, nullptr);
-                    // Schedule error;
-                    // Also, we should free the original request. We don't have to do this for the read req since it's sycnrhonous
-                    info->token->fail("Error reading file");
-                    uv_fs_req_cleanup(req);
-                    delete (ResumeCaptureInformation*)req->data;
-                    delete req;
+                    uv_fs_t statReq;
+                    uv_fs_stat(nullptr, &statReq, dst.c_str(), nullptr);
+                    int64_t size = int64_t(statReq.statbuf.st_size);
+                    uv_fs_req_cleanup(&statReq);
+
+                    if (err == 0)
+                    {
+                        reportProgress(progress, size, size);
+                        token->complete([](lua_State* L) {
+                            return 0;
+                        });
+                    }
+                    else
+                    {
+                        token->fail(uv_strerror(err));
+                    }
+
                     return;
                 }
+            }
 
-                for (int i = 0; i < numBytesRead; i++)
-                    resultData.push_back(readBuffer[i]);
+            uv_fs_t openReq;
+            uv_file in = uv_fs_open(nullptr, &openReq, src.c_str(), O_RDONLY, 0, nullptr);
+            uv_fs_req_cleanup(&openReq);
 
-            } while (numBytesRead > 0);
+            if (in < 0)
+            {
+                token->fail(uv_strerror(in));
+                return;
+            }
 
-            // Push the result buffer onto the stack
-            info->token->complete(
-                [data = std::move(resultData)](lua_State* L)
-                {
-                    lua_pushlstring(L, data.data(), data.size());
-                    return 1;
-                }
-            );
+            uv_fs_t statReq;
+            uv_fs_fstat(nullptr, &statReq, in, nullptr);
+            int64_t size = int64_t(statReq.statbuf.st_size);
+            int mode = int(statReq.statbuf.st_mode & 0777);
+            uv_fs_req_cleanup(&statReq);
+
+            uv_file out = uv_fs_open(nullptr, &openReq, dst.c_str(), O_WRONLY | O_CREAT | O_TRUNC, mode, nullptr);
+            uv_fs_req_cleanup(&openReq);
+
+            int64_t result = out < 0 ? out : transfer(out, in, 0, -1, size, progress);
 
             uv_fs_t closeReq;
-            uv_fs_close(uv_default_loop(), &closeReq, fd, nullptr);
-            // free the read buffer as well as the resume information and the request
-            delete (ResumeCaptureInformation*)req->data;
-            delete req;
-            return;
+            uv_fs_close(nullptr, &closeReq, in, nullptr);
+            uv_fs_req_cleanup(&closeReq);
+
+            if (out >= 0)
+            {
+                uv_fs_close(nullptr, &closeReq, out, nullptr);
+                uv_fs_req_cleanup(&closeReq);
+            }
+
+            if (result < 0)
+                token->fail(transferError(progress, result));
+            else
+                token->complete([](lua_State* L) {
+                    return 0;
+                });
+        }
+    );
+
+    return lua_yield(L, 0);
+}
+
+// Accepts a file handle or a raw descriptor number, such as a socket, data held back by small writes to a handle is moved to 'buffered'
+static uv_file checkDescriptor(lua_State* L, int idx, std::vector<char>& buffered)
+{
+    if (FileHandle* file = toFileHandle(L, idx))
+    {
+        buffered = std::move(file->writeBuffer);
+        return uv_file(file->fileDescriptor);
+    }
+
+    return uv_file(luaL_checkinteger(L, idx));
+}
+
+int sendfile(lua_State* L)
+{
+    std::vector<char> inBuffered;
+    std::vector<char> outBuffered;
+
+    uv_file in = checkDescriptor(L, 1, inBuffered);
+    uv_file out = checkDescriptor(L, 2, outBuffered);
+    int64_t offset = int64_t(luaL_optnumber(L, 3, 0));
+    int64_t len = lua_isnoneornil(L, 4) ? -1 : int64_t(luaL_checknumber(L, 4));
+
+    luaL_argcheck(L, offset >= 0, 3, "offset must be non-negative");
+
+    std::shared_ptr<TransferProgress> progress;
+
+    if (!lua_isnoneornil(L, 5))
+    {
+        luaL_checktype(L, 5, LUA_TFUNCTION);
+        progress = createProgress(L, 5);
+    }
+
+    ResumeToken token = getResumeToken(L);
+
+    token->runtime->runInWorkQueue(
+        [token, in, out, offset, len, progress, inBuffered = std::move(inBuffered), outBuffered = std::move(outBuffered)]
+        {
+            int err = writeFully(in, inBuffered.data(), inBuffered.size());
+
+            if (err == 0)
+                err = writeFully(out, outBuffered.data(), outBuffered.size());
+
+            int64_t total = len;
+
+            if (total < 0)
+            {
+                uv_fs_t statReq;
+                uv_fs_fstat(nullptr, &statReq, in, nullptr);
+                total = std::max(int64_t(statReq.statbuf.st_size) - offset, int64_t(0));
+                uv_fs_req_cleanup(&statReq);
+            }
+
+            int64_t result = err < 0 ? err : transfer(out, in, offset, len, total, progress);
+
+            if (result < 0)
+                token->fail(transferError(progress, result));
+            else
+                token->complete([result](lua_State* L) {
+                    lua_pushnumber(L, double(result));
+                    return 1;
+                });
         }
     );
 
     return lua_yield(L, 0);
 }
 
+static const luaL_Reg fileHandleMethods[] = {
+    {"read", read},
+    {"readtobuffer", readtobuffer},
+    {"write", write},
+    {"readinto", readinto},
+    {"writefrom", writefrom},
+    {"readvinto", readvinto},
+    {"writevfrom", writevfrom},
+    {"flush", flush},
+    {"close", close},
+    {nullptr, nullptr},
+};
+
+static void registerFileHandleType(lua_State* L)
+{
+    lua_setuserdatadtor(L, kFileHandleTag, [](lua_State* L, void* userdata) {
+        FileHandle* file = (FileHandle*)userdata;
+
+        // Handles which are dropped without being closed don't leak their descriptor
+        if (!file->closed)
+            closeFileHandle(*file);
+
+        file->~FileHandle();
+    });
+
+    lua_createtable(L, 0, 2);
+
+    lua_createtable(L, 0, std::size(fileHandleMethods));
+
+    for (auto& [name, func] : fileHandleMethods)
+    {
+        if (!name || !func)
+            break;
+
+        lua_pushcfunction(L, func, name);
+        lua_setfield(L, -2, name);
+    }
+
+    lua_setreadonly(L, -1, 1);
+    lua_setfield(L, -2, "__index");
+
+    lua_pushstring(L, "FileHandle");
+    lua_setfield(L, -2, "__type");
+
+    lua_setreadonly(L, -1, 1);
+    lua_setuserdatametatable(L, kFileHandleTag, -1);
+}
+
 } // namespace fs
 
 int luaopen_fs(lua_State* L)
 {
+    fs::registerFileHandleType(L);
+
     luaL_register(L, "fs", fs::lib);
     return 1;
 }
 
 int luteopen_fs(lua_State* L)
 {
+    fs::registerFileHandleType(L);
+
     lua_createtable(L, 0, std::size(fs::lib));
 
     for (auto& [name, func] : fs::lib)
@@ -0,0 +1,376 @@
+#include "lute/map.h"
+
+#include "lua.h"
+#include "lualib.h"
+#include "uv.h"
+
+#include "lute/runtime.h"
+
+#include <algorithm>
+#include <cerrno>
+#include <cstdint>
+#include <cstring>
+#include <fcntl.h>
+#include <string>
+#include <string_view>
+#ifdef _WIN32
+#include <Windows.h>
+#else
+#include <sys/mman.h>
+#endif
+
+namespace fs
+{
+
+static const char* kMappedFileType = "MappedFile";
+
+struct MappedFile
+{
+    char* data = nullptr;
+    size_t size = 0;
+    bool writable = false;
+    bool closed = false;
+};
+
+static void unmap(MappedFile& file)
+{
+    if (file.data)
+    {
+#ifdef _WIN32
+        UnmapViewOfFile(file.data);
+#else
+        munmap(file.data, file.size);
+#endif
+    }
+
+    file.data = nullptr;
+    file.size = 0;
+    file.closed = true;
+}
+
+static MappedFile& checkMappedFile(lua_State* L, int idx)
+{
+    MappedFile* file = (MappedFile*)luaL_checkudata(L, idx, kMappedFileType);
+
+    if (file->closed)
+        luaL_error(L, "mapped file is closed");
+
+    return *file;
+}
+
+// Validates the [offset, offset + count) range of the mapping and returns a pointer to its start
+static char* checkRange(lua_State* L, MappedFile& file, double offset, size_t count)
+{
+    if (offset < 0 || offset > double(file.size) || count > file.size - size_t(offset))
+        luaL_error(L, "access out of bounds of the mapped file (size %llu)", (unsigned long long)file.size);
+
+    return file.data + size_t(offset);
+}
+
+template<typename T>
+static int readValue(lua_State* L)
+{
+    MappedFile& file = checkMappedFile(L, 1);
+
+    T value;
+    memcpy(&value, checkRange(L, file, luaL_checknumber(L, 2), sizeof(T)), sizeof(T));
+
+    lua_pushnumber(L, double(value));
+    return 1;
+}
+
+template<typename T>
+static int writeValue(lua_State* L)
+{
+    MappedFile& file = checkMappedFile(L, 1);
+
+    if (!file.writable)
+        luaL_error(L, "mapped file was not opened for writing");
+
+    T value = T(luaL_checknumber(L, 3));
+    memcpy(checkRange(L, file, luaL_checknumber(L, 2), sizeof(T)), &value, sizeof(T));
+
+    return 0;
+}
+
+static int mapLen(lua_State* L)
+{
+    MappedFile& file = checkMappedFile(L, 1);
+
+    lua_pushnumber(L, double(file.size));
+    return 1;
+}
+
+static int mapReadString(lua_State* L)
+{
+    MappedFile& file = checkMappedFile(L, 1);
+    double offset = luaL_checknumber(L, 2);
+
+    // Counts are taken as numbers, integers would cut reads from mappings over 2GB short
+    double count = luaL_checknumber(L, 3);
+
+    luaL_argcheck(L, count >= 0 && count <= double(file.size), 3, "count must be between 0 and the size of the mapped file");
+    luaL_argcheck(L, count == double(size_t(count)), 3, "count must be an integer");
+
+    const char* data = checkRange(L, file, offset, size_t(count));
+
+    lua_pushlstring(L, data, size_t(count));
+    return 1;
+}
+
+static int mapWriteString(lua_State* L)
+{
+    MappedFile& file = checkMappedFile(L, 1);
+
+    if (!file.writable)
+        luaL_error(L, "mapped file was not opened for writing");
+
+    size_t len = 0;
+    const char* str = luaL_checklstring(L, 3, &len);
+
+    memcpy(checkRange(L, file, luaL_checknumber(L, 2), len), str, len);
+    return 0;
+}
+
+/* Copies a range of the mapping into a buffer: (target: buffer, targetOffset: number, offset: number?, count: number?)
+   Returns the number of bytes copied, which defaults to as much as fits in the buffer */
+static int mapCopyTo(lua_State* L)
+{
+    MappedFile& file = checkMappedFile(L, 1);
+
+    size_t targetLen = 0;
+    char* target = (char*)luaL_checkbuffer(L, 2, &targetLen);
+    double targetOffset = luaL_checknumber(L, 3);
+    double offset = luaL_optnumber(L, 4, 0);
+
+    luaL_argcheck(L, targetOffset >= 0 && targetOffset <= double(targetLen), 3, "offset is out of bounds of the buffer");
+    luaL_argcheck(L, offset >= 0 && offset <= double(file.size), 4, "offset is out of bounds of the mapped file");
+
+    size_t space = targetLen - size_t(targetOffset);
+    size_t count = lua_isnoneornil(L, 5) ? std::min(space, file.size - size_t(offset)) : size_t(luaL_checknumber(L, 5));
+
+    luaL_argcheck(L, count <= space, 5, "count is out of bounds of the buffer");
+
+    memcpy(target + size_t(targetOffset), checkRange(L, file, offset, count), count);
+
+    lua_pushnumber(L, double(count));
+    return 1;
+}
+
+/* Finds a string in the mapping starting at offset 'init' (defaulting to 0), returns the offset or nil */
+static int mapFind(lua_State* L)
+{
+    MappedFile& file = checkMappedFile(L, 1);
+
+    size_t len = 0;
+    const char* needle = luaL_checklstring(L, 2, &len);
+    double init = luaL_optnumber(L, 3, 0);
+
+    if (init < 0 || init > double(file.size))
+        luaL_argerror(L, 3, "offset is out of bounds of the mapped file");
+
+    std::string_view haystack(file.data, file.size);
+    size_t pos = haystack.find(std::string_view(needle, len), size_t(init));
+
+    if (pos == std::string_view::npos)
+        lua_pushnil(L);
+    else
+        lua_pushnumber(L, double(pos));
+
+    return 1;
+}
+
+static void applyAdvice(lua_State* L, MappedFile& file, int adviceArg)
+{
+    static const char* const advices[] = {"normal", "sequential", "random", "willneed", "dontneed", nullptr};
+    int advice = luaL_checkoption(L, adviceArg, nullptr, advices);
+
+#ifndef _WIN32
+    static const int madvices[] = {MADV_NORMAL, MADV_SEQUENTIAL, MADV_RANDOM, MADV_WILLNEED, MADV_DONTNEED};
+
+    if (file.data && madvise(file.data, file.size, madvices[advice]) != 0)
+        luaL_error(L, "madvise failed: %s", strerror(errno));
+#else
+    if (file.data && advice == 3)
+    {
+        WIN32_MEMORY_RANGE_ENTRY range = {file.data, file.size};
+        PrefetchVirtualMemory(GetCurrentProcess(), 1, &range, 0);
+    }
+#endif
+}
+
+static int mapAdvise(lua_State* L)
+{
+    applyAdvice(L, checkMappedFile(L, 1), 2);
+    return 0;
+}
+
+static int mapSync(lua_State* L)
+{
+    MappedFile& file = checkMappedFile(L, 1);
+
+    if (!file.data || !file.writable)
+        return 0;
+
+#ifdef _WIN32
+    if (!FlushViewOfFile(file.data, file.size))
+        luaL_error(L, "failed to flush mapped file");
+#else
+    if (msync(file.data, file.size, MS_SYNC) != 0)
+        luaL_error(L, "msync failed: %s", strerror(errno));
+#endif
+
+    return 0;
+}
+
+static int mapClose(lua_State* L)
+{
+    MappedFile* file = (MappedFile*)luaL_checkudata(L, 1, kMappedFileType);
+    unmap(*file);
+    return 0;
+}
+
+static const luaL_Reg mappedFileMethods[] = {
+    {"len", mapLen},
+    {"readi8", readValue<int8_t>},
+    {"readu8", readValue<uint8_t>},
+    {"readi16", readValue<int16_t>},
+    {"readu16", readValue<uint16_t>},
+    {"readi32", readValue<int32_t>},
+    {"readu32", readValue<uint32_t>},
+    {"readf32", readValue<float>},
+    {"readf64", readValue<double>},
+    {"readstring", mapReadString},
+    {"writei8", writeValue<int8_t>},
+    {"writeu8", writeValue<uint8_t>},
+    {"writei16", writeValue<int16_t>},
+    {"writeu16", writeValue<uint16_t>},
+    {"writei32", writeValue<int32_t>},
+    {"writeu32", writeValue<uint32_t>},
+    {"writef32", writeValue<float>},
+    {"writef64", writeValue<double>},
+    {"writestring", mapWriteString},
+    {"copyto", mapCopyTo},
+    {"find", mapFind},
+    {"advise", mapAdvise},
+    {"sync", mapSync},
+    {"close", mapClose},
+    {nullptr, nullptr},
+};
+
+static void pushMappedFileMetatable(lua_State* L)
+{
+    if (luaL_newmetatable(L, kMappedFileType))
+    {
+        lua_createtable(L, 0, std::size(mappedFileMethods));
+
+        for (auto& [name, func] : mappedFileMethods)
+        {
+            if (!name || !func)
+                break;
+
+            lua_pushcfunction(L, func, name);
+            lua_setfield(L, -2, name);
+        }
+
+        lua_setreadonly(L, -1, 1);
+        lua_setfield(L, -2, "__index");
+
+        lua_pushcfunction(L, mapLen, "__len");
+        lua_setfield(L, -2, "__len");
+
+        lua_pushstring(L, kMappedFileType);
+        lua_setfield(L, -2, "__type");
+
+        lua_setreadonly(L, -1, 1);
+    }
+}
+
+int map(lua_State* L)
+{
+    lua_settop(L, 3);
+
+    const char* path = luaL_checkstring(L, 1);
+    const char* mode = luaL_optstring(L, 2, "r");
+
+    bool writable = false;
+
+    if (strcmp(mode, "w") == 0 || strcmp(mode, "rw") == 0 || strcmp(mode, "r+") == 0)
+        writable = true;
+    else if (strcmp(mode, "r") != 0)
+        luaL_argerror(L, 2, "mode must be 'r' or 'w'");
+
+    uv_loop_t* loop = &getRuntime(L)->loop;
+
+    uv_fs_t openReq;
+    int fd = uv_fs_open(loop, &openReq, path, writable ? O_RDWR : O_RDONLY, 0, nullptr);
+    uv_fs_req_cleanup(&openReq);
+
+    if (fd < 0)
+        luaL_error(L, "Error opening file %s: %s", path, uv_strerror(fd));
+
+    uv_fs_t statReq;
+    int err = uv_fs_fstat(loop, &statReq, fd, nullptr);
+    size_t size = size_t(statReq.statbuf.st_size);
+    uv_fs_req_cleanup(&statReq);
+
+    MappedFile file;
+    file.size = size;
+    file.writable = writable;
+
+    std::string error;
+
+    if (err < 0)
+    {
+        error = uv_strerror(err);
+    }
+    else if (size != 0)
+    {
+#ifdef _WIN32
+        HANDLE handle = (HANDLE)uv_get_osfhandle(fd);
+        HANDLE mapping = CreateFileMappingA(handle, nullptr, writable ? PAGE_READWRITE : PAGE_READONLY, 0, 0, nullptr);
+
+        if (mapping)
+        {
+            file.data = (char*)MapViewOfFile(mapping, writable ? FILE_MAP_WRITE : FILE_MAP_READ, 0, 0, size);
+
+            // The view keeps the mapping alive
+            CloseHandle(mapping);
+        }
+
+        if (!file.data)
+            error = "failed to map file";
+#else
+        void* data = mmap(nullptr, size, writable ? PROT_READ | PROT_WRITE : PROT_READ, MAP_SHARED, fd, 0);
+
+        if (data == MAP_FAILED)
+            error = strerror(errno);
+        else
+            file.data = (char*)data;
+#endif
+    }
+
+    // The mapping stays valid after the descriptor is closed
+    uv_fs_t closeReq;
+    uv_fs_close(loop, &closeReq, fd, nullptr);
+    uv_fs_req_cleanup(&closeReq);
+
+    if (!error.empty())
+        luaL_error(L, "Error mapping file %s: %s", path, error.c_str());
+
+    MappedFile* result = (MappedFile*)lua_newuserdatadtor(L, sizeof(MappedFile), [](void* userdata) {
+        unmap(*(MappedFile*)userdata);
+    });
+
+    *result = file;
+
+    pushMappedFileMetatable(L);
+    lua_setmetatable(L, -2);
+
+    if (!lua_isnoneornil(L, 3))
+        applyAdvice(L, *result, 3);
+
+    return 1;
+}
+
+} // namespace fs
@@ -0,0 +1,678 @@
+#include "lute/stat.h"
+
+#include "lua.h"
+#include "lualib.h"
+#include "uv.h"
+
+#include "lute/runtime.h"
+
+#include <algorithm>
+#include <atomic>
+#include <filesystem>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <sys/stat.h>
+#include <thread>
+#include <unordered_map>
+#include <vector>
+
+namespace fs
+{
+
+void pushTypeName(lua_State* L, uint64_t mode);
+
+// Every watched directory takes an inotify watch, which are limited per user
+constexpr size_t kMaxWatchedDirectories = 8192;
+
+// statmany splits its paths between this many threadpool tasks, each with at least kMinPathsPerTask paths
+constexpr size_t kStatManyTasks = 4;
+constexpr size_t kMinPathsPerTask = 64;
+
+static int statUncached(const char* path, uv_stat_t* statbuf)
+{
+    uv_fs_t req;
+    int err = uv_fs_stat(nullptr, &req, path, nullptr);
+
+    if (err == 0)
+        *statbuf = req.statbuf;
+
+    uv_fs_req_cleanup(&req);
+    return err;
+}
+
+struct CachedMetadata
+{
+    int err = 0;
+    uv_stat_t statbuf = {};
+};
+
+struct WatchedDirectory
+{
+    // Entries are only cached once the watcher is running, otherwise changes could be missed
+    bool watching = false;
+
+    // Changes whenever the directory starts being watched or changes, so stats which raced with a change aren't cached
+    uint64_t generation = 0;
+
+    // Paths of the cached entries of the directory
+    std::vector<std::string> entries;
+};
+
+// Absolute path used as the cache key for 'path', relative paths are resolved against the working directory
+static bool cacheKey(const char* path, std::string& key)
+{
+#ifndef _WIN32
+    if (path[0] == '/')
+    {
+        key = path;
+    }
+    else
+#endif
+    {
+        std::error_code ec;
+        key = std::filesystem::absolute(path, ec).string();
+
+        if (ec)
+            return false;
+    }
+
+    while (key.size() > 1 && (key.back() == '/' || key.back() == char(std::filesystem::path::preferred_separator)))
+        key.pop_back();
+
+    return true;
+}
+
+class MetadataCache;
+
+// Owned by the watcher thread
+struct DirectoryWatch
+{
+    uv_fs_event_t handle;
+    MetadataCache* cache = nullptr;
+    std::string path;
+
+    // Identity of the directory when the watch started, to notice it being replaced
+    uint64_t dev = 0;
+    uint64_t ino = 0;
+};
+
+// Process-wide stat cache, the directories holding cached entries are watched by a thread of its own
+// so that the cache can be shared by every runtime and invalidated without any of them polling
+class MetadataCache
+{
+public:
+    ~MetadataCache()
+    {
+        if (!watcherThread.joinable())
+            return;
+
+        {
+            std::unique_lock lock(mutex);
+            stopRequested = true;
+        }
+
+        uv_async_send(&wakeup);
+        watcherThread.join();
+    }
+
+    bool isEnabled() const
+    {
+        return enabled.load(std::memory_order_relaxed);
+    }
+
+    void setEnabled(bool enable)
+    {
+        std::unique_lock lock(mutex);
+
+        if (enable == enabled)
+            return;
+
+        enabled = enable;
+
+        if (!enable)
+        {
+            entries.clear();
+            directories.clear();
+            watchRequests.clear();
+            clearRequested = true;
+
+            uv_async_send(&wakeup);
+            return;
+        }
+
+        if (!watcherThread.joinable())
+        {
+            uv_loop_init(&loop);
+
+            uv_async_init(&loop, &wakeup, [](uv_async_t* handle) {
+                ((MetadataCache*)handle->data)->processCommands();
+            });
+            wakeup.data = this;
+
+            watcherThread = std::thread([this] {
+                uv_run(&loop, UV_RUN_DEFAULT);
+                uv_loop_close(&loop);
+            });
+        }
+    }
+
+    int stat(const char* path, uv_stat_t* statbuf)
+    {
+        std::string key;
+
+        if (!cacheKey(path, key))
+            return statUncached(path, statbuf);
+
+        {
+            std::unique_lock lock(mutex);
+
+            // Entries only exist while their directory is watched and unchanged
+            if (auto it = entries.find(key); it != entries.end())
+            {
+                hits++;
+
+                *statbuf = it->second.statbuf;
+                return it->second.err;
+            }
+        }
+
+        std::filesystem::path absolute(key);
+
+        // Roots have no directory to watch them from
+        if (!absolute.has_relative_path())
+            return statUncached(path, statbuf);
+
+        std::string dir = absolute.parent_path().string();
+
+        uint64_t parentGeneration = 0;
+        uint64_t selfGeneration = 0;
+
+        {
+            std::unique_lock lock(mutex);
+
+            if (!enabled)
+                return statUncached(path, statbuf);
+
+            misses++;
+
+            if (WatchedDirectory* parent = findOrWatch(dir))
+                parentGeneration = parent->generation;
+
+            if (auto it = directories.find(key); it != directories.end())
+                selfGeneration = it->second.generation;
+        }
+
+        int err = statUncached(path, statbuf);
+
+        // Transient errors like running out of descriptors aren't worth remembering
+        if (err != 0 && err != UV_ENOENT && err != UV_ENOTDIR)
+            return err;
+
+        std::unique_lock lock(mutex);
+
+        if (!enabled)
+            return err;
+
+        auto parent = directories.find(dir);
+
+        if (parent == directories.end() || !parent->second.watching || parent->second.generation != parentGeneration)
+            return err;
+
+        // The metadata of a directory also changes with its contents, which only its own watch reports
+        if (err == 0 && (statbuf->st_mode & S_IFMT) == S_IFDIR)
+        {
+            WatchedDirectory* self = findOrWatch(key);
+
+            if (!self || !self->watching || self->generation != selfGeneration)
+                return err;
+        }
+
+        if (entries.insert_or_assign(key, CachedMetadata{err, *statbuf}).second)
+            parent->second.entries.push_back(key);
+
+        return err;
+    }
+
+    void pushCounters(lua_State* L)
+    {
+        std::unique_lock lock(mutex);
+
+        size_t watching = 0;
+
+        for (auto& [_, directory] : directories)
+            watching += directory.watching;
+
+        lua_createtable(L, 0, 6);
+
+        lua_pushboolean(L, enabled);
+        lua_setfield(L, -2, "enabled");
+
+        lua_pushnumber(L, double(entries.size()));
+        lua_setfield(L, -2, "entries");
+
+        lua_pushnumber(L, double(watching));
+        lua_setfield(L, -2, "directories");
+
+        lua_pushnumber(L, double(hits));
+        lua_setfield(L, -2, "hits");
+
+        lua_pushnumber(L, double(misses));
+        lua_setfield(L, -2, "misses");
+
+        lua_pushnumber(L, double(invalidations));
+        lua_setfield(L, -2, "invalidations");
+    }
+
+private:
+    // Must be called with the mutex held, returns nullptr once too many directories are watched
+    WatchedDirectory* findOrWatch(const std::string& dir)
+    {
+        if (auto it = directories.find(dir); it != directories.end())
+            return &it->second;
+
+        if (directories.size() >= kMaxWatchedDirectories)
+            return nullptr;
+
+        WatchedDirectory& directory = directories[dir];
+        directory.generation = ++nextGeneration;
+
+        watchRequests.push_back(dir);
+        uv_async_send(&wakeup);
+
+        return &directory;
+    }
+
+    // Must be called with the mutex held
+    void invalidate(const std::string& dir)
+    {
+        auto it = directories.find(dir);
+
+        if (it == directories.end())
+            return;
+
+        invalidations++;
+
+        for (const std::string& key : it->second.entries)
+            entries.erase(key);
+
+        it->second.entries.clear();
+        it->second.generation = ++nextGeneration;
+
+        // The directory's own metadata is cached with its parent
+        entries.erase(dir);
+    }
+
+    void processCommands()
+    {
+        std::vector<std::string> requests;
+        bool clear = false;
+        bool stop = false;
+
+        {
+            std::unique_lock lock(mutex);
+
+            requests.swap(watchRequests);
+            std::swap(clear, clearRequested);
+            stop = stopRequested;
+        }
+
+        if (clear || stop)
+        {
+            for (auto& [_, watch] : watches)
+                closeWatch(watch);
+
+            watches.clear();
+        }
+
+        if (stop)
+        {
+            uv_close((uv_handle_t*)&wakeup, nullptr);
+            return;
+        }
+
+        for (const std::string& dir : requests)
+            startWatch(dir);
+    }
+
+    void startWatch(const std::string& dir)
+    {
+        if (watches.count(dir))
+            return;
+
+        DirectoryWatch* watch = new DirectoryWatch{};
+        watch->cache = this;
+        watch->path = dir;
+        watch->handle.data = watch;
+
+        uv_fs_event_init(&loop, &watch->handle);
+
+        int err = uv_fs_event_start(&watch->handle, onEvent, dir.c_str(), 0);
+
+        uv_stat_t statbuf = {};
+
+        if (err == 0)
+            err = statUncached(dir.c_str(), &statbuf);
+
+        std::unique_lock lock(mutex);
+
+        auto it = directories.find(dir);
+
+        // The cache was cleared while the request was queued
+        if (it == directories.end() || it->second.watching)
+        {
+            closeWatch(watch);
+            return;
+        }
+
+        // Directories which can't be watched are forgotten, so they are retried if they appear later
+        if (err != 0)
+        {
+            directories.erase(it);
+            closeWatch(watch);
+            return;
+        }
+
+        watch->dev = statbuf.st_dev;
+        watch->ino = statbuf.st_ino;
+        watches[dir] = watch;
+
+        it->second.watching = true;
+        it->second.generation = ++nextGeneration;
+    }
+
+    static void onEvent(uv_fs_event_t* handle, const char* filename, int events, int status)
+    {
+        DirectoryWatch* watch = (DirectoryWatch*)handle->data;
+        MetadataCache* cache = watch->cache;
+
+        // Renames are also reported when the directory itself is removed or replaced, which ends the watch
+        bool replaced = status < 0;
+
+        if (!replaced && (events & UV_RENAME))
+        {
+            uv_stat_t statbuf;
+            replaced = statUncached(watch->path.c_str(), &statbuf) != 0 || statbuf.st_dev != watch->dev || statbuf.st_ino != watch->ino;
+        }
+
+        std::unique_lock lock(cache->mutex);
+
+        cache->invalidate(watch->path);
+
+        if (replaced)
+        {
+            cache->directories.erase(watch->path);
+            cache->watches.erase(watch->path);
+
+            closeWatch(watch);
+        }
+    }
+
+    static void closeWatch(DirectoryWatch* watch)
+    {
+        uv_close((uv_handle_t*)&watch->handle, [](uv_handle_t* handle) {
+            delete (DirectoryWatch*)handle->data;
+        });
+    }
+
+    std::atomic<bool> enabled = false;
+
+    std::mutex mutex;
+    std::unordered_map<std::string, CachedMetadata> entries;
+    std::unordered_map<std::string, WatchedDirectory> directories;
+    uint64_t nextGeneration = 0;
+
+    uint64_t hits = 0;
+    uint64_t misses = 0;
+    uint64_t invalidations = 0;
+
+    // Commands for the watcher thread
+    std::vector<std::string> watchRequests;
+    bool clearRequested = false;
+    bool stopRequested = false;
+
+    uv_loop_t loop;
+    uv_async_t wakeup;
+    std::thread watcherThread;
+
+    // Only used by the watcher thread
+    std::unordered_map<std::string, DirectoryWatch*> watches;
+};
+
+static MetadataCache& getMetadataCache()
+{
+    static MetadataCache cache;
+    return cache;
+}
+
+int statPath(const char* path, uv_stat_t* statbuf)
+{
+    MetadataCache& cache = getMetadataCache();
+
+    if (!cache.isEnabled())
+        return statUncached(path, statbuf);
+
+    return cache.stat(path, statbuf);
+}
+
+static double toSeconds(const uv_timespec_t& time)
+{
+    return double(time.tv_sec) + double(time.tv_nsec) / 1e9;
+}
+
+static void pushMetadata(lua_State* L, const uv_stat_t& statbuf)
+{
+    lua_createtable(L, 0, 7);
+
+    pushTypeName(L, statbuf.st_mode);
+    lua_setfield(L, -2, "type");
+
+    lua_pushnumber(L, double(statbuf.st_size));
+    lua_setfield(L, -2, "size");
+
+    lua_pushnumber(L, double(statbuf.st_mode & 07777));
+    lua_setfield(L, -2, "mode");
+
+    lua_pushnumber(L, toSeconds(statbuf.st_atim));
+    lua_setfield(L, -2, "atime");
+
+    lua_pushnumber(L, toSeconds(statbuf.st_mtim));
+    lua_setfield(L, -2, "mtime");
+
+    lua_pushnumber(L, toSeconds(statbuf.st_ctim));
+    lua_setfield(L, -2, "ctime");
+
+    lua_pushnumber(L, toSeconds(statbuf.st_birthtim));
+    lua_setfield(L, -2, "birthtime");
+}
+
+int stat(lua_State* L)
+{
+    const char* path = luaL_checkstring(L, 1);
+
+    uv_stat_t statbuf;
+
+    if (int err = statPath(path, &statbuf))
+        luaL_errorL(L, "Error getting the metadata of %s: %s", path, uv_strerror(err));
+
+    pushMetadata(L, statbuf);
+    return 1;
+}
+
+// With io_uring, stats are submitted on the runtime loop and this many are kept in flight
+constexpr size_t kMaxStatsInFlight = 64;
+
+struct StatBatch
+{
+    std::vector<std::string> paths;
+    std::vector<CachedMetadata> results;
+
+    std::atomic<size_t> remaining = 0;
+    ResumeToken token;
+
+    // Only used when the stats are submitted on the loop
+    uv_loop_t* loop = nullptr;
+    size_t next = 0;
+    size_t inFlight = 0;
+};
+
+struct StatRequest
+{
+    uv_fs_t req;
+    std::shared_ptr<StatBatch> batch;
+    size_t index = 0;
+};
+
+static void completeStats(const std::shared_ptr<StatBatch>& batch)
+{
+    batch->token->complete([batch](lua_State* L) {
+        lua_createtable(L, int(batch->results.size()), 0);
+
+        for (size_t i = 0; i < batch->results.size(); i++)
+        {
+            if (batch->results[i].err == 0)
+                pushMetadata(L, batch->results[i].statbuf);
+            else
+                lua_pushboolean(L, false);
+
+            lua_rawseti(L, -2, int(i + 1));
+        }
+
+        return 1;
+    });
+}
+
+static void submitStats(const std::shared_ptr<StatBatch>& batch);
+
+static void recordStat(StatBatch& batch, size_t index, int err, const uv_stat_t* statbuf)
+{
+    CachedMetadata& result = batch.results[index];
+    result.err = err;
+
+    if (statbuf)
+        result.statbuf = *statbuf;
+
+    batch.remaining--;
+}
+
+// Starts stats until the window is full, paths which can't be submitted are finished right away
+static void submitStats(const std::shared_ptr<StatBatch>& batch)
+{
+    while (batch->next < batch->paths.size() && batch->inFlight < kMaxStatsInFlight)
+    {
+        StatRequest* request = new StatRequest();
+        request->req.data = request;
+        request->batch = batch;
+        request->index = batch->next++;
+
+        int err = uv_fs_stat(batch->loop, &request->req, batch->paths[request->index].c_str(), [](uv_fs_t* req) {
+            StatRequest* request = (StatRequest*)req->data;
+            std::shared_ptr<StatBatch> batch = std::move(request->batch);
+
+            int err = int(req->result);
+
+            recordStat(*batch, request->index, err, err == 0 ? &req->statbuf : nullptr);
+
+            uv_fs_req_cleanup(req);
+            delete request;
+
+            batch->inFlight--;
+            submitStats(batch);
+        });
+
+        if (err < 0)
+        {
+            recordStat(*batch, request->index, err, nullptr);
+            delete request;
+        }
+        else
+        {
+            batch->inFlight++;
+        }
+    }
+
+    if (batch->remaining == 0)
+        completeStats(batch);
+}
+
+int statmany(lua_State* L)
+{
+    luaL_checktype(L, 1, LUA_TTABLE);
+
+    size_t count = lua_objlen(L, 1);
+
+    auto batch = std::make_shared<StatBatch>();
+    batch->paths.reserve(count);
+
+    for (size_t i = 0; i < count; i++)
+    {
+        lua_rawgeti(L, 1, int(i + 1));
+
+        if (!lua_isstring(L, -1))
+            luaL_argerror(L, 1, "expected an array of paths");
+
+        batch->paths.push_back(lua_tostring(L, -1));
+        lua_pop(L, 1);
+    }
+
+    if (count == 0)
+    {
+        lua_createtable(L, 0, 0);
+        return 1;
+    }
+
+    batch->results.resize(count);
+    batch->token = getResumeToken(L);
+
+    Runtime* runtime = getRuntime(L);
+
+    // The ring takes the stats without a thread switch per path, the cache is only consulted by the threadpool path
+    if (runtime->ioUring && !getMetadataCache().isEnabled())
+    {
+        batch->loop = &runtime->loop;
+        batch->remaining = count;
+
+        submitStats(batch);
+
+        return lua_yield(L, 0);
+    }
+
+    size_t tasks = std::clamp(count / kMinPathsPerTask, size_t(1), kStatManyTasks);
+
+    batch->remaining = tasks;
+
+    for (size_t task = 0; task < tasks; task++)
+    {
+        size_t begin = count * task / tasks;
+        size_t end = count * (task + 1) / tasks;
+
+        runtime->runInWorkQueue([batch, begin, end] {
+            for (size_t i = begin; i < end; i++)
+            {
+                CachedMetadata& result = batch->results[i];
+                result.err = statPath(batch->paths[i].c_str(), &result.statbuf);
+            }
+
+            if (batch->remaining.fetch_sub(1) == 1)
+                completeStats(batch);
+        });
+    }
+
+    return lua_yield(L, 0);
+}
+
+int statcache(lua_State* L)
+{
+    MetadataCache& cache = getMetadataCache();
+
+    if (!lua_isnoneornil(L, 1))
+    {
+        luaL_checktype(L, 1, LUA_TBOOLEAN);
+        cache.setEnabled(lua_toboolean(L, 1));
+    }
+
+    cache.pushCounters(L);
+    return 1;
+}
+
+} // namespace fs
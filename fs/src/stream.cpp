@@ -0,0 +1,508 @@
+#include "lute/stream.h"
+
+#include "lua.h"
+#include "lualib.h"
+#include "uv.h"
+
+#include "lute/ref.h"
+#include "lute/runtime.h"
+
+#include <cstdint>
+#include <cstring>
+#include <fcntl.h>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <vector>
+
+namespace fs
+{
+
+static const char* kFileStreamType = "FileStream";
+
+constexpr size_t kDefaultChunkSize = 64 * 1024;
+constexpr int kDefaultReadahead = 4;
+
+enum class ChunkStatus
+{
+    Ready,
+    Pending,
+    Eof,
+    Error,
+};
+
+struct StreamState
+{
+    ~StreamState()
+    {
+        if (fd >= 0)
+        {
+            uv_fs_t closeReq;
+            uv_fs_close(nullptr, &closeReq, fd, nullptr);
+            uv_fs_req_cleanup(&closeReq);
+        }
+    }
+
+    Runtime* runtime = nullptr;
+    uv_file fd = -1;
+
+    size_t chunkSize = kDefaultChunkSize;
+    int readahead = kDefaultReadahead;
+
+    std::mutex mutex;
+
+    // Chunks are read at fixed offsets, so several reads can be in flight and complete out of order
+    uint64_t nextIssue = 0;
+    uint64_t nextConsume = 0;
+    uint64_t eofChunk = UINT64_MAX;
+    int inFlight = 0;
+    int error = 0;
+    bool closed = false;
+
+    std::map<uint64_t, std::vector<char>> completed;
+    std::vector<std::vector<char>> freeChunks;
+
+    // Coroutine waiting for the next chunk to arrive
+    ResumeToken waiter;
+    std::shared_ptr<Ref> waiterSelf;
+
+    // Partial line carried over between chunks by 'readline' and 'lines'
+    std::string pendingLine;
+};
+
+using StreamPtr = std::shared_ptr<StreamState>;
+
+static void wakeWaiter(std::unique_lock<std::mutex>& lock, StreamState& state)
+{
+    if (!state.waiter)
+        return;
+
+    ResumeToken waiter = std::move(state.waiter);
+    std::shared_ptr<Ref> self = std::move(state.waiterSelf);
+
+    lock.unlock();
+
+    // The waiting call is finished by its continuation with the stream passed back in
+    waiter->complete([self = std::move(self)](lua_State* L) {
+        self->push(L);
+        return 1;
+    });
+}
+
+static void readChunk(const StreamPtr& state, uint64_t index, std::vector<char> data)
+{
+    data.resize(state->chunkSize);
+
+    size_t total = 0;
+    int error = 0;
+
+    while (total < data.size())
+    {
+        uv_buf_t iov = uv_buf_init(data.data() + total, unsigned(data.size() - total));
+
+        uv_fs_t readReq;
+        int64_t offset = int64_t(index * state->chunkSize + total);
+        ssize_t numBytesRead = uv_fs_read(nullptr, &readReq, state->fd, &iov, 1, offset, nullptr);
+        uv_fs_req_cleanup(&readReq);
+
+        if (numBytesRead < 0)
+        {
+            error = int(numBytesRead);
+            break;
+        }
+
+        if (numBytesRead == 0)
+            break;
+
+        total += numBytesRead;
+    }
+
+    data.resize(total);
+
+    std::unique_lock lock(state->mutex);
+
+    state->inFlight--;
+
+    if (error != 0)
+        state->error = error;
+    else if (total < state->chunkSize && index < state->eofChunk)
+        state->eofChunk = index;
+
+    state->completed[index] = std::move(data);
+
+    // Reads can finish out of order, the waiting coroutine only needs to run once the next chunk is here
+    if (index == state->nextConsume || state->error != 0)
+        wakeWaiter(lock, *state);
+}
+
+// Keeps 'readahead' chunks read or in flight ahead of the consumer, must be called on the runtime thread
+static void fill(const StreamPtr& state, std::unique_lock<std::mutex>& lock)
+{
+    while (!state->closed && state->error == 0 && state->nextIssue <= state->eofChunk &&
+           int(state->nextIssue - state->nextConsume) < state->readahead)
+    {
+        uint64_t index = state->nextIssue++;
+        state->inFlight++;
+
+        std::vector<char> data;
+
+        if (!state->freeChunks.empty())
+        {
+            data = std::move(state->freeChunks.back());
+            state->freeChunks.pop_back();
+        }
+
+        state->runtime->runInWorkQueue([state, index, data = std::move(data)]() mutable {
+            readChunk(state, index, std::move(data));
+        });
+    }
+}
+
+static ChunkStatus takeChunk(const StreamPtr& state, std::unique_lock<std::mutex>& lock, std::vector<char>& out)
+{
+    fill(state, lock);
+
+    if (state->closed)
+        return ChunkStatus::Eof;
+
+    if (state->error != 0)
+        return ChunkStatus::Error;
+
+    if (state->nextConsume > state->eofChunk)
+        return ChunkStatus::Eof;
+
+    auto it = state->completed.find(state->nextConsume);
+
+    if (it == state->completed.end())
+        return ChunkStatus::Pending;
+
+    out = std::move(it->second);
+    state->completed.erase(it);
+    state->nextConsume++;
+
+    fill(state, lock);
+
+    // The last chunk of a file which is a multiple of the chunk size is empty
+    if (out.empty())
+        return ChunkStatus::Eof;
+
+    return ChunkStatus::Ready;
+}
+
+static void recycleChunk(StreamState& state, std::vector<char>&& chunk)
+{
+    std::unique_lock lock(state.mutex);
+
+    if (int(state.freeChunks.size()) < state.readahead)
+        state.freeChunks.push_back(std::move(chunk));
+}
+
+// Splits the next line off the pending data, without the line terminator
+static bool takeLine(StreamState& state, std::string& line, bool atEof)
+{
+    size_t pos = state.pendingLine.find('\n');
+
+    if (pos == std::string::npos)
+    {
+        if (!atEof || state.pendingLine.empty())
+            return false;
+
+        pos = state.pendingLine.size();
+    }
+
+    size_t end = pos > 0 && state.pendingLine[pos - 1] == '\r' ? pos - 1 : pos;
+
+    line.assign(state.pendingLine, 0, end);
+    state.pendingLine.erase(0, pos + 1);
+    return true;
+}
+
+static StreamPtr& checkStream(lua_State* L, int idx)
+{
+    StreamPtr& state = *(StreamPtr*)luaL_checkudata(L, idx, kFileStreamType);
+
+    if (state->closed)
+        luaL_error(L, "file stream is closed");
+
+    return state;
+}
+
+static void pushChunk(lua_State* L, const std::vector<char>& chunk)
+{
+    void* data = lua_newbuffer(L, chunk.size());
+    memcpy(data, chunk.data(), chunk.size());
+}
+
+static int yieldForChunk(lua_State* L, const StreamPtr& state, std::unique_lock<std::mutex>& lock)
+{
+    if (state->waiter)
+        luaL_error(L, "file stream is already being read by another coroutine");
+
+    state->waiter = getResumeToken(L);
+    state->waiterSelf = std::make_shared<Ref>(L, 1);
+
+    lock.unlock();
+
+    return lua_yield(L, 0);
+}
+
+// Iterators can't yield, so the loop is driven from here instead, each read finishing on the threadpool wakes it
+static void pumpForChunk(const StreamPtr& state, std::unique_lock<std::mutex>& lock)
+{
+    lock.unlock();
+
+    uv_run(&state->runtime->loop, UV_RUN_ONCE);
+
+    lock.lock();
+}
+
+// Pushes the next chunk as a buffer or nil at the end of the file, waiting for it to be read when necessary
+static int pushNextChunk(lua_State* L, const StreamPtr& state, bool canYield)
+{
+    std::vector<char> chunk;
+
+    std::unique_lock lock(state->mutex);
+
+    for (;;)
+    {
+        ChunkStatus status = takeChunk(state, lock, chunk);
+
+        if (status == ChunkStatus::Ready)
+        {
+            lock.unlock();
+            pushChunk(L, chunk);
+            recycleChunk(*state, std::move(chunk));
+            return 1;
+        }
+
+        if (status == ChunkStatus::Eof)
+        {
+            lua_pushnil(L);
+            return 1;
+        }
+
+        if (status == ChunkStatus::Error)
+        {
+            lock.unlock();
+            luaL_error(L, "Error reading file stream: %s", uv_strerror(state->error));
+        }
+
+        if (canYield)
+            return yieldForChunk(L, state, lock);
+
+        pumpForChunk(state, lock);
+    }
+}
+
+// Pushes the next line without its terminator or nil at the end of the file
+static int pushNextLine(lua_State* L, const StreamPtr& state, bool canYield)
+{
+    std::string line;
+    std::vector<char> chunk;
+
+    std::unique_lock lock(state->mutex);
+
+    while (!takeLine(*state, line, false))
+    {
+        ChunkStatus status = takeChunk(state, lock, chunk);
+
+        if (status == ChunkStatus::Ready)
+        {
+            state->pendingLine.append(chunk.data(), chunk.size());
+
+            if (int(state->freeChunks.size()) < state->readahead)
+                state->freeChunks.push_back(std::move(chunk));
+
+            continue;
+        }
+
+        if (status == ChunkStatus::Eof)
+        {
+            if (takeLine(*state, line, true))
+                break;
+
+            lua_pushnil(L);
+            return 1;
+        }
+
+        if (status == ChunkStatus::Error)
+        {
+            lock.unlock();
+            luaL_error(L, "Error reading file stream: %s", uv_strerror(state->error));
+        }
+
+        if (canYield)
+            return yieldForChunk(L, state, lock);
+
+        pumpForChunk(state, lock);
+    }
+
+    lock.unlock();
+
+    lua_pushlstring(L, line.data(), line.size());
+    return 1;
+}
+
+static int streamRead(lua_State* L)
+{
+    return pushNextChunk(L, checkStream(L, 1), true);
+}
+
+static int streamReadCont(lua_State* L, int status)
+{
+    // Resumed with the stream as the only argument once the next chunk is ready, continuations cannot yield again
+    return pushNextChunk(L, checkStream(L, 1), false);
+}
+
+static int streamReadLine(lua_State* L)
+{
+    return pushNextLine(L, checkStream(L, 1), true);
+}
+
+static int streamReadLineCont(lua_State* L, int status)
+{
+    // A line spanning more than the chunk that woke us up drives the loop until the rest arrives
+    return pushNextLine(L, checkStream(L, 1), false);
+}
+
+static int chunksIterator(lua_State* L)
+{
+    return pushNextChunk(L, checkStream(L, lua_upvalueindex(1)), false);
+}
+
+static int linesIterator(lua_State* L)
+{
+    return pushNextLine(L, checkStream(L, lua_upvalueindex(1)), false);
+}
+
+/* Iterators do not yield: when the next chunk has not been read ahead yet, they drive the loop until it arrives */
+static int streamChunks(lua_State* L)
+{
+    checkStream(L, 1);
+
+    lua_pushvalue(L, 1);
+    lua_pushcclosure(L, chunksIterator, "chunks", 1);
+    return 1;
+}
+
+static int streamLines(lua_State* L)
+{
+    checkStream(L, 1);
+
+    lua_pushvalue(L, 1);
+    lua_pushcclosure(L, linesIterator, "lines", 1);
+    return 1;
+}
+
+static int streamClose(lua_State* L)
+{
+    StreamPtr& state = *(StreamPtr*)luaL_checkudata(L, 1, kFileStreamType);
+
+    std::unique_lock lock(state->mutex);
+
+    // In-flight reads hold on to the state, the descriptor is closed when the last of them finishes
+    state->closed = true;
+    state->completed.clear();
+    state->freeChunks.clear();
+    state->pendingLine.clear();
+
+    // A coroutine still waiting on the stream will fail with an error once resumed
+    wakeWaiter(lock, *state);
+
+    return 0;
+}
+
+static void pushFileStreamMetatable(lua_State* L)
+{
+    if (luaL_newmetatable(L, kFileStreamType))
+    {
+        lua_createtable(L, 0, 5);
+
+        lua_pushcclosurek(L, streamRead, "read", 0, streamReadCont);
+        lua_setfield(L, -2, "read");
+
+        lua_pushcclosurek(L, streamReadLine, "readline", 0, streamReadLineCont);
+        lua_setfield(L, -2, "readline");
+
+        lua_pushcfunction(L, streamChunks, "chunks");
+        lua_setfield(L, -2, "chunks");
+
+        lua_pushcfunction(L, streamLines, "lines");
+        lua_setfield(L, -2, "lines");
+
+        lua_pushcfunction(L, streamClose, "close");
+        lua_setfield(L, -2, "close");
+
+        lua_setreadonly(L, -1, 1);
+        lua_setfield(L, -2, "__index");
+
+        lua_pushstring(L, kFileStreamType);
+        lua_setfield(L, -2, "__type");
+
+        lua_setreadonly(L, -1, 1);
+    }
+}
+
+int stream(lua_State* L)
+{
+    const char* path = luaL_checkstring(L, 1);
+
+    size_t chunkSize = kDefaultChunkSize;
+    int readahead = kDefaultReadahead;
+
+    if (!lua_isnoneornil(L, 2))
+    {
+        luaL_checktype(L, 2, LUA_TTABLE);
+
+        lua_getfield(L, 2, "chunkSize");
+        if (!lua_isnil(L, -1))
+            chunkSize = size_t(luaL_checknumber(L, -1));
+        lua_pop(L, 1);
+
+        lua_getfield(L, 2, "readahead");
+        if (!lua_isnil(L, -1))
+            readahead = luaL_checkinteger(L, -1);
+        lua_pop(L, 1);
+
+        luaL_argcheck(L, chunkSize > 0 && chunkSize <= 1024 * 1024 * 1024, 2, "chunkSize must be between 1 byte and 1GB");
+        luaL_argcheck(L, readahead > 0, 2, "readahead must be positive");
+    }
+
+    uv_fs_t openReq;
+    int fd = uv_fs_open(nullptr, &openReq, path, O_RDONLY, 0, nullptr);
+    uv_fs_req_cleanup(&openReq);
+
+    if (fd < 0)
+        luaL_error(L, "Error opening file %s: %s", path, uv_strerror(fd));
+
+    auto state = std::make_shared<StreamState>();
+    state->runtime = getRuntime(L);
+    state->fd = fd;
+    state->chunkSize = chunkSize;
+    state->readahead = readahead;
+
+    StreamPtr* result = (StreamPtr*)lua_newuserdatadtor(L, sizeof(StreamPtr), [](void* userdata) {
+        StreamPtr& state = *(StreamPtr*)userdata;
+
+        {
+            std::unique_lock lock(state->mutex);
+            state->closed = true;
+        }
+
+        state.~StreamPtr();
+    });
+
+    new (result) StreamPtr(state);
+
+    pushFileStreamMetatable(L);
+    lua_setmetatable(L, -2);
+
+    // Start reading ahead right away
+    std::unique_lock lock(state->mutex);
+    fill(state, lock);
+
+    return 1;
+}
+
+} // namespace fs
@@ -0,0 +1,687 @@
+#include "lute/walk.h"
+
+#include "lua.h"
+#include "lualib.h"
+#include "uv.h"
+
+#include "lute/ref.h"
+#include "lute/runtime.h"
+
+#include <algorithm>
+#include <cstdint>
+#include <deque>
+#include <memory>
+#include <mutex>
+#include <set>
+#include <string>
+#include <sys/stat.h>
+#include <utility>
+#include <vector>
+
+#if !defined(S_ISDIR) && defined(S_IFMT) && defined(S_IFDIR)
+#define S_ISDIR(m) (((m) & S_IFMT) == S_IFDIR)
+#endif
+
+namespace fs
+{
+
+extern const char* UV_DIRENT_TYPES[];
+
+static const char* kWalkerType = "Walker";
+
+constexpr size_t kDefaultWalkBatchSize = 1024;
+// Matches the default size of the libuv threadpool
+constexpr int kWalkWorkers = 4;
+// Workers return to the threadpool once this many batches are waiting for the script, taking a batch submits them again
+constexpr size_t kMaxQueuedBatches = 16;
+// Entries requested from each readdir call
+constexpr unsigned kReaddirEntries = 256;
+
+struct WalkBatch
+{
+    std::vector<std::string> paths;
+    std::vector<uv_dirent_type_t> types;
+};
+
+struct PendingDirectory
+{
+    std::string path;
+    std::string relative;
+    int depth = 0;
+};
+
+struct WalkState
+{
+    Runtime* runtime = nullptr;
+
+    std::string glob;
+    bool matchNames = true;
+    int maxDepth = INT32_MAX;
+    bool followLinks = false;
+    size_t batchSize = kDefaultWalkBatchSize;
+
+    std::mutex mutex;
+
+    std::vector<PendingDirectory> pending;
+    int scanning = 0;
+    int activeWorkers = 0;
+    bool spawnScheduled = false;
+    bool done = false;
+    bool cancelled = false;
+
+    // Set while the runtime thread drives the loop waiting for a batch, workers wake it up as they publish one
+    bool pumping = false;
+
+    WalkBatch current;
+    std::deque<WalkBatch> batches;
+
+    // Directories entered through links, as {device, inode}, so that link cycles are only walked once
+    std::set<std::pair<uint64_t, uint64_t>> visited;
+
+    ResumeToken waiter;
+    std::shared_ptr<Ref> waiterSelf;
+};
+
+using WalkPtr = std::shared_ptr<WalkState>;
+
+// Matches 'str' against a glob where '*' and '?' stay within a path segment, '**' spans segments and [...] is a character class
+static bool globMatch(const char* p, const char* s)
+{
+    while (*p)
+    {
+        if (p[0] == '*' && p[1] == '*')
+        {
+            p += 2;
+
+            // '**/' also matches no directories at all, but never the middle of a name
+            if (*p == '/')
+            {
+                p++;
+
+                for (const char* t = s;; t++)
+                {
+                    if ((t == s || t[-1] == '/') && globMatch(p, t))
+                        return true;
+
+                    if (!*t)
+                        return false;
+                }
+            }
+
+            for (const char* t = s;; t++)
+            {
+                if (globMatch(p, t))
+                    return true;
+
+                if (!*t)
+                    return false;
+            }
+        }
+
+        if (*p == '*')
+        {
+            p++;
+
+            for (const char* t = s;; t++)
+            {
+                if (globMatch(p, t))
+                    return true;
+
+                if (!*t || *t == '/')
+                    return false;
+            }
+        }
+
+        if (!*s)
+            return false;
+
+        if (*p == '?')
+        {
+            if (*s == '/')
+                return false;
+
+            p++;
+            s++;
+            continue;
+        }
+
+        if (*p == '[')
+        {
+            const char* q = p + 1;
+            bool negate = *q == '!' || *q == '^';
+
+            if (negate)
+                q++;
+
+            const char* start = q;
+            bool matched = false;
+
+            while (*q && (*q != ']' || q == start))
+            {
+                if (q[1] == '-' && q[2] && q[2] != ']')
+                {
+                    matched |= *s >= q[0] && *s <= q[2];
+                    q += 3;
+                }
+                else
+                {
+                    matched |= *q == *s;
+                    q++;
+                }
+            }
+
+            // An unterminated class is an ordinary '['
+            if (*q == ']')
+            {
+                if (matched == negate || *s == '/')
+                    return false;
+
+                p = q + 1;
+                s++;
+                continue;
+            }
+        }
+
+        if (*p != *s)
+            return false;
+
+        p++;
+        s++;
+    }
+
+    return !*s;
+}
+
+static bool matches(const WalkState& state, const std::string& relative, const char* name)
+{
+    if (state.glob.empty())
+        return true;
+
+    return globMatch(state.glob.c_str(), state.matchNames ? name : relative.c_str());
+}
+
+static uv_dirent_type_t typeFromMode(uint64_t mode)
+{
+    if (S_ISDIR(mode))
+        return UV_DIRENT_DIR;
+#ifdef S_ISREG
+    if (S_ISREG(mode))
+        return UV_DIRENT_FILE;
+#endif
+#ifdef S_ISLNK
+    if (S_ISLNK(mode))
+        return UV_DIRENT_LINK;
+#endif
+#ifdef S_ISFIFO
+    if (S_ISFIFO(mode))
+        return UV_DIRENT_FIFO;
+#endif
+#ifdef S_ISSOCK
+    if (S_ISSOCK(mode))
+        return UV_DIRENT_SOCKET;
+#endif
+#ifdef S_ISCHR
+    if (S_ISCHR(mode))
+        return UV_DIRENT_CHAR;
+#endif
+#ifdef S_ISBLK
+    if (S_ISBLK(mode))
+        return UV_DIRENT_BLOCK;
+#endif
+    return UV_DIRENT_UNKNOWN;
+}
+
+static void wakeWaiter(std::unique_lock<std::mutex>& lock, WalkState& state)
+{
+    if (!state.waiter || (state.batches.empty() && !state.done && !state.cancelled))
+        return;
+
+    ResumeToken waiter = std::move(state.waiter);
+    std::shared_ptr<Ref> self = std::move(state.waiterSelf);
+
+    lock.unlock();
+
+    // The waiting call is finished by its continuation with the walker passed back in
+    waiter->complete([self = std::move(self)](lua_State* L) {
+        self->push(L);
+        return 1;
+    });
+}
+
+// Moves entries found by a worker into the shared batches, must be called with the lock held
+static void publish(WalkState& state, WalkBatch& found)
+{
+    for (size_t i = 0; i < found.paths.size(); i++)
+    {
+        state.current.paths.push_back(std::move(found.paths[i]));
+        state.current.types.push_back(found.types[i]);
+
+        if (state.current.paths.size() >= state.batchSize)
+        {
+            state.batches.push_back(std::move(state.current));
+            state.current = {};
+        }
+    }
+
+    found.paths.clear();
+    found.types.clear();
+}
+
+// Reads one directory, collecting matching entries into 'found' and subdirectories to walk into 'subdirectories'
+static void scanDirectory(WalkState& state, const PendingDirectory& directory, WalkBatch& found, std::vector<PendingDirectory>& subdirectories)
+{
+    uv_fs_t openReq;
+    int err = uv_fs_opendir(nullptr, &openReq, directory.path.c_str(), nullptr);
+    uv_dir_t* dir = (uv_dir_t*)openReq.ptr;
+    uv_fs_req_cleanup(&openReq);
+
+    // Directories which can't be read, usually for lack of permissions, are skipped like 'find' does
+    if (err < 0)
+        return;
+
+    uv_dirent_t entries[kReaddirEntries];
+    dir->dirents = entries;
+    dir->nentries = kReaddirEntries;
+
+    for (;;)
+    {
+        uv_fs_t readReq;
+        int count = uv_fs_readdir(nullptr, &readReq, dir, nullptr);
+
+        if (count <= 0)
+        {
+            uv_fs_req_cleanup(&readReq);
+            break;
+        }
+
+        for (int i = 0; i < count; i++)
+        {
+            const char* name = entries[i].name;
+            uv_dirent_type_t type = entries[i].type;
+
+            std::string path = directory.path;
+
+            if (path.back() != '/')
+                path += '/';
+
+            path += name;
+            std::string relative = directory.relative.empty() ? name : directory.relative + "/" + name;
+
+            bool enter = false;
+
+            if (type == UV_DIRENT_UNKNOWN || (type == UV_DIRENT_LINK && state.followLinks))
+            {
+                uv_fs_t statReq;
+                int statErr = state.followLinks ? uv_fs_stat(nullptr, &statReq, path.c_str(), nullptr)
+                                                : uv_fs_lstat(nullptr, &statReq, path.c_str(), nullptr);
+
+                if (statErr == 0)
+                {
+                    type = typeFromMode(statReq.statbuf.st_mode);
+
+                    if (type == UV_DIRENT_DIR && state.followLinks)
+                    {
+                        std::unique_lock lock(state.mutex);
+                        enter = state.visited.insert({statReq.statbuf.st_dev, statReq.statbuf.st_ino}).second;
+                    }
+                }
+
+                uv_fs_req_cleanup(&statReq);
+            }
+            else if (type == UV_DIRENT_DIR)
+            {
+                enter = true;
+            }
+
+            if (enter && directory.depth + 1 < state.maxDepth)
+                subdirectories.push_back({path, relative, directory.depth + 1});
+
+            if (matches(state, relative, name))
+            {
+                found.paths.push_back(std::move(path));
+                found.types.push_back(type);
+            }
+        }
+
+        uv_fs_req_cleanup(&readReq);
+    }
+
+    uv_fs_t closeReq;
+    uv_fs_closedir(nullptr, &closeReq, dir, nullptr);
+    uv_fs_req_cleanup(&closeReq);
+}
+
+static void walkWorker(const WalkPtr& state);
+
+// Submits workers for the directories waiting to be scanned, must be called on the runtime thread with the lock held
+static void spawnWorkers(const WalkPtr& state)
+{
+    size_t wanted = std::min(size_t(kWalkWorkers), state->pending.size() + size_t(state->scanning));
+
+    while (!state->cancelled && size_t(state->activeWorkers) < wanted && state->batches.size() < kMaxQueuedBatches)
+    {
+        state->activeWorkers++;
+
+        state->runtime->runInWorkQueue([state] {
+            walkWorker(state);
+        });
+    }
+}
+
+// Takes directories from the shared stack, runs on the threadpool
+// Workers never wait for each other or for the script, they return once there is nothing to scan or enough batches are
+// queued, so a walk never holds on to threadpool threads other work needs
+static void walkWorker(const WalkPtr& state)
+{
+    WalkBatch found;
+    std::vector<PendingDirectory> subdirectories;
+
+    std::unique_lock lock(state->mutex);
+
+    while (!state->cancelled && !state->pending.empty() && state->batches.size() < kMaxQueuedBatches)
+    {
+        PendingDirectory directory = std::move(state->pending.back());
+        state->pending.pop_back();
+        state->scanning++;
+
+        lock.unlock();
+
+        scanDirectory(*state, directory, found, subdirectories);
+
+        lock.lock();
+
+        state->scanning--;
+
+        for (PendingDirectory& subdirectory : subdirectories)
+            state->pending.push_back(std::move(subdirectory));
+
+        // Workers which returned while this directory was scanned are brought back for the subdirectories it had
+        if (!subdirectories.empty() && state->activeWorkers < kWalkWorkers && state->pending.size() > 1 && !state->spawnScheduled)
+        {
+            state->spawnScheduled = true;
+
+            state->runtime->schedule([state] {
+                std::unique_lock lock(state->mutex);
+
+                state->spawnScheduled = false;
+                spawnWorkers(state);
+            });
+        }
+
+        subdirectories.clear();
+
+        bool published = !found.paths.empty();
+        publish(*state, found);
+
+        if (published && state->pumping && !state->batches.empty())
+            state->runtime->schedule([] {});
+
+        wakeWaiter(lock, *state);
+
+        if (!lock.owns_lock())
+            lock.lock();
+    }
+
+    if (--state->activeWorkers == 0 && state->pending.empty())
+    {
+        if (!state->current.paths.empty())
+            state->batches.push_back(std::move(state->current));
+
+        state->done = true;
+    }
+
+    wakeWaiter(lock, *state);
+}
+
+static WalkPtr& checkWalker(lua_State* L, int idx)
+{
+    WalkPtr& state = *(WalkPtr*)luaL_checkudata(L, idx, kWalkerType);
+
+    if (state->cancelled)
+        luaL_error(L, "walker is closed");
+
+    return state;
+}
+
+static void cancel(WalkState& state)
+{
+    std::unique_lock lock(state.mutex);
+
+    state.cancelled = true;
+    state.batches.clear();
+    state.current = {};
+    state.pending.clear();
+
+    // A coroutine still waiting on the walker will fail with an error once resumed
+    wakeWaiter(lock, state);
+}
+
+// Pushes the paths and types of the next batch, or nil once the walk is over, waiting for workers when necessary
+static int pushNextBatch(lua_State* L, const WalkPtr& state, bool canYield)
+{
+    std::unique_lock lock(state->mutex);
+
+    for (;;)
+    {
+        if (!state->batches.empty())
+            break;
+
+        if (state->done)
+        {
+            lua_pushnil(L);
+            return 1;
+        }
+
+        spawnWorkers(state);
+
+        if (!canYield)
+        {
+            // Iterators can't yield, so the loop is driven from here until a worker publishes a batch or returns
+            state->pumping = true;
+            lock.unlock();
+
+            uv_run(&state->runtime->loop, UV_RUN_ONCE);
+
+            lock.lock();
+            state->pumping = false;
+            continue;
+        }
+
+        if (state->waiter)
+            luaL_error(L, "walker is already being read by another coroutine");
+
+        state->waiter = getResumeToken(L);
+        state->waiterSelf = std::make_shared<Ref>(L, 1);
+
+        lock.unlock();
+
+        return lua_yield(L, 0);
+    }
+
+    WalkBatch batch = std::move(state->batches.front());
+    state->batches.pop_front();
+
+    // Workers return once too many batches are queued, taking one makes room for them again
+    spawnWorkers(state);
+
+    lock.unlock();
+
+    int count = int(batch.paths.size());
+
+    lua_createtable(L, count, 0);
+
+    for (int i = 0; i < count; i++)
+    {
+        lua_pushlstring(L, batch.paths[i].data(), batch.paths[i].size());
+        lua_rawseti(L, -2, i + 1);
+    }
+
+    lua_createtable(L, count, 0);
+
+    for (int i = 0; i < count; i++)
+    {
+        lua_pushstring(L, UV_DIRENT_TYPES[batch.types[i]]);
+        lua_rawseti(L, -2, i + 1);
+    }
+
+    return 2;
+}
+
+static int walkerNext(lua_State* L)
+{
+    return pushNextBatch(L, checkWalker(L, 1), true);
+}
+
+static int walkerNextCont(lua_State* L, int status)
+{
+    // Resumed with the walker as the only argument once a batch is ready, continuations cannot yield again
+    return pushNextBatch(L, checkWalker(L, 1), false);
+}
+
+/* Iterates over single entries as (path, type), driving the loop until the workers publish since iterators can't yield */
+static int entriesIterator(lua_State* L)
+{
+    WalkPtr& state = checkWalker(L, lua_upvalueindex(1));
+
+    int index = lua_tointeger(L, lua_upvalueindex(4));
+
+    if (lua_isnil(L, lua_upvalueindex(2)) || index >= lua_objlen(L, lua_upvalueindex(2)))
+    {
+        if (pushNextBatch(L, state, false) == 1)
+            return 1;
+
+        lua_replace(L, lua_upvalueindex(3));
+        lua_replace(L, lua_upvalueindex(2));
+        index = 0;
+    }
+
+    lua_rawgeti(L, lua_upvalueindex(2), index + 1);
+    lua_rawgeti(L, lua_upvalueindex(3), index + 1);
+
+    lua_pushinteger(L, index + 1);
+    lua_replace(L, lua_upvalueindex(4));
+
+    return 2;
+}
+
+static int walkerEntries(lua_State* L)
+{
+    checkWalker(L, 1);
+
+    lua_pushvalue(L, 1);
+    lua_pushnil(L);
+    lua_pushnil(L);
+    lua_pushinteger(L, 0);
+    lua_pushcclosure(L, entriesIterator, "entries", 4);
+    return 1;
+}
+
+static int walkerClose(lua_State* L)
+{
+    WalkPtr& state = *(WalkPtr*)luaL_checkudata(L, 1, kWalkerType);
+    cancel(*state);
+    return 0;
+}
+
+static void pushWalkerMetatable(lua_State* L)
+{
+    if (luaL_newmetatable(L, kWalkerType))
+    {
+        lua_createtable(L, 0, 3);
+
+        lua_pushcclosurek(L, walkerNext, "next", 0, walkerNextCont);
+        lua_setfield(L, -2, "next");
+
+        lua_pushcfunction(L, walkerEntries, "entries");
+        lua_setfield(L, -2, "entries");
+
+        lua_pushcfunction(L, walkerClose, "close");
+        lua_setfield(L, -2, "close");
+
+        lua_setreadonly(L, -1, 1);
+        lua_setfield(L, -2, "__index");
+
+        lua_pushstring(L, kWalkerType);
+        lua_setfield(L, -2, "__type");
+
+        lua_setreadonly(L, -1, 1);
+    }
+}
+
+int walk(lua_State* L)
+{
+    std::string root = luaL_checkstring(L, 1);
+
+    auto state = std::make_shared<WalkState>();
+
+    if (!lua_isnoneornil(L, 2))
+    {
+        luaL_checktype(L, 2, LUA_TTABLE);
+
+        lua_getfield(L, 2, "glob");
+        if (!lua_isnil(L, -1))
+            state->glob = luaL_checkstring(L, -1);
+        lua_pop(L, 1);
+
+        lua_getfield(L, 2, "maxDepth");
+        if (!lua_isnil(L, -1))
+            state->maxDepth = luaL_checkinteger(L, -1);
+        lua_pop(L, 1);
+
+        lua_getfield(L, 2, "followLinks");
+        state->followLinks = lua_toboolean(L, -1);
+        lua_pop(L, 1);
+
+        lua_getfield(L, 2, "batchSize");
+        if (!lua_isnil(L, -1))
+            state->batchSize = luaL_checkinteger(L, -1);
+        lua_pop(L, 1);
+
+        luaL_argcheck(L, state->maxDepth > 0, 2, "maxDepth must be positive");
+        luaL_argcheck(L, state->batchSize > 0, 2, "batchSize must be positive");
+    }
+
+    state->matchNames = state->glob.find('/') == std::string::npos;
+
+    while (root.size() > 1 && root.back() == '/')
+        root.pop_back();
+
+    uv_fs_t statReq;
+    int err = uv_fs_stat(nullptr, &statReq, root.c_str(), nullptr);
+    bool isDirectory = err == 0 && S_ISDIR(statReq.statbuf.st_mode);
+
+    if (isDirectory && state->followLinks)
+        state->visited.insert({statReq.statbuf.st_dev, statReq.statbuf.st_ino});
+
+    uv_fs_req_cleanup(&statReq);
+
+    if (err < 0)
+        luaL_error(L, "Error walking %s: %s", root.c_str(), uv_strerror(err));
+
+    if (!isDirectory)
+        luaL_error(L, "Error walking %s: not a directory", root.c_str());
+
+    state->runtime = getRuntime(L);
+    state->pending.push_back({root, "", 0});
+
+    WalkPtr* result = (WalkPtr*)lua_newuserdatadtor(L, sizeof(WalkPtr), [](void* userdata) {
+        WalkPtr& state = *(WalkPtr*)userdata;
+
+        // Workers stop at the next directory once nobody is left to read the results
+        cancel(*state);
+
+        state.~WalkPtr();
+    });
+
+    new (result) WalkPtr(state);
+
+    pushWalkerMetatable(L);
+    lua_setmetatable(L, -2);
+
+    std::unique_lock lock(state->mutex);
+    spawnWorkers(state);
+
+    return 1;
+}
+
+} // namespace fs
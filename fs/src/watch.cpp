@@ -0,0 +1,454 @@
+#include "lute/watch.h"
+
+#include "lua.h"
+#include "lualib.h"
+#include "uv.h"
+
+#include "lute/ref.h"
+#include "lute/runtime.h"
+
+#include <algorithm>
+#include <cstdint>
+#include <map>
+#include <memory>
+#include <string>
+#include <sys/stat.h>
+#include <vector>
+
+#if !defined(S_ISDIR) && defined(S_IFMT) && defined(S_IFDIR)
+#define S_ISDIR(m) (((m) & S_IFMT) == S_IFDIR)
+#endif
+
+namespace fs
+{
+
+static const char* kWatcherType = "Watcher";
+
+constexpr uint64_t kDefaultDebounceMs = 50;
+// A burst of changes which never goes quiet is still delivered after this many debounce periods
+constexpr uint64_t kMaxDebouncePeriods = 10;
+
+struct WatcherState;
+
+struct WatchHandle
+{
+    uv_fs_event_t handle;
+    WatcherState* state = nullptr;
+
+    // Path of the watched directory relative to the root, with a trailing separator, empty for the root itself
+    std::string prefix;
+};
+
+struct WatcherState
+{
+    std::string root;
+    bool recursive = false;
+    uint64_t debounce = kDefaultDebounceMs;
+
+    std::vector<WatchHandle*> handles;
+    uv_timer_t* timer = nullptr;
+
+    // Changed paths relative to the root, with the libuv events seen for them since the last delivery
+    std::map<std::string, int> changes;
+    uint64_t burstStart = 0;
+    bool ready = false;
+
+    std::string error;
+    bool closed = false;
+
+    ResumeToken waiter;
+    std::shared_ptr<Ref> waiterSelf;
+};
+
+using WatcherPtr = std::unique_ptr<WatcherState>;
+
+// Handles are usually closed here, unless the runtime already closed them while shutting down
+static void closeHandle(WatchHandle* watch)
+{
+    if (uv_is_closing((uv_handle_t*)&watch->handle))
+    {
+        delete watch;
+        return;
+    }
+
+    uv_close((uv_handle_t*)&watch->handle, [](uv_handle_t* handle) {
+        delete (WatchHandle*)handle->data;
+    });
+}
+
+static void closeHandle(uv_timer_t* timer)
+{
+    if (uv_is_closing((uv_handle_t*)timer))
+    {
+        delete timer;
+        return;
+    }
+
+    uv_close((uv_handle_t*)timer, [](uv_handle_t* handle) {
+        delete (uv_timer_t*)handle;
+    });
+}
+
+static void pushChanges(lua_State* L, const std::map<std::string, int>& changes)
+{
+    lua_createtable(L, int(changes.size()), 0);
+
+    int index = 0;
+
+    for (auto& [path, events] : changes)
+    {
+        lua_createtable(L, 0, 2);
+
+        lua_pushlstring(L, path.data(), path.size());
+        lua_setfield(L, -2, "path");
+
+        // A path which appeared or disappeared is reported as such even if it was also modified
+        lua_pushstring(L, (events & UV_RENAME) ? "rename" : "change");
+        lua_setfield(L, -2, "event");
+
+        lua_rawseti(L, -2, ++index);
+    }
+}
+
+static void wakeWaiter(WatcherState& state)
+{
+    if (!state.waiter)
+        return;
+
+    ResumeToken waiter = std::move(state.waiter);
+    state.waiterSelf.reset();
+
+    if (!state.error.empty())
+    {
+        waiter->fail(state.error);
+        return;
+    }
+
+    if (state.closed)
+    {
+        waiter->complete([](lua_State* L) {
+            lua_pushnil(L);
+            return 1;
+        });
+        return;
+    }
+
+    waiter->complete([changes = std::move(state.changes)](lua_State* L) {
+        pushChanges(L, changes);
+        return 1;
+    });
+
+    state.changes.clear();
+    state.ready = false;
+}
+
+static int startWatch(WatcherState& state, const std::string& prefix, bool reportEntries);
+
+#ifdef __linux__
+// inotify only reports changes to the direct entries of a directory, so recursive watches are built from one watch per directory
+// Entries of directories which appear after the watch started may have been created before their watch, so they can be reported
+static int watchSubdirectories(WatcherState& state, const std::string& prefix, bool reportEntries)
+{
+    std::string path = prefix.empty() ? state.root : state.root + "/" + prefix;
+
+    uv_fs_t req;
+    int err = uv_fs_scandir(nullptr, &req, path.c_str(), 0, nullptr);
+
+    if (err < 0)
+    {
+        uv_fs_req_cleanup(&req);
+        return err;
+    }
+
+    std::vector<std::string> directories;
+    uv_dirent_t entry;
+
+    while (uv_fs_scandir_next(&req, &entry) != UV_EOF)
+    {
+        if (reportEntries)
+            state.changes[prefix + entry.name] |= UV_RENAME;
+
+        if (entry.type == UV_DIRENT_DIR)
+            directories.push_back(prefix + entry.name + "/");
+    }
+
+    uv_fs_req_cleanup(&req);
+
+    for (const std::string& directory : directories)
+    {
+        if (int err = startWatch(state, directory, reportEntries))
+            return err;
+    }
+
+    return 0;
+}
+
+static bool isWatched(WatcherState& state, const std::string& prefix)
+{
+    return std::any_of(state.handles.begin(), state.handles.end(), [&](WatchHandle* handle) {
+        return handle->prefix == prefix;
+    });
+}
+
+// Keeps the set of watched directories in sync with directories appearing and disappearing below the root
+static void updateSubdirectories(WatcherState& state, const std::string& path)
+{
+    std::string prefix = path + "/";
+
+    uv_fs_t req;
+    int err = uv_fs_lstat(nullptr, &req, (state.root + "/" + path).c_str(), nullptr);
+    bool isDirectory = err == 0 && S_ISDIR(req.statbuf.st_mode);
+    uv_fs_req_cleanup(&req);
+
+    if (isDirectory)
+    {
+        // Directories created with contents, e.g. by a rename, are watched along with everything below them
+        if (!isWatched(state, prefix))
+            startWatch(state, prefix, true);
+
+        return;
+    }
+
+    // Watches of removed directories are dropped, so that a directory created in their place is watched again
+    auto removed = std::remove_if(state.handles.begin(), state.handles.end(), [&](WatchHandle* handle) {
+        if (handle->prefix.compare(0, prefix.size(), prefix) != 0)
+            return false;
+
+        closeHandle(handle);
+        return true;
+    });
+
+    state.handles.erase(removed, state.handles.end());
+}
+#endif
+
+static void onTimer(uv_timer_t* timer)
+{
+    WatcherState& state = *(WatcherState*)timer->data;
+
+    state.ready = true;
+    wakeWaiter(state);
+}
+
+static void onEvent(uv_fs_event_t* handle, const char* filename, int events, int status)
+{
+    WatchHandle* watch = (WatchHandle*)handle->data;
+    WatcherState& state = *watch->state;
+
+    if (status < 0)
+    {
+        state.error = std::string("Error watching ") + state.root + ": " + uv_strerror(status);
+        wakeWaiter(state);
+        return;
+    }
+
+    bool self = !filename || !*filename;
+
+    // Changes to a watched subdirectory itself are already reported by the watch on its parent
+    if (self && !watch->prefix.empty())
+        return;
+
+    std::string path = self ? "" : watch->prefix + filename;
+
+    uint64_t now = uv_now(handle->loop);
+
+    if (state.changes.empty())
+        state.burstStart = now;
+
+    state.changes[path] |= events;
+
+#ifdef __linux__
+    if (state.recursive && !self && (events & UV_RENAME))
+        updateSubdirectories(state, path);
+#endif
+
+    // Every change pushes the delivery back, up to a limit so that constant activity is still reported
+    uint64_t deadline = std::min(now + state.debounce, state.burstStart + state.debounce * kMaxDebouncePeriods);
+
+    if (!state.ready)
+        uv_timer_start(state.timer, onTimer, deadline > now ? deadline - now : 0, 0);
+}
+
+static int startWatch(WatcherState& state, const std::string& prefix, bool reportEntries)
+{
+    // Handles live on the same loop as the timer
+    uv_loop_t* loop = state.timer->loop;
+
+    WatchHandle* watch = new WatchHandle{};
+    watch->state = &state;
+    watch->prefix = prefix;
+    watch->handle.data = watch;
+
+    uv_fs_event_init(loop, &watch->handle);
+
+    std::string path = prefix.empty() ? state.root : state.root + "/" + prefix;
+    unsigned flags = 0;
+
+#ifndef __linux__
+    if (state.recursive)
+        flags |= UV_FS_EVENT_RECURSIVE;
+#endif
+
+    if (int err = uv_fs_event_start(&watch->handle, onEvent, path.c_str(), flags))
+    {
+        closeHandle(watch);
+        return err;
+    }
+
+    state.handles.push_back(watch);
+
+#ifdef __linux__
+    if (state.recursive)
+    {
+        uv_fs_t req;
+        int err = uv_fs_stat(nullptr, &req, path.c_str(), nullptr);
+        bool isDirectory = err == 0 && S_ISDIR(req.statbuf.st_mode);
+        uv_fs_req_cleanup(&req);
+
+        if (isDirectory)
+            return watchSubdirectories(state, prefix, reportEntries);
+    }
+#endif
+
+    return 0;
+}
+
+static void closeWatcher(WatcherState& state)
+{
+    if (state.closed)
+        return;
+
+    state.closed = true;
+
+    for (WatchHandle* watch : state.handles)
+        closeHandle(watch);
+
+    state.handles.clear();
+
+    closeHandle(state.timer);
+    state.timer = nullptr;
+
+    wakeWaiter(state);
+}
+
+static WatcherState& checkWatcher(lua_State* L, int idx)
+{
+    return **(WatcherPtr*)luaL_checkudata(L, idx, kWatcherType);
+}
+
+static int watcherNext(lua_State* L)
+{
+    WatcherState& state = checkWatcher(L, 1);
+
+    if (!state.error.empty())
+        luaL_error(L, "%s", state.error.c_str());
+
+    if (state.closed)
+    {
+        lua_pushnil(L);
+        return 1;
+    }
+
+    if (state.ready)
+    {
+        pushChanges(L, state.changes);
+
+        state.changes.clear();
+        state.ready = false;
+
+        return 1;
+    }
+
+    if (state.waiter)
+        luaL_error(L, "watcher is already being waited on by another coroutine");
+
+    state.waiter = getResumeToken(L);
+
+    // The watcher can't be collected while a coroutine waits on it
+    state.waiterSelf = std::make_shared<Ref>(L, 1);
+
+    return lua_yield(L, 0);
+}
+
+static int watcherClose(lua_State* L)
+{
+    closeWatcher(checkWatcher(L, 1));
+    return 0;
+}
+
+static void pushWatcherMetatable(lua_State* L)
+{
+    if (luaL_newmetatable(L, kWatcherType))
+    {
+        lua_createtable(L, 0, 2);
+
+        lua_pushcfunction(L, watcherNext, "next");
+        lua_setfield(L, -2, "next");
+
+        lua_pushcfunction(L, watcherClose, "close");
+        lua_setfield(L, -2, "close");
+
+        lua_setreadonly(L, -1, 1);
+        lua_setfield(L, -2, "__index");
+
+        lua_pushstring(L, kWatcherType);
+        lua_setfield(L, -2, "__type");
+
+        lua_setreadonly(L, -1, 1);
+    }
+}
+
+int watch(lua_State* L)
+{
+    auto state = std::make_unique<WatcherState>();
+    state->root = luaL_checkstring(L, 1);
+
+    if (!lua_isnoneornil(L, 2))
+    {
+        luaL_checktype(L, 2, LUA_TTABLE);
+
+        lua_getfield(L, 2, "recursive");
+        state->recursive = lua_toboolean(L, -1);
+        lua_pop(L, 1);
+
+        lua_getfield(L, 2, "debounce");
+        if (!lua_isnil(L, -1))
+        {
+            double debounce = luaL_checknumber(L, -1);
+            luaL_argcheck(L, debounce >= 0, 2, "debounce must not be negative");
+
+            state->debounce = uint64_t(debounce);
+        }
+        lua_pop(L, 1);
+    }
+
+    while (state->root.size() > 1 && state->root.back() == '/')
+        state->root.pop_back();
+
+    state->timer = new uv_timer_t();
+    state->timer->data = state.get();
+    uv_timer_init(&getRuntime(L)->loop, state->timer);
+
+    if (int err = startWatch(*state, "", false))
+    {
+        closeWatcher(*state);
+        luaL_error(L, "Error watching %s: %s", state->root.c_str(), uv_strerror(err));
+    }
+
+    WatcherPtr* result = (WatcherPtr*)lua_newuserdatadtor(L, sizeof(WatcherPtr), [](void* userdata) {
+        WatcherPtr& state = *(WatcherPtr*)userdata;
+
+        closeWatcher(*state);
+
+        state.~WatcherPtr();
+    });
+
+    new (result) WatcherPtr(std::move(state));
+
+    pushWatcherMetatable(L);
+    lua_setmetatable(L, -2);
+
+    return 1;
+}
+
+} // namespace fs
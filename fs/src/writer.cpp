@@ -0,0 +1,489 @@
+#include "lute/writer.h"
+
+#include "lua.h"
+#include "lualib.h"
+#include "uv.h"
+
+#include "lute/runtime.h"
+
+#include <cstdint>
+#include <cstring>
+#include <deque>
+#include <fcntl.h>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <vector>
+
+namespace fs
+{
+
+static const char* kFileWriterType = "FileWriter";
+
+constexpr size_t kDefaultBufferSize = 64 * 1024;
+// Writes yield once this many buffers worth of data are waiting for the threadpool, and resume when half of it is written
+constexpr size_t kMaxQueuedBuffers = 4;
+
+using Segments = std::vector<std::vector<char>>;
+
+struct WriterState
+{
+    ~WriterState()
+    {
+        if (fd >= 0)
+        {
+            uv_fs_t closeReq;
+            uv_fs_close(nullptr, &closeReq, fd, nullptr);
+            uv_fs_req_cleanup(&closeReq);
+        }
+    }
+
+    Runtime* runtime = nullptr;
+    uv_file fd = -1;
+    size_t bufferSize = kDefaultBufferSize;
+    bool closed = false;
+
+    // Data collected by the runtime thread since the last batch was submitted
+    Segments segments;
+    size_t bufferedBytes = 0;
+
+    std::mutex mutex;
+
+    // Batches are written in order by a single threadpool task at a time
+    std::deque<Segments> queue;
+    size_t queuedBytes = 0;
+    bool writing = false;
+    int error = 0;
+
+    Segments freeSegments;
+
+    // Coroutine waiting for the queue to shrink to 'waitUntil' bytes, resumed with 'waiterCont'
+    ResumeToken waiter;
+    size_t waitUntil = 0;
+    std::function<int(lua_State*)> waiterCont;
+
+    uint64_t bytesWritten = 0;
+    uint64_t writeCalls = 0;
+    uint64_t syscalls = 0;
+    uint64_t batches = 0;
+    uint64_t busyTime = 0;
+};
+
+using WriterPtr = std::shared_ptr<WriterState>;
+
+static void wakeWaiter(std::unique_lock<std::mutex>& lock, WriterState& state)
+{
+    if (!state.waiter || (state.error == 0 && state.queuedBytes > state.waitUntil))
+        return;
+
+    ResumeToken waiter = std::move(state.waiter);
+    std::function<int(lua_State*)> cont = std::move(state.waiterCont);
+    int error = state.error;
+
+    lock.unlock();
+
+    if (error != 0)
+        waiter->fail(std::string("Error writing file: ") + uv_strerror(error));
+    else
+        waiter->complete(std::move(cont));
+}
+
+// Writes all of 'iovs' at the current file position, coalescing them into as few writev calls as possible
+static int writeVectored(uv_file fd, std::vector<uv_buf_t>& iovs, uint64_t& syscalls)
+{
+    size_t first = 0;
+
+    while (first < iovs.size())
+    {
+        uv_fs_t writeReq;
+        int result = uv_fs_write(nullptr, &writeReq, fd, &iovs[first], unsigned(iovs.size() - first), -1, nullptr);
+        uv_fs_req_cleanup(&writeReq);
+
+        syscalls++;
+
+        if (result < 0)
+            return result;
+
+        // Skip past everything that was written, a short write leaves us in the middle of a buffer
+        size_t written = size_t(result);
+
+        while (first < iovs.size() && written >= iovs[first].len)
+            written -= iovs[first++].len;
+
+        if (first < iovs.size())
+        {
+            iovs[first].base += written;
+            iovs[first].len -= decltype(iovs[first].len)(written);
+        }
+    }
+
+    return 0;
+}
+
+// Writes queued batches until the queue is empty, runs on the threadpool
+static void drain(const WriterPtr& state)
+{
+    std::vector<uv_buf_t> iovs;
+
+    std::unique_lock lock(state->mutex);
+
+    while (!state->queue.empty() && state->error == 0)
+    {
+        Segments batch = std::move(state->queue.front());
+        state->queue.pop_front();
+
+        lock.unlock();
+
+        size_t batchBytes = 0;
+        iovs.clear();
+
+        for (std::vector<char>& segment : batch)
+        {
+            iovs.push_back(uv_buf_init(segment.data(), unsigned(segment.size())));
+            batchBytes += segment.size();
+        }
+
+        uint64_t syscalls = 0;
+        uint64_t start = uv_hrtime();
+        int error = writeVectored(state->fd, iovs, syscalls);
+        uint64_t duration = uv_hrtime() - start;
+
+        lock.lock();
+
+        state->busyTime += duration;
+        state->syscalls += syscalls;
+        state->batches++;
+        state->queuedBytes -= batchBytes;
+
+        if (error != 0)
+            state->error = error;
+        else
+            state->bytesWritten += batchBytes;
+
+        for (std::vector<char>& segment : batch)
+        {
+            if (state->freeSegments.size() < kMaxQueuedBuffers && segment.capacity() == state->bufferSize)
+            {
+                segment.clear();
+                state->freeSegments.push_back(std::move(segment));
+            }
+        }
+
+        wakeWaiter(lock, *state);
+
+        if (!lock.owns_lock())
+            lock.lock();
+    }
+
+    state->writing = false;
+    wakeWaiter(lock, *state);
+}
+
+// Hands the buffered data to the threadpool as a single batch
+static void submit(const WriterPtr& state)
+{
+    if (state->bufferedBytes == 0)
+        return;
+
+    std::unique_lock lock(state->mutex);
+
+    state->queue.push_back(std::move(state->segments));
+    state->queuedBytes += state->bufferedBytes;
+
+    state->segments.clear();
+    state->bufferedBytes = 0;
+
+    if (state->writing)
+        return;
+
+    state->writing = true;
+
+    lock.unlock();
+
+    state->runtime->runInWorkQueue([state] {
+        drain(state);
+    });
+}
+
+// Copies data into the current batch, small writes share buffers so that the batch turns into a few large iovecs
+static void append(const WriterPtr& state, const char* data, size_t len)
+{
+    if (len == 0)
+        return;
+
+    Segments& segments = state->segments;
+
+    if (len >= state->bufferSize / 2)
+    {
+        segments.emplace_back(data, data + len);
+    }
+    else
+    {
+        if (segments.empty() || segments.back().capacity() - segments.back().size() < len)
+        {
+            std::vector<char> segment;
+
+            {
+                std::unique_lock lock(state->mutex);
+
+                if (!state->freeSegments.empty())
+                {
+                    segment = std::move(state->freeSegments.back());
+                    state->freeSegments.pop_back();
+                }
+            }
+
+            segment.reserve(state->bufferSize);
+            segments.push_back(std::move(segment));
+        }
+
+        segments.back().insert(segments.back().end(), data, data + len);
+    }
+
+    state->bufferedBytes += len;
+}
+
+static WriterPtr& checkWriter(lua_State* L, int idx)
+{
+    WriterPtr& state = *(WriterPtr*)luaL_checkudata(L, idx, kFileWriterType);
+
+    if (state->closed)
+        luaL_error(L, "file writer is closed");
+
+    std::unique_lock lock(state->mutex);
+
+    if (state->error != 0)
+    {
+        int error = state->error;
+        lock.unlock();
+        luaL_error(L, "Error writing file: %s", uv_strerror(error));
+    }
+
+    return state;
+}
+
+// Sets up the calling coroutine to be resumed once at most 'waitUntil' bytes are waiting to be written
+// Returns false when there is no need to wait, otherwise the caller has to yield
+static bool waitForQueue(lua_State* L, const WriterPtr& state, size_t waitUntil, std::function<int(lua_State*)> cont)
+{
+    std::unique_lock lock(state->mutex);
+
+    if (state->queuedBytes <= waitUntil)
+        return false;
+
+    if (state->waiter)
+        luaL_error(L, "file writer is already being waited on by another coroutine");
+
+    state->waiter = getResumeToken(L);
+    state->waitUntil = waitUntil;
+    state->waiterCont = std::move(cont);
+
+    return true;
+}
+
+static int writerWrite(lua_State* L)
+{
+    WriterPtr& state = checkWriter(L, 1);
+
+    int top = lua_gettop(L);
+
+    for (int i = 2; i <= top; i++)
+    {
+        size_t len = 0;
+        const char* data = nullptr;
+
+        if (lua_isbuffer(L, i))
+            data = (const char*)lua_tobuffer(L, i, &len);
+        else
+            data = luaL_checklstring(L, i, &len);
+
+        append(state, data, len);
+        state->writeCalls++;
+    }
+
+    if (state->bufferedBytes >= state->bufferSize)
+        submit(state);
+
+    // Apply backpressure when the disk can't keep up, instead of buffering without bound
+    std::unique_lock lock(state->mutex);
+
+    if (state->queuedBytes <= kMaxQueuedBuffers * state->bufferSize)
+        return 0;
+
+    lock.unlock();
+
+    bool wait = waitForQueue(L, state, kMaxQueuedBuffers * state->bufferSize / 2, [](lua_State* L) {
+        return 0;
+    });
+
+    return wait ? lua_yield(L, 0) : 0;
+}
+
+static int writerFlush(lua_State* L)
+{
+    WriterPtr& state = checkWriter(L, 1);
+
+    submit(state);
+
+    bool wait = waitForQueue(L, state, 0, [](lua_State* L) {
+        return 0;
+    });
+
+    return wait ? lua_yield(L, 0) : 0;
+}
+
+static int writerClose(lua_State* L)
+{
+    WriterPtr& state = checkWriter(L, 1);
+
+    submit(state);
+    state->closed = true;
+
+    WriterPtr keepAlive = state;
+
+    auto closeFile = [keepAlive](lua_State* L) {
+        uv_fs_t closeReq;
+        uv_fs_close(nullptr, &closeReq, keepAlive->fd, nullptr);
+        uv_fs_req_cleanup(&closeReq);
+
+        keepAlive->fd = -1;
+        return 0;
+    };
+
+    if (waitForQueue(L, state, 0, closeFile))
+        return lua_yield(L, 0);
+
+    closeFile(L);
+    return 0;
+}
+
+/* Returns {bytes, writes, syscalls, batches, busytime, throughput}, busy time is in seconds and throughput in bytes per second */
+static int writerStats(lua_State* L)
+{
+    WriterPtr& state = *(WriterPtr*)luaL_checkudata(L, 1, kFileWriterType);
+
+    std::unique_lock lock(state->mutex);
+
+    lua_createtable(L, 0, 6);
+
+    lua_pushnumber(L, double(state->bytesWritten));
+    lua_setfield(L, -2, "bytes");
+
+    lua_pushnumber(L, double(state->writeCalls));
+    lua_setfield(L, -2, "writes");
+
+    lua_pushnumber(L, double(state->syscalls));
+    lua_setfield(L, -2, "syscalls");
+
+    lua_pushnumber(L, double(state->batches));
+    lua_setfield(L, -2, "batches");
+
+    lua_pushnumber(L, double(state->busyTime) / 1e9);
+    lua_setfield(L, -2, "busytime");
+
+    lua_pushnumber(L, state->busyTime ? double(state->bytesWritten) * 1e9 / double(state->busyTime) : 0.0);
+    lua_setfield(L, -2, "throughput");
+
+    return 1;
+}
+
+static const luaL_Reg fileWriterMethods[] = {
+    {"write", writerWrite},
+    {"flush", writerFlush},
+    {"close", writerClose},
+    {"stats", writerStats},
+    {nullptr, nullptr},
+};
+
+static void pushFileWriterMetatable(lua_State* L)
+{
+    if (luaL_newmetatable(L, kFileWriterType))
+    {
+        lua_createtable(L, 0, std::size(fileWriterMethods));
+
+        for (auto& [name, func] : fileWriterMethods)
+        {
+            if (!name || !func)
+                break;
+
+            lua_pushcfunction(L, func, name);
+            lua_setfield(L, -2, name);
+        }
+
+        lua_setreadonly(L, -1, 1);
+        lua_setfield(L, -2, "__index");
+
+        lua_pushstring(L, kFileWriterType);
+        lua_setfield(L, -2, "__type");
+
+        lua_setreadonly(L, -1, 1);
+    }
+}
+
+int writer(lua_State* L)
+{
+    const char* path = luaL_checkstring(L, 1);
+
+    size_t bufferSize = kDefaultBufferSize;
+    bool appendMode = false;
+
+    if (!lua_isnoneornil(L, 2))
+    {
+        luaL_checktype(L, 2, LUA_TTABLE);
+
+        lua_getfield(L, 2, "bufferSize");
+        if (!lua_isnil(L, -1))
+            bufferSize = size_t(luaL_checknumber(L, -1));
+        lua_pop(L, 1);
+
+        lua_getfield(L, 2, "append");
+        appendMode = lua_toboolean(L, -1);
+        lua_pop(L, 1);
+
+        luaL_argcheck(L, bufferSize > 0 && bufferSize <= 1024 * 1024 * 1024, 2, "bufferSize must be between 1 byte and 1GB");
+    }
+
+    uv_fs_t openReq;
+    int fd = uv_fs_open(nullptr, &openReq, path, O_WRONLY | O_CREAT | (appendMode ? O_APPEND : O_TRUNC), 0644, nullptr);
+    uv_fs_req_cleanup(&openReq);
+
+    if (fd < 0)
+        luaL_error(L, "Error opening file %s: %s", path, uv_strerror(fd));
+
+    auto state = std::make_shared<WriterState>();
+    state->runtime = getRuntime(L);
+    state->fd = fd;
+    state->bufferSize = bufferSize;
+
+    WriterPtr* result = (WriterPtr*)lua_newuserdatadtor(L, sizeof(WriterPtr), [](void* userdata) {
+        WriterPtr& state = *(WriterPtr*)userdata;
+
+        // A writer which was never closed still writes out everything it was given
+        if (!state->closed && state->bufferedBytes != 0)
+        {
+            std::unique_lock lock(state->mutex);
+
+            state->queue.push_back(std::move(state->segments));
+            state->queuedBytes += state->bufferedBytes;
+
+            if (!state->writing)
+            {
+                state->writing = true;
+                lock.unlock();
+                drain(state);
+            }
+        }
+
+        state.~WriterPtr();
+    });
+
+    new (result) WriterPtr(state);
+
+    pushFileWriterMetatable(L);
+    lua_setmetatable(L, -2);
+
+    return 1;
+}
+
+} // namespace fs
@@ -0,0 +1,189 @@
+#pragma once
+
+#include "lute/metrics.h"
+
+#include "curl/curl.h"
+#include "uv.h"
+
+#include <cstdint>
+#include <deque>
+#include <functional>
+#include <memory>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+struct lua_State;
+struct Runtime;
+
+namespace net
+{
+
+// Timing of a transfer as reported by curl, each phase in microseconds since the transfer started
+struct TransferStats
+{
+    uint64_t namelookup = 0;
+    uint64_t connect = 0;
+    uint64_t appconnect = 0;
+    uint64_t starttransfer = 0;
+    uint64_t total = 0;
+
+    uint64_t bytesSent = 0;
+    uint64_t bytesReceived = 0;
+
+    // Whether the transfer went over a kept-alive connection instead of opening one
+    bool reused = false;
+
+    static TransferStats get(CURL* easy);
+};
+
+// Aggregate of the transfers made to one host:port
+struct HostStats
+{
+    uint64_t requests = 0;
+    uint64_t failures = 0;
+    uint64_t reused = 0;
+
+    uint64_t bytesSent = 0;
+    uint64_t bytesReceived = 0;
+
+    // Connection setup including the TLS handshake, only for transfers which opened a connection
+    LatencyHistogram connect;
+    // Time until the first byte of the response
+    LatencyHistogram firstByte;
+    LatencyHistogram total;
+};
+
+struct PoolStats
+{
+    size_t idleHandles = 0;
+    size_t activeTransfers = 0;
+    size_t queuedTransfers = 0;
+    size_t openSockets = 0;
+
+    uint64_t handlesCreated = 0;
+    uint64_t connectionsOpened = 0;
+    uint64_t connectionsReused = 0;
+};
+
+// Limits applied to the transfers of each host:port, zero means unlimited
+struct ClientLimits
+{
+    // Transfers in flight at once
+    int maxPerHost = 0;
+
+    // Token bucket refilled at 'rate' transfers per second, holding up to 'burst' tokens
+    double rate = 0.0;
+    double burst = 0.0;
+};
+
+/* Drives the transfers of a runtime with a single curl multi handle on the runtime loop
+   Sockets are watched with uv_poll_t handles and curl's timeouts with a uv_timer_t, so any number of requests
+   can be in flight without taking up threadpool threads
+   Easy handles are pooled and share one DNS cache, connection cache and TLS session cache, so repeated requests
+   to an origin reuse its kept-alive connections instead of going through the lookup and handshakes again
+   Transfers beyond the limits of their host wait in a queue per host and start in order as slots and tokens free up
+ */
+class HttpClient : public std::enable_shared_from_this<HttpClient>
+{
+public:
+    // Called on the runtime thread once the transfer is finished, the easy handle goes back to the pool after it returns
+    using Completion = std::function<void(CURL* easy, CURLcode result)>;
+
+    explicit HttpClient(Runtime* runtime);
+    ~HttpClient();
+
+    HttpClient(const HttpClient&) = delete;
+    HttpClient& operator=(const HttpClient&) = delete;
+
+    // Client of the runtime running 'L', created on first use
+    static HttpClient& get(lua_State* L);
+
+    // Easy handle from the pool, reset to the default options and attached to the caches of the client
+    CURL* acquire();
+    // Returns a handle taken with 'acquire' once it is done with
+    void release(CURL* easy);
+
+    // Starts a transfer to 'url' with a configured easy handle, which the client owns from now on
+    // The transfer waits in the queue of its host while the host is at its limits
+    void perform(CURL* easy, const std::string& url, Completion done);
+
+    // Stops a transfer started with 'perform', queued or in flight, without calling its completion
+    void cancel(CURL* easy);
+
+    // Whether a transfer started with 'perform' is in flight, transfers still waiting in a queue are not
+    bool running(CURL* easy) const;
+
+    void setLimits(const ClientLimits& limits);
+
+    // Number of transfers in flight
+    size_t activeTransfers() const;
+
+    // Adds a finished transfer to the host and pool stats, done for every transfer started with 'perform'
+    void record(CURL* easy, CURLcode result);
+
+    const std::unordered_map<std::string, HostStats>& hostStats() const;
+    PoolStats poolStats() const;
+
+    // Aborts every transfer and closes the handles of the client, must be done before the loop is closed
+    void shutdown();
+
+private:
+    struct Socket;
+
+    struct Transfer
+    {
+        Completion done;
+        std::string host;
+    };
+
+    struct HostQueue
+    {
+        int active = 0;
+
+        double tokens = 0.0;
+        uint64_t refilledAt = 0;
+
+        std::deque<CURL*> waiting;
+    };
+
+    static int onSocket(CURL* easy, curl_socket_t fd, int action, void* userp, void* socketp);
+    static int onTimeout(CURLM* multi, long timeoutMs, void* userp);
+    static void closeSocket(Socket* socket);
+
+    void socketAction(curl_socket_t fd, int events);
+    void processCompleted();
+
+    void start(CURL* easy, Transfer transfer);
+    // Starts the waiting transfers of a host for which there is room, or arms the limit timer for the next token
+    void dispatch(const std::string& host);
+    void dispatchAll();
+    void releaseSlot(const std::string& host);
+    void detachCancelled();
+
+    Runtime* runtime = nullptr;
+    CURLM* multi = nullptr;
+    CURLSH* share = nullptr;
+    uv_timer_t* timer = nullptr;
+    uv_timer_t* limitTimer = nullptr;
+
+    ClientLimits limits;
+
+    std::vector<CURL*> idle;
+    std::unordered_map<CURL*, Transfer> transfers;
+    std::unordered_map<CURL*, Transfer> queued;
+    std::unordered_map<std::string, HostQueue> queues;
+    // Transfers reported done by curl whose completions are being run
+    std::vector<std::pair<CURL*, CURLcode>> completing;
+    // Set while curl runs its callbacks, transfers cancelled meanwhile wait in 'detached' to be removed once it returns
+    bool inSocketAction = false;
+    std::vector<std::pair<CURL*, std::string>> detached;
+    std::unordered_map<curl_socket_t, Socket*> sockets;
+
+    std::unordered_map<std::string, HostStats> hosts;
+    uint64_t handlesCreated = 0;
+    uint64_t connectionsOpened = 0;
+    uint64_t connectionsReused = 0;
+};
+
+} // namespace net
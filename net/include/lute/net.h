@@ -3,6 +3,11 @@
 #include "lua.h"
 #include "lualib.h"
 
+#include "lute/request.h"
+#include "lute/server.h"
+#include "lute/tcp.h"
+#include "lute/udp.h"
+
 // open the library as a standard global luau library
 int luaopen_net(lua_State* L);
 // open the library as a table on top of the stack
@@ -11,13 +16,39 @@ int luteopen_net(lua_State* L);
 namespace net
 {
 
+/* Both return the response body as a buffer, which is allocated up front when the server sends a Content-Length and
+   handed over without copying
+ */
 int get(lua_State* L);
 
+/* Takes an optional options table {retries: number?, backoff: number?, maxbackoff: number?, hedge: number?}
+   Failed connections, timeouts and 429, 502, 503 and 504 responses are retried up to 'retries' times after a random delay
+   of up to 'backoff' * 2^n seconds, capped at 'maxbackoff'; the last response is returned once retries run out
+   With 'hedge', a second attempt is started when the first hasn't finished after that many seconds, the first one to
+   finish wins and the other is cancelled
+ */
 int getAsync(lua_State* L);
 
+/* Takes {perhost: number?, rate: number?, burst: number?} and limits every host:port to 'perhost' requests in flight and
+   'rate' requests per second with bursts of up to 'burst', which defaults to 'rate'; requests over the limits wait in
+   order, and leaving a limit out removes it
+ */
+int limit(lua_State* L);
+
+/* Returns the stats of the HTTP client of this runtime
+   pool: {idlehandles, activetransfers, queuedtransfers, opensockets, handlescreated, connectionsopened, connectionsreused}
+   hosts: per "host:port" {requests, failures, reused, bytessent, bytesreceived} with latency summaries
+   {count, mean, max, p50, p90, p99} in seconds for 'connect' (new connections only), 'firstbyte' and 'total'
+ */
+int metrics(lua_State* L);
+
 static const luaL_Reg lib[] = {
     {"get", get},
     {"getAsync", getAsync},
+    {"limit", limit},
+    {"metrics", metrics},
+    {"request", request},
+    {"serve", serve},
     {nullptr, nullptr},
 };
 
@@ -0,0 +1,21 @@
+#pragma once
+
+struct lua_State;
+
+namespace net
+{
+
+/* Takes an options table {url: string, method: string?, headers: {[string]: string}?, body: (string | buffer | FileHandle)?,
+   timeout: number?}, where 'timeout' limits the whole transfer in seconds
+   A file handle body is sent from its current position to the end of the file, read in chunks as the upload goes
+   Yields until the response headers have arrived and returns {status: number, headers: {[string]: string}, body: ResponseBody}
+   with lowercase header names; the body is streamed with 'read', which yields for the next chunk as a buffer and returns nil
+   at the end, or the 'chunks' iterator, and 'close' stops the transfer early
+   The transfer is paused while a reader falls behind, so a response of any size is streamed in constant memory
+   The response also has 'timing' {namelookup, connect, appconnect, starttransfer}, seconds from the start of the request to
+   the end of each phase, and 'reused', whether it came over a kept-alive connection; body:stats() adds 'total',
+   'bytessent' and 'bytesreceived', which are final once the body has been read to the end
+ */
+int request(lua_State* L);
+
+} // namespace net
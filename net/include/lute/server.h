@@ -0,0 +1,18 @@
+#pragma once
+
+struct lua_State;
+
+namespace net
+{
+
+/* Takes an options table {port: number, handler: (request) -> response, hostname: string?, reuseport: boolean?}
+   Serves HTTP/1.1 on 'hostname' (all interfaces by default) until the returned server is closed, a 'port' of 0 picks a free
+   one which the server's 'port' method reports
+   Every request runs 'handler' in its own coroutine with {method: string, path: string, query: string?,
+   headers: {[string]: string}, body: string}, which can yield; it returns the response body as a string or buffer, or
+   {status: number?, headers: {[string]: string}?, body: (string | buffer)?}, and a handler error becomes a 500 response
+   Connections are kept alive and pipelined requests are answered in order, request bodies need a Content-Length
+ */
+int serve(lua_State* L);
+
+} // namespace net
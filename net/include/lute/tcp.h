@@ -0,0 +1,31 @@
+#pragma once
+
+#include "lua.h"
+#include "lualib.h"
+
+namespace net
+{
+namespace tcp
+{
+
+/* Takes host: string and port: number, yields until connected and returns a TcpSocket
+   read() yields for the next data as a buffer and returns nil once the peer has closed its side
+   write(data: string | buffer) only yields while more than a megabyte is waiting to be sent
+   close() closes the socket, a coroutine waiting on it gets nil back
+   Reads land in pooled blocks and the socket stops reading while a megabyte of them is waiting for the reader
+ */
+int connect(lua_State* L);
+
+/* Takes an options table {port: number, hostname: string?, backlog: number?}, 'hostname' defaults to all interfaces
+   Returns a TcpListener whose accept() yields for the next connection as a TcpSocket, with port() and close()
+ */
+int listen(lua_State* L);
+
+static const luaL_Reg lib[] = {
+    {"connect", connect},
+    {"listen", listen},
+    {nullptr, nullptr},
+};
+
+} // namespace tcp
+} // namespace net
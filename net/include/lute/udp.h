@@ -0,0 +1,28 @@
+#pragma once
+
+#include "lua.h"
+#include "lualib.h"
+
+namespace net
+{
+namespace udp
+{
+
+/* Takes an optional options table {port: number?, hostname: string?}, binding to a free port on all interfaces by default
+   Returns a UdpSocket with:
+   send(data: string | buffer, host: string, port: number), where 'host' is an IP address; it only yields while more
+   than a megabyte of datagrams is waiting to be sent
+   recv(), which yields for the next datagram and returns it as a buffer with the host and port it came from
+   port() and close()
+   Datagrams are received in batches with recvmmsg where available, at most 1024 of them wait for a reader before the
+   socket stops receiving and leaves the rest to the kernel
+ */
+int bind(lua_State* L);
+
+static const luaL_Reg lib[] = {
+    {"bind", bind},
+    {nullptr, nullptr},
+};
+
+} // namespace udp
+} // namespace net
@@ -0,0 +1,638 @@
+#include "lute/client.h"
+
+#include "lute/runtime.h"
+
+#include "lua.h"
+#include "lualib.h"
+
+#include <algorithm>
+#include <utility>
+#include <vector>
+
+namespace net
+{
+
+static const char* kHttpClientKey = "net.client";
+
+// Idle easy handles kept around for reuse, handles released beyond that are cleaned up
+constexpr size_t kMaxIdleHandles = 64;
+
+struct HttpClient::Socket
+{
+    uv_poll_t poll;
+    curl_socket_t fd;
+    HttpClient* client = nullptr;
+};
+
+void HttpClient::closeSocket(Socket* socket)
+{
+    uv_poll_stop(&socket->poll);
+
+    uv_close((uv_handle_t*)&socket->poll, [](uv_handle_t* handle) {
+        delete (Socket*)handle->data;
+    });
+}
+
+HttpClient::HttpClient(Runtime* runtime)
+    : runtime(runtime)
+{
+    // The client is only used from the runtime thread, so the shared caches need no locking
+    share = curl_share_init();
+
+    curl_share_setopt(share, CURLSHOPT_SHARE, CURL_LOCK_DATA_DNS);
+    curl_share_setopt(share, CURLSHOPT_SHARE, CURL_LOCK_DATA_CONNECT);
+    curl_share_setopt(share, CURLSHOPT_SHARE, CURL_LOCK_DATA_SSL_SESSION);
+
+    multi = curl_multi_init();
+
+    curl_multi_setopt(multi, CURLMOPT_SOCKETFUNCTION, onSocket);
+    curl_multi_setopt(multi, CURLMOPT_SOCKETDATA, this);
+    curl_multi_setopt(multi, CURLMOPT_TIMERFUNCTION, onTimeout);
+    curl_multi_setopt(multi, CURLMOPT_TIMERDATA, this);
+
+    timer = new uv_timer_t();
+    timer->data = this;
+    uv_timer_init(&runtime->loop, timer);
+
+    limitTimer = new uv_timer_t();
+    limitTimer->data = this;
+    uv_timer_init(&runtime->loop, limitTimer);
+}
+
+HttpClient::~HttpClient()
+{
+    shutdown();
+}
+
+HttpClient& HttpClient::get(lua_State* L)
+{
+    lua_getfield(L, LUA_REGISTRYINDEX, kHttpClientKey);
+
+    if (lua_isnil(L, -1))
+    {
+        lua_pop(L, 1);
+
+        using HttpClientPtr = std::shared_ptr<HttpClient>;
+
+        HttpClientPtr* client = (HttpClientPtr*)lua_newuserdatadtor(L, sizeof(HttpClientPtr), [](void* userdata) {
+            ((HttpClientPtr*)userdata)->~HttpClientPtr();
+        });
+
+        Runtime* runtime = getRuntime(L);
+        new (client) HttpClientPtr(std::make_shared<HttpClient>(runtime));
+
+        // The VM is closed after the loop, so the client lets go of its handles while the loop is still around
+        runtime->addShutdownHook([client = *client] {
+            client->shutdown();
+        });
+
+        lua_pushvalue(L, -1);
+        lua_setfield(L, LUA_REGISTRYINDEX, kHttpClientKey);
+    }
+
+    HttpClient& client = **(std::shared_ptr<HttpClient>*)lua_touserdata(L, -1);
+    lua_pop(L, 1);
+
+    return client;
+}
+
+CURL* HttpClient::acquire()
+{
+    CURL* easy = nullptr;
+
+    if (!idle.empty())
+    {
+        easy = idle.back();
+        idle.pop_back();
+
+        // Resetting the options keeps the connections and caches of the handle
+        curl_easy_reset(easy);
+    }
+    else
+    {
+        easy = curl_easy_init();
+
+        if (!easy)
+            return nullptr;
+
+        handlesCreated++;
+    }
+
+    curl_easy_setopt(easy, CURLOPT_SHARE, share);
+
+    return easy;
+}
+
+void HttpClient::release(CURL* easy)
+{
+    if (multi && idle.size() < kMaxIdleHandles)
+        idle.push_back(easy);
+    else
+        curl_easy_cleanup(easy);
+}
+
+static std::string hostKey(const char* url)
+{
+    std::string key = "unknown";
+
+    CURLU* parsed = curl_url();
+
+    if (url && curl_url_set(parsed, CURLUPART_URL, url, 0) == CURLUE_OK)
+    {
+        char* host = nullptr;
+        char* port = nullptr;
+
+        if (curl_url_get(parsed, CURLUPART_HOST, &host, 0) == CURLUE_OK &&
+            curl_url_get(parsed, CURLUPART_PORT, &port, CURLU_DEFAULT_PORT) == CURLUE_OK)
+            key = std::string(host) + ":" + port;
+
+        curl_free(host);
+        curl_free(port);
+    }
+
+    curl_url_cleanup(parsed);
+
+    return key;
+}
+
+void HttpClient::perform(CURL* easy, const std::string& url, Completion done)
+{
+    Transfer transfer = {std::move(done), hostKey(url.c_str())};
+
+    if (limits.maxPerHost == 0 && limits.rate == 0.0)
+    {
+        start(easy, std::move(transfer));
+        return;
+    }
+
+    std::string host = transfer.host;
+
+    queues[host].waiting.push_back(easy);
+    queued[easy] = std::move(transfer);
+
+    dispatch(host);
+}
+
+void HttpClient::start(CURL* easy, Transfer transfer)
+{
+    std::string host = transfer.host;
+
+    queues[host].active++;
+    transfers[easy] = std::move(transfer);
+
+    // Adding the handle sets a timeout which starts the transfer from the loop
+    CURLMcode err = curl_multi_add_handle(multi, easy);
+
+    if (err != CURLM_OK)
+    {
+        Completion completion = std::move(transfers[easy].done);
+        transfers.erase(easy);
+
+        completion(easy, CURLE_FAILED_INIT);
+        release(easy);
+
+        releaseSlot(host);
+    }
+}
+
+void HttpClient::dispatch(const std::string& host)
+{
+    for (;;)
+    {
+        // Starting a transfer can fail and finish it right away, which may drop the queue of the host
+        auto it = queues.find(host);
+
+        if (it == queues.end())
+            return;
+
+        HostQueue& queue = it->second;
+
+        if (queue.waiting.empty() || (limits.maxPerHost != 0 && queue.active >= limits.maxPerHost))
+            return;
+
+        if (limits.rate > 0.0)
+        {
+            uint64_t now = uv_hrtime();
+            double burst = std::max(1.0, limits.burst);
+
+            // A host seen for the first time starts with a full bucket
+            if (queue.refilledAt == 0)
+                queue.tokens = burst;
+            else
+                queue.tokens = std::min(burst, queue.tokens + double(now - queue.refilledAt) / 1e9 * limits.rate);
+
+            queue.refilledAt = now;
+
+            if (queue.tokens < 1.0)
+            {
+                uint64_t waitMs = uint64_t((1.0 - queue.tokens) / limits.rate * 1000.0) + 1;
+
+                if (!uv_is_active((uv_handle_t*)limitTimer) || uv_timer_get_due_in(limitTimer) > waitMs)
+                {
+                    uv_timer_start(limitTimer, [](uv_timer_t* timer) {
+                        ((HttpClient*)timer->data)->dispatchAll();
+                    }, waitMs, 0);
+                }
+
+                return;
+            }
+
+            queue.tokens -= 1.0;
+        }
+
+        CURL* easy = queue.waiting.front();
+        queue.waiting.pop_front();
+
+        auto waiting = queued.find(easy);
+        Transfer transfer = std::move(waiting->second);
+        queued.erase(waiting);
+
+        start(easy, std::move(transfer));
+    }
+}
+
+void HttpClient::dispatchAll()
+{
+    std::vector<std::string> hosts;
+
+    for (auto& [name, queue] : queues)
+    {
+        if (!queue.waiting.empty())
+            hosts.push_back(name);
+    }
+
+    for (const std::string& name : hosts)
+        dispatch(name);
+}
+
+void HttpClient::releaseSlot(const std::string& host)
+{
+    auto it = queues.find(host);
+
+    if (it == queues.end())
+        return;
+
+    it->second.active--;
+
+    // Hosts are forgotten once idle, unless their token bucket has to be remembered
+    if (it->second.active == 0 && it->second.waiting.empty() && limits.rate == 0.0)
+    {
+        queues.erase(it);
+        return;
+    }
+
+    dispatch(host);
+}
+
+void HttpClient::cancel(CURL* easy)
+{
+    auto waiting = queued.find(easy);
+
+    if (waiting != queued.end())
+    {
+        Transfer transfer = std::move(waiting->second);
+        queued.erase(waiting);
+
+        std::deque<CURL*>& queue = queues[transfer.host].waiting;
+        queue.erase(std::find(queue.begin(), queue.end(), easy));
+
+        release(easy);
+        return;
+    }
+
+    auto it = transfers.find(easy);
+
+    if (it == transfers.end())
+        return;
+
+    // The completion is destroyed after the transfer is gone, it might hold the last reference to its state
+    Transfer transfer = std::move(it->second);
+    transfers.erase(it);
+
+    // The handle can go back to the pool and into a new transfer, which must not pick up this one's result
+    for (auto& entry : completing)
+    {
+        if (entry.first == easy)
+            entry.first = nullptr;
+    }
+
+    // curl refuses to remove a handle from inside its callbacks, where a response buffer allocation can run the finalizer
+    // of an abandoned body; the handle is detached once curl returns
+    if (inSocketAction)
+    {
+        detached.emplace_back(easy, std::move(transfer.host));
+        return;
+    }
+
+    curl_multi_remove_handle(multi, easy);
+    release(easy);
+
+    releaseSlot(transfer.host);
+}
+
+void HttpClient::detachCancelled()
+{
+    std::vector<std::pair<CURL*, std::string>> cancelled = std::move(detached);
+    detached.clear();
+
+    for (auto& [easy, host] : cancelled)
+    {
+        curl_multi_remove_handle(multi, easy);
+        release(easy);
+
+        releaseSlot(host);
+    }
+}
+
+bool HttpClient::running(CURL* easy) const
+{
+    return transfers.count(easy) != 0;
+}
+
+void HttpClient::setLimits(const ClientLimits& newLimits)
+{
+    limits = newLimits;
+
+    // Raised limits take effect on the transfers already waiting
+    dispatchAll();
+}
+
+size_t HttpClient::activeTransfers() const
+{
+    return transfers.size();
+}
+
+void HttpClient::shutdown()
+{
+    if (!multi)
+        return;
+
+    // Transfers which are still running are dropped along with the coroutines waiting for them
+    for (auto& [easy, _] : transfers)
+    {
+        curl_multi_remove_handle(multi, easy);
+        curl_easy_cleanup(easy);
+    }
+
+    transfers.clear();
+
+    for (auto& [easy, _] : queued)
+        curl_easy_cleanup(easy);
+
+    queued.clear();
+    queues.clear();
+
+    for (CURL* easy : idle)
+        curl_easy_cleanup(easy);
+
+    idle.clear();
+
+    for (auto& [_, socket] : sockets)
+        closeSocket(socket);
+
+    sockets.clear();
+
+    // Connections closed by the cleanup must not come back to the loop
+    curl_multi_setopt(multi, CURLMOPT_SOCKETFUNCTION, nullptr);
+    curl_multi_setopt(multi, CURLMOPT_TIMERFUNCTION, nullptr);
+    curl_multi_cleanup(multi);
+    multi = nullptr;
+
+    // Closes the pooled connections, which are no longer used by any handle
+    curl_share_cleanup(share);
+    share = nullptr;
+
+    uv_close((uv_handle_t*)timer, [](uv_handle_t* handle) {
+        delete (uv_timer_t*)handle;
+    });
+    timer = nullptr;
+
+    uv_close((uv_handle_t*)limitTimer, [](uv_handle_t* handle) {
+        delete (uv_timer_t*)handle;
+    });
+    limitTimer = nullptr;
+}
+
+int HttpClient::onSocket(CURL* easy, curl_socket_t fd, int action, void* userp, void* socketp)
+{
+    HttpClient* client = (HttpClient*)userp;
+    Socket* socket = (Socket*)socketp;
+
+    if (action == CURL_POLL_REMOVE)
+    {
+        if (socket)
+        {
+            client->sockets.erase(fd);
+            curl_multi_assign(client->multi, fd, nullptr);
+
+            closeSocket(socket);
+        }
+
+        return 0;
+    }
+
+    if (!socket)
+    {
+        socket = new Socket();
+        socket->fd = fd;
+        socket->client = client;
+        socket->poll.data = socket;
+
+        uv_poll_init_socket(&client->runtime->loop, &socket->poll, fd);
+
+        client->sockets[fd] = socket;
+        curl_multi_assign(client->multi, fd, socket);
+    }
+
+    int events = 0;
+
+    if (action == CURL_POLL_IN || action == CURL_POLL_INOUT)
+        events |= UV_READABLE;
+
+    if (action == CURL_POLL_OUT || action == CURL_POLL_INOUT)
+        events |= UV_WRITABLE;
+
+    uv_poll_start(&socket->poll, events, [](uv_poll_t* poll, int status, int events) {
+        Socket* socket = (Socket*)poll->data;
+
+        int flags = 0;
+
+        if (status < 0)
+            flags |= CURL_CSELECT_ERR;
+
+        if (events & UV_READABLE)
+            flags |= CURL_CSELECT_IN;
+
+        if (events & UV_WRITABLE)
+            flags |= CURL_CSELECT_OUT;
+
+        socket->client->socketAction(socket->fd, flags);
+    });
+
+    return 0;
+}
+
+int HttpClient::onTimeout(CURLM* multi, long timeoutMs, void* userp)
+{
+    HttpClient* client = (HttpClient*)userp;
+
+    if (timeoutMs < 0)
+    {
+        uv_timer_stop(client->timer);
+        return 0;
+    }
+
+    // curl can't be called back into from here, even an expired timeout goes through the loop
+    uv_timer_start(client->timer, [](uv_timer_t* timer) {
+        ((HttpClient*)timer->data)->socketAction(CURL_SOCKET_TIMEOUT, 0);
+    }, uint64_t(timeoutMs), 0);
+
+    return 0;
+}
+
+void HttpClient::socketAction(curl_socket_t fd, int events)
+{
+    int running = 0;
+
+    inSocketAction = true;
+    curl_multi_socket_action(multi, fd, events, &running);
+    inSocketAction = false;
+
+    processCompleted();
+
+    // Only after the completions, so the handles can't go back to the pool while curl still reports them as done
+    detachCancelled();
+}
+
+void HttpClient::processCompleted()
+{
+    completing.clear();
+
+    int pending = 0;
+
+    while (CURLMsg* message = curl_multi_info_read(multi, &pending))
+    {
+        if (message->msg == CURLMSG_DONE)
+            completing.emplace_back(message->easy_handle, message->data.result);
+    }
+
+    // Completions can start new transfers, so they only run once curl is done reporting
+    for (auto [easy, result] : completing)
+    {
+        // A completion earlier in the batch can cancel this transfer, which has already been removed and released then
+        auto it = transfers.find(easy);
+
+        if (it == transfers.end())
+            continue;
+
+        curl_multi_remove_handle(multi, easy);
+
+        Transfer transfer = std::move(it->second);
+        transfers.erase(it);
+
+        record(easy, result);
+
+        transfer.done(easy, result);
+        release(easy);
+
+        releaseSlot(transfer.host);
+    }
+
+    completing.clear();
+}
+
+TransferStats TransferStats::get(CURL* easy)
+{
+    TransferStats stats;
+
+    curl_off_t value = 0;
+
+    if (curl_easy_getinfo(easy, CURLINFO_NAMELOOKUP_TIME_T, &value) == CURLE_OK)
+        stats.namelookup = uint64_t(value);
+    if (curl_easy_getinfo(easy, CURLINFO_CONNECT_TIME_T, &value) == CURLE_OK)
+        stats.connect = uint64_t(value);
+    if (curl_easy_getinfo(easy, CURLINFO_APPCONNECT_TIME_T, &value) == CURLE_OK)
+        stats.appconnect = uint64_t(value);
+    if (curl_easy_getinfo(easy, CURLINFO_STARTTRANSFER_TIME_T, &value) == CURLE_OK)
+        stats.starttransfer = uint64_t(value);
+    if (curl_easy_getinfo(easy, CURLINFO_TOTAL_TIME_T, &value) == CURLE_OK)
+        stats.total = uint64_t(value);
+
+    if (curl_easy_getinfo(easy, CURLINFO_SIZE_UPLOAD_T, &value) == CURLE_OK)
+        stats.bytesSent = uint64_t(value);
+    if (curl_easy_getinfo(easy, CURLINFO_SIZE_DOWNLOAD_T, &value) == CURLE_OK)
+        stats.bytesReceived = uint64_t(value);
+
+    // Counts the connections the transfer had to open, none means it went over one from the cache
+    long connects = 0;
+    curl_easy_getinfo(easy, CURLINFO_NUM_CONNECTS, &connects);
+
+    long status = 0;
+    curl_easy_getinfo(easy, CURLINFO_RESPONSE_CODE, &status);
+
+    stats.reused = connects == 0 && status != 0;
+
+    return stats;
+}
+
+void HttpClient::record(CURL* easy, CURLcode result)
+{
+    TransferStats stats = TransferStats::get(easy);
+
+    // Stats go to the host which answered, after any redirects
+    char* url = nullptr;
+    curl_easy_getinfo(easy, CURLINFO_EFFECTIVE_URL, &url);
+
+    HostStats& host = hosts[hostKey(url)];
+
+    host.requests++;
+    host.bytesSent += stats.bytesSent;
+    host.bytesReceived += stats.bytesReceived;
+
+    if (result != CURLE_OK)
+    {
+        host.failures++;
+        return;
+    }
+
+    if (stats.reused)
+    {
+        host.reused++;
+        connectionsReused++;
+    }
+    else
+    {
+        long connects = 0;
+        curl_easy_getinfo(easy, CURLINFO_NUM_CONNECTS, &connects);
+
+        connectionsOpened += connects;
+
+        host.connect.record(stats.appconnect != 0 ? stats.appconnect : stats.connect);
+    }
+
+    host.firstByte.record(stats.starttransfer);
+    host.total.record(stats.total);
+}
+
+const std::unordered_map<std::string, HostStats>& HttpClient::hostStats() const
+{
+    return hosts;
+}
+
+PoolStats HttpClient::poolStats() const
+{
+    PoolStats stats;
+
+    stats.idleHandles = idle.size();
+    stats.activeTransfers = transfers.size();
+    stats.queuedTransfers = queued.size();
+    stats.openSockets = sockets.size();
+
+    stats.handlesCreated = handlesCreated;
+    stats.connectionsOpened = connectionsOpened;
+    stats.connectionsReused = connectionsReused;
+
+    return stats;
+}
+
+} // namespace net
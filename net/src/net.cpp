@@ -1,5 +1,7 @@
 #include "lute/net.h"
 
+#include "lute/client.h"
+
 #include "lute/runtime.h"
 
 #include "curl/curl.h"
@@ -7,88 +9,446 @@
 #include "lua.h"
 #include "lualib.h"
 
+#include <algorithm>
+#include <cmath>
+#include <cstring>
+#include <memory>
+#include <random>
 #include <string>
-#include <utility>
 #include <vector>
 
 namespace net
 {
 
+// Largest body that is preallocated from Content-Length, the size limit of Luau buffers
+constexpr curl_off_t kMaxPresizedBody = 1 << 30;
+
+// Response body accumulated straight into a Luau buffer when the server announces its length, so it can be handed to
+// Luau without copying; bodies of unknown length grow in 'overflow' and are copied into a buffer once at the end
+struct ResponseData
+{
+    CURL* easy = nullptr;
+    lua_State* GL = nullptr;
+
+    bool sized = false;
+
+    std::shared_ptr<Ref> buffer;
+    char* data = nullptr;
+    size_t capacity = 0;
+    size_t size = 0;
+
+    std::vector<char> overflow;
+};
+
 static size_t writeFunction(void* contents, size_t size, size_t nmemb, void* context)
 {
-    std::vector<char>& target = *(std::vector<char>*)context;
+    ResponseData& response = *(ResponseData*)context;
     size_t fullsize = size * nmemb;
 
-    target.insert(target.end(), (char*)contents, (char*)contents + fullsize);
+    // Headers of the final response are in by the time its first data arrives, bodies of redirects are never written
+    if (!response.sized)
+    {
+        response.sized = true;
+
+        curl_off_t length = -1;
+        curl_easy_getinfo(response.easy, CURLINFO_CONTENT_LENGTH_DOWNLOAD_T, &length);
+
+        if (length > 0 && length <= kMaxPresizedBody)
+        {
+            response.data = (char*)lua_newbuffer(response.GL, size_t(length));
+            response.buffer = std::make_shared<Ref>(response.GL, -1);
+            response.capacity = size_t(length);
+            lua_pop(response.GL, 1);
+        }
+    }
+
+    if (response.size + fullsize <= response.capacity)
+    {
+        memcpy(response.data + response.size, contents, fullsize);
+        response.size += fullsize;
+        return fullsize;
+    }
+
+    // More data than announced, carry on without the preallocated buffer
+    if (response.buffer)
+    {
+        response.overflow.assign(response.data, response.data + response.size);
+        response.buffer.reset();
+        response.data = nullptr;
+        response.capacity = 0;
+    }
+
+    response.overflow.insert(response.overflow.end(), (char*)contents, (char*)contents + fullsize);
+    response.size += fullsize;
 
     return fullsize;
 }
 
-static std::pair<std::string, std::vector<char>> requestData(const std::string& url)
+static void setupResponseData(lua_State* L, CURL* curl, ResponseData& response)
 {
-    CURL* curl = curl_easy_init();
+    response.easy = curl;
+    response.GL = getRuntime(L)->GL;
+
+    curl_easy_setopt(curl, CURLOPT_WRITEFUNCTION, writeFunction);
+    curl_easy_setopt(curl, CURLOPT_WRITEDATA, &response);
+}
+
+static int pushResponseData(lua_State* L, ResponseData& response)
+{
+    if (response.buffer && response.size == response.capacity)
+    {
+        response.buffer->push(L);
+        return 1;
+    }
+
+    const char* data = response.buffer ? response.data : response.overflow.data();
+
+    void* buffer = lua_newbuffer(L, response.size);
+
+    if (response.size != 0)
+        memcpy(buffer, data, response.size);
+
+    return 1;
+}
+
+int get(lua_State* L)
+{
+    std::string url = luaL_checkstring(L, 1);
+
+    HttpClient& client = HttpClient::get(L);
+    CURL* curl = client.acquire();
 
     if (!curl)
-        return { "failed to initialize", {} };
+        luaL_error(L, "network request failed: failed to initialize");
 
-    std::vector<char> data;
+    ResponseData response;
 
     curl_easy_setopt(curl, CURLOPT_URL, url.c_str());
     curl_easy_setopt(curl, CURLOPT_FOLLOWLOCATION, 1L);
 
-    curl_easy_setopt(curl, CURLOPT_WRITEFUNCTION, writeFunction);
-    curl_easy_setopt(curl, CURLOPT_WRITEDATA, &data);
+    setupResponseData(L, curl, response);
 
     curl_easy_setopt(curl, CURLOPT_SSL_VERIFYPEER, 0L);
 
     CURLcode res = curl_easy_perform(curl);
 
+    client.record(curl, res);
+    client.release(curl);
+
     if (res != CURLE_OK)
-        return { curl_easy_strerror(res), {} };
+        luaL_error(L, "network request failed: %s", curl_easy_strerror(res));
 
-    curl_easy_cleanup(curl);
-    return { "", data };
+    return pushResponseData(L, response);
 }
 
-int get(lua_State* L)
+// Attempts of a getAsync call, which can be retried after failures and hedged with a second attempt when slow
+struct AsyncGet : std::enable_shared_from_this<AsyncGet>
 {
-    std::string url = luaL_checkstring(L, 1);
+    std::shared_ptr<HttpClient> client;
+    Runtime* runtime = nullptr;
 
-    auto [error, data] = requestData(url);
+    std::string url;
+    ResumeToken token;
 
-    if (!error.empty())
-        luaL_error(L, "network request failed: %s", error.c_str());
+    int retriesLeft = 0;
+    int retriesDone = 0;
+    double backoff = 0.1;
+    double maxBackoff = 10.0;
+    double hedge = 0.0;
 
-    lua_pushlstring(L, data.data(), data.size());
-    return 1;
+    std::vector<std::pair<CURL*, std::shared_ptr<ResponseData>>> attempts;
+
+    // Delays the next retry or the hedged attempt, keeps the request alive while it is armed
+    uv_timer_t* timer = nullptr;
+    std::shared_ptr<AsyncGet> waiting;
+
+    bool done = false;
+};
+
+using AsyncGetPtr = std::shared_ptr<AsyncGet>;
+
+static bool isRetryable(CURLcode result, long status)
+{
+    switch (result)
+    {
+    case CURLE_OK:
+        return status == 429 || status == 502 || status == 503 || status == 504;
+    case CURLE_COULDNT_RESOLVE_HOST:
+    case CURLE_COULDNT_CONNECT:
+    case CURLE_OPERATION_TIMEDOUT:
+    case CURLE_SEND_ERROR:
+    case CURLE_RECV_ERROR:
+    case CURLE_GOT_NOTHING:
+    case CURLE_PARTIAL_FILE:
+        return true;
+    default:
+        return false;
+    }
+}
+
+static void startAttempt(const AsyncGetPtr& request);
+
+static void armTimer(const AsyncGetPtr& request, double seconds)
+{
+    if (!request->timer)
+    {
+        request->timer = new uv_timer_t();
+        request->timer->data = request.get();
+        uv_timer_init(&request->runtime->loop, request->timer);
+    }
+
+    request->waiting = request;
+
+    uv_timer_start(request->timer, [](uv_timer_t* timer) {
+        AsyncGetPtr request = std::move(((AsyncGet*)timer->data)->waiting);
+
+        if (!request->done)
+            startAttempt(request);
+    }, uint64_t(seconds * 1000.0), 0);
+}
+
+static void finishGet(const AsyncGetPtr& request, CURLcode result, const std::shared_ptr<ResponseData>& response)
+{
+    request->done = true;
+
+    // The losing attempts are stopped and their handles go back to the pool
+    for (auto& [easy, _] : request->attempts)
+        request->client->cancel(easy);
+
+    request->attempts.clear();
+
+    if (request->timer)
+    {
+        request->waiting.reset();
+
+        uv_close((uv_handle_t*)request->timer, [](uv_handle_t* handle) {
+            delete (uv_timer_t*)handle;
+        });
+        request->timer = nullptr;
+    }
+
+    if (result != CURLE_OK)
+    {
+        request->token->fail(std::string("network request failed: ") + curl_easy_strerror(result));
+        return;
+    }
+
+    request->token->complete([response](lua_State* L) {
+        return pushResponseData(L, *response);
+    });
+}
+
+static void startAttempt(const AsyncGetPtr& request)
+{
+    HttpClient& client = *request->client;
+    CURL* curl = client.acquire();
+
+    if (!curl)
+    {
+        if (request->attempts.empty())
+            finishGet(request, CURLE_FAILED_INIT, nullptr);
+
+        return;
+    }
+
+    auto response = std::make_shared<ResponseData>();
+
+    curl_easy_setopt(curl, CURLOPT_URL, request->url.c_str());
+    curl_easy_setopt(curl, CURLOPT_FOLLOWLOCATION, 1L);
+
+    setupResponseData(request->runtime->GL, curl, *response);
+
+    curl_easy_setopt(curl, CURLOPT_SSL_VERIFYPEER, 0L);
+
+    request->attempts.emplace_back(curl, response);
+
+    client.perform(curl, request->url, [request, response](CURL* easy, CURLcode res) {
+        auto& attempts = request->attempts;
+
+        attempts.erase(std::find_if(attempts.begin(), attempts.end(), [easy](auto& attempt) {
+            return attempt.first == easy;
+        }));
+
+        long status = 0;
+        curl_easy_getinfo(easy, CURLINFO_RESPONSE_CODE, &status);
+
+        if (!isRetryable(res, status))
+            return finishGet(request, res, response);
+
+        // A hedged attempt still running gets to finish the request
+        if (!attempts.empty())
+            return;
+
+        if (request->retriesLeft == 0)
+            return finishGet(request, res, response);
+
+        request->retriesLeft--;
+
+        // Full jitter, a random delay up to the exponential backoff, keeps retrying clients from moving in lockstep
+        double ceiling = std::min(request->maxBackoff, request->backoff * std::pow(2.0, request->retriesDone++));
+        std::uniform_real_distribution<double> jitter(0.0, ceiling);
+
+        static thread_local std::minstd_rand random(std::random_device{}());
+
+        armTimer(request, jitter(random));
+    });
+
+    // The hedged attempt races the first one when it hasn't finished in time, whichever wins cancels the other
+    if (request->hedge > 0.0 && request->attempts.size() == 1)
+        armTimer(request, request->hedge);
 }
 
 int getAsync(lua_State* L)
 {
     std::string url = luaL_checkstring(L, 1);
 
-    auto token = getResumeToken(L);
+    auto request = std::make_shared<AsyncGet>();
 
-    // TODO: add cancellations
-    token->runtime->runInWorkQueue([=] {
-        auto [error, data] = requestData(url);
+    if (!lua_isnoneornil(L, 2))
+    {
+        luaL_checktype(L, 2, LUA_TTABLE);
 
-        if (!error.empty())
-        {
-            token->fail("network request failed: " + error);
-        }
-        else
-        {
-            token->complete([data = std::move(data)](lua_State* L) {
-                lua_pushlstring(L, data.data(), data.size());
-                return 1;
-            });
-        }
-    });
+        lua_getfield(L, 2, "retries");
+        request->retriesLeft = lua_isnil(L, -1) ? 0 : luaL_checkinteger(L, -1);
+        lua_pop(L, 1);
+
+        lua_getfield(L, 2, "backoff");
+        request->backoff = lua_isnil(L, -1) ? request->backoff : luaL_checknumber(L, -1);
+        lua_pop(L, 1);
+
+        lua_getfield(L, 2, "maxbackoff");
+        request->maxBackoff = lua_isnil(L, -1) ? request->maxBackoff : luaL_checknumber(L, -1);
+        lua_pop(L, 1);
+
+        lua_getfield(L, 2, "hedge");
+        request->hedge = lua_isnil(L, -1) ? 0.0 : luaL_checknumber(L, -1);
+        lua_pop(L, 1);
+
+        luaL_argcheck(L, request->retriesLeft >= 0, 2, "retries can't be negative");
+        luaL_argcheck(L, request->backoff >= 0.0 && request->maxBackoff >= 0.0, 2, "backoff can't be negative");
+        luaL_argcheck(L, request->hedge >= 0.0, 2, "hedge can't be negative");
+    }
+
+    request->client = HttpClient::get(L).shared_from_this();
+    request->runtime = getRuntime(L);
+    request->url = std::move(url);
+    request->token = getResumeToken(L);
+
+    // The losing attempt of a hedged request is cancelled once the other one wins, there is no way for the caller to
+    // abandon the whole request yet
+    startAttempt(request);
 
     return lua_yield(L, 0);
 }
 
+int limit(lua_State* L)
+{
+    luaL_checktype(L, 1, LUA_TTABLE);
+
+    ClientLimits limits;
+
+    lua_getfield(L, 1, "perhost");
+    limits.maxPerHost = lua_isnil(L, -1) ? 0 : luaL_checkinteger(L, -1);
+    lua_pop(L, 1);
+
+    lua_getfield(L, 1, "rate");
+    limits.rate = lua_isnil(L, -1) ? 0.0 : luaL_checknumber(L, -1);
+    lua_pop(L, 1);
+
+    lua_getfield(L, 1, "burst");
+    limits.burst = lua_isnil(L, -1) ? limits.rate : luaL_checknumber(L, -1);
+    lua_pop(L, 1);
+
+    luaL_argcheck(L, limits.maxPerHost >= 0, 1, "perhost can't be negative");
+    luaL_argcheck(L, limits.rate >= 0.0 && limits.burst >= 0.0, 1, "rate and burst can't be negative");
+
+    HttpClient::get(L).setLimits(limits);
+
+    return 0;
+}
+
+static void pushHistogram(lua_State* L, const LatencyHistogram& histogram)
+{
+    uint64_t count = histogram.count.load(std::memory_order_relaxed);
+
+    // Latencies are reported in seconds, like the timing of responses
+    lua_createtable(L, 0, 6);
+
+    lua_pushnumber(L, double(count));
+    lua_setfield(L, -2, "count");
+    lua_pushnumber(L, count ? double(histogram.total.load(std::memory_order_relaxed)) / double(count) / 1e6 : 0.0);
+    lua_setfield(L, -2, "mean");
+    lua_pushnumber(L, double(histogram.max.load(std::memory_order_relaxed)) / 1e6);
+    lua_setfield(L, -2, "max");
+    lua_pushnumber(L, double(histogram.percentile(50)) / 1e6);
+    lua_setfield(L, -2, "p50");
+    lua_pushnumber(L, double(histogram.percentile(90)) / 1e6);
+    lua_setfield(L, -2, "p90");
+    lua_pushnumber(L, double(histogram.percentile(99)) / 1e6);
+    lua_setfield(L, -2, "p99");
+}
+
+int metrics(lua_State* L)
+{
+    HttpClient& client = HttpClient::get(L);
+
+    lua_createtable(L, 0, 2);
+
+    PoolStats pool = client.poolStats();
+
+    lua_createtable(L, 0, 7);
+
+    lua_pushnumber(L, double(pool.idleHandles));
+    lua_setfield(L, -2, "idlehandles");
+    lua_pushnumber(L, double(pool.activeTransfers));
+    lua_setfield(L, -2, "activetransfers");
+    lua_pushnumber(L, double(pool.queuedTransfers));
+    lua_setfield(L, -2, "queuedtransfers");
+    lua_pushnumber(L, double(pool.openSockets));
+    lua_setfield(L, -2, "opensockets");
+    lua_pushnumber(L, double(pool.handlesCreated));
+    lua_setfield(L, -2, "handlescreated");
+    lua_pushnumber(L, double(pool.connectionsOpened));
+    lua_setfield(L, -2, "connectionsopened");
+    lua_pushnumber(L, double(pool.connectionsReused));
+    lua_setfield(L, -2, "connectionsreused");
+
+    lua_setfield(L, -2, "pool");
+
+    const auto& hosts = client.hostStats();
+
+    lua_createtable(L, 0, int(hosts.size()));
+
+    for (auto& [name, host] : hosts)
+    {
+        lua_createtable(L, 0, 8);
+
+        lua_pushnumber(L, double(host.requests));
+        lua_setfield(L, -2, "requests");
+        lua_pushnumber(L, double(host.failures));
+        lua_setfield(L, -2, "failures");
+        lua_pushnumber(L, double(host.reused));
+        lua_setfield(L, -2, "reused");
+        lua_pushnumber(L, double(host.bytesSent));
+        lua_setfield(L, -2, "bytessent");
+        lua_pushnumber(L, double(host.bytesReceived));
+        lua_setfield(L, -2, "bytesreceived");
+
+        pushHistogram(L, host.connect);
+        lua_setfield(L, -2, "connect");
+        pushHistogram(L, host.firstByte);
+        lua_setfield(L, -2, "firstbyte");
+        pushHistogram(L, host.total);
+        lua_setfield(L, -2, "total");
+
+        lua_setfield(L, -2, name.c_str());
+    }
+
+    lua_setfield(L, -2, "hosts");
+
+    return 1;
+}
+
 } // namespace net
 
 struct CurlHolder
@@ -110,12 +470,35 @@ static CurlHolder& globalCurlInit()
     return holder;
 }
 
+template<size_t N>
+static void pushLib(lua_State* L, const luaL_Reg (&lib)[N])
+{
+    lua_createtable(L, 0, int(N));
+
+    for (auto& [name, func] : lib)
+    {
+        if (!name || !func)
+            break;
+
+        lua_pushcfunction(L, func, name);
+        lua_setfield(L, -2, name);
+    }
+
+    lua_setreadonly(L, -1, 1);
+}
+
 int luaopen_net(lua_State* L)
 {
     globalCurlInit();
 
     luaL_register(L, "net", net::lib);
 
+    pushLib(L, net::tcp::lib);
+    lua_setfield(L, -2, "tcp");
+
+    pushLib(L, net::udp::lib);
+    lua_setfield(L, -2, "udp");
+
     return 1;
 }
 
@@ -123,7 +506,7 @@ int luteopen_net(lua_State* L)
 {
     globalCurlInit();
 
-    lua_createtable(L, 0, std::size(net::lib));
+    lua_createtable(L, 0, std::size(net::lib) + 2);
 
     for (auto& [name, func] : net::lib)
     {
@@ -133,7 +516,13 @@ int luteopen_net(lua_State* L)
         lua_pushcfunction(L, func, name);
         lua_setfield(L, -2, name);
     }
-    
+
+    pushLib(L, net::tcp::lib);
+    lua_setfield(L, -2, "tcp");
+
+    pushLib(L, net::udp::lib);
+    lua_setfield(L, -2, "udp");
+
     lua_setreadonly(L, -1, 1);
 
     return 1;
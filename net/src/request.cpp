@@ -0,0 +1,736 @@
+#include "lute/request.h"
+
+#include "lute/client.h"
+#include "lute/fs.h"
+#include "lute/ref.h"
+#include "lute/runtime.h"
+
+#include "lua.h"
+#include "lualib.h"
+
+#include <algorithm>
+#include <cctype>
+#include <cstring>
+#include <deque>
+#include <memory>
+#include <string>
+#include <string_view>
+#include <utility>
+#include <vector>
+
+#ifdef _WIN32
+#include <io.h>
+#else
+#include <unistd.h>
+#endif
+
+namespace net
+{
+
+static const char* kResponseBodyType = "ResponseBody";
+
+// Response data held for a reader before the transfer is paused
+constexpr size_t kMaxBufferedBody = 1024 * 1024;
+// Size of the reads of a file handle body
+constexpr size_t kUploadChunkSize = 256 * 1024;
+
+struct HttpTransfer : std::enable_shared_from_this<HttpTransfer>
+{
+    std::shared_ptr<HttpClient> client;
+    uv_loop_t* loop = nullptr;
+
+    // Set while the transfer is running
+    CURL* easy = nullptr;
+    curl_slist* headerList = nullptr;
+
+    // Body from a string or a buffer, sent straight from the pinned Luau object, or the file handle being uploaded
+    std::shared_ptr<Ref> pinned;
+
+    // Body from a file handle, read ahead into 'upload' while curl sends the previous chunk
+    uv_file uploadFile = -1;
+    int64_t uploadOffset = 0;
+    int64_t uploadRemaining = 0;
+    std::vector<char> upload;
+    size_t uploadStart = 0;
+    size_t uploadEnd = 0;
+    bool uploadReading = false;
+    int uploadError = 0;
+
+    // Pause state of both directions of the transfer, they can only be changed together
+    bool sendPaused = false;
+    bool recvPaused = false;
+
+    ResumeToken responseWaiter;
+    bool responded = false;
+    long status = 0;
+    std::vector<std::pair<std::string, std::string>> headers;
+
+    // Taken when the headers arrive and again once the transfer is finished
+    TransferStats stats;
+
+    ResumeToken reader;
+    std::deque<std::vector<char>> chunks;
+    size_t buffered = 0;
+
+    bool finished = false;
+    bool closed = false;
+    std::string error;
+
+    ~HttpTransfer()
+    {
+        if (headerList)
+            curl_slist_free_all(headerList);
+    }
+};
+
+using HttpTransferPtr = std::shared_ptr<HttpTransfer>;
+
+struct UploadRead
+{
+    uv_fs_t req;
+    HttpTransferPtr transfer;
+};
+
+static void updatePause(HttpTransfer& transfer)
+{
+    // Transfers dropped by a runtime shutting down still have their handle set, but it is gone
+    if (!transfer.easy || !transfer.client->running(transfer.easy))
+        return;
+
+    curl_easy_pause(transfer.easy, (transfer.sendPaused ? CURLPAUSE_SEND : 0) | (transfer.recvPaused ? CURLPAUSE_RECV : 0));
+}
+
+static void pushResponse(lua_State* L, const HttpTransferPtr& transfer);
+static int pushChunk(lua_State* L, HttpTransfer& transfer);
+
+static void respond(HttpTransfer& transfer, CURL* easy, const HttpTransferPtr& self)
+{
+    transfer.responded = true;
+
+    curl_easy_getinfo(easy, CURLINFO_RESPONSE_CODE, &transfer.status);
+
+    transfer.stats = TransferStats::get(easy);
+
+    if (ResumeToken token = std::move(transfer.responseWaiter))
+    {
+        token->complete([self](lua_State* L) {
+            pushResponse(L, self);
+            return 1;
+        });
+    }
+}
+
+static void wakeReader(HttpTransfer& transfer, const HttpTransferPtr& self)
+{
+    ResumeToken token = std::move(transfer.reader);
+
+    if (!token)
+        return;
+
+    if (!transfer.error.empty())
+    {
+        token->fail("network request failed: " + transfer.error);
+        return;
+    }
+
+    token->complete([self](lua_State* L) {
+        return pushChunk(L, *self);
+    });
+}
+
+static size_t onHeader(char* data, size_t size, size_t count, void* userp)
+{
+    HttpTransfer& transfer = *(HttpTransfer*)userp;
+    size_t length = size * count;
+
+    std::string_view line(data, length);
+
+    while (!line.empty() && (line.back() == '\n' || line.back() == '\r'))
+        line.remove_suffix(1);
+
+    // Redirects and interim responses start a new header block, only the final one is reported
+    if (line.substr(0, 5) == "HTTP/")
+    {
+        transfer.headers.clear();
+        return length;
+    }
+
+    size_t colon = line.find(':');
+
+    if (colon == std::string_view::npos)
+        return length;
+
+    std::string name(line.substr(0, colon));
+    std::transform(name.begin(), name.end(), name.begin(), [](unsigned char c) {
+        return char(tolower(c));
+    });
+
+    std::string_view value = line.substr(colon + 1);
+
+    while (!value.empty() && (value.front() == ' ' || value.front() == '\t'))
+        value.remove_prefix(1);
+
+    transfer.headers.emplace_back(std::move(name), std::string(value));
+
+    return length;
+}
+
+static size_t onBody(char* data, size_t size, size_t count, void* userp)
+{
+    HttpTransfer& transfer = *(HttpTransfer*)userp;
+    size_t length = size * count;
+
+    // The transfer state is owned by the completion for as long as curl calls back into it
+    HttpTransferPtr self = transfer.shared_from_this();
+
+    if (!transfer.responded)
+        respond(transfer, transfer.easy, self);
+
+    // Paused data is handed to us again once the reader catches up
+    if (transfer.buffered >= kMaxBufferedBody)
+    {
+        transfer.recvPaused = true;
+        return CURL_WRITEFUNC_PAUSE;
+    }
+
+    transfer.chunks.emplace_back(data, data + length);
+    transfer.buffered += length;
+
+    wakeReader(transfer, self);
+
+    return length;
+}
+
+static void startUploadRead(const HttpTransferPtr& transfer);
+
+static size_t onUpload(char* data, size_t size, size_t count, void* userp)
+{
+    HttpTransfer& transfer = *(HttpTransfer*)userp;
+    size_t length = size * count;
+
+    if (transfer.uploadStart < transfer.uploadEnd)
+    {
+        size_t copied = std::min(length, transfer.uploadEnd - transfer.uploadStart);
+        memcpy(data, transfer.upload.data() + transfer.uploadStart, copied);
+
+        transfer.uploadStart += copied;
+
+        // The next chunk is read while curl sends this one
+        if (transfer.uploadStart == transfer.uploadEnd && transfer.uploadRemaining > 0)
+            startUploadRead(transfer.shared_from_this());
+
+        return copied;
+    }
+
+    if (transfer.uploadError != 0)
+        return CURL_READFUNC_ABORT;
+
+    if (transfer.uploadRemaining == 0)
+        return 0;
+
+    if (!transfer.uploadReading)
+        startUploadRead(transfer.shared_from_this());
+
+    transfer.sendPaused = true;
+    return CURL_READFUNC_PAUSE;
+}
+
+static void startUploadRead(const HttpTransferPtr& transfer)
+{
+    if (transfer->uploadReading)
+        return;
+
+    transfer->uploadReading = true;
+    transfer->upload.resize(kUploadChunkSize);
+
+    UploadRead* read = new UploadRead();
+    read->req.data = read;
+    read->transfer = transfer;
+
+    size_t size = size_t(std::min(transfer->uploadRemaining, int64_t(kUploadChunkSize)));
+    uv_buf_t buf = uv_buf_init(transfer->upload.data(), unsigned(size));
+
+    int err = uv_fs_read(transfer->loop, &read->req, transfer->uploadFile, &buf, 1, transfer->uploadOffset, [](uv_fs_t* req) {
+        UploadRead* read = (UploadRead*)req->data;
+        HttpTransfer& transfer = *read->transfer;
+
+        ssize_t result = req->result;
+
+        uv_fs_req_cleanup(req);
+
+        transfer.uploadReading = false;
+
+        if (result < 0)
+        {
+            transfer.uploadError = int(result);
+        }
+        else if (result == 0)
+        {
+            // The file got shorter than it was when the request started, curl fails the upload as incomplete
+            transfer.uploadRemaining = 0;
+        }
+        else
+        {
+            transfer.uploadStart = 0;
+            transfer.uploadEnd = size_t(result);
+            transfer.uploadOffset += result;
+            transfer.uploadRemaining -= result;
+        }
+
+        if (transfer.sendPaused)
+        {
+            transfer.sendPaused = false;
+            updatePause(transfer);
+        }
+
+        delete read;
+    });
+
+    if (err < 0)
+    {
+        transfer->uploadReading = false;
+        transfer->uploadError = err;
+
+        delete read;
+    }
+}
+
+static void finishTransfer(const HttpTransferPtr& transfer, CURL* easy, CURLcode result)
+{
+    transfer->easy = nullptr;
+    transfer->finished = true;
+
+    transfer->stats = TransferStats::get(easy);
+
+    if (result != CURLE_OK)
+    {
+        transfer->error = transfer->uploadError != 0 ? std::string("reading the body: ") + uv_strerror(transfer->uploadError)
+                                                     : curl_easy_strerror(result);
+    }
+
+    if (!transfer->responded)
+    {
+        if (transfer->error.empty())
+        {
+            respond(*transfer, easy, transfer);
+        }
+        else if (ResumeToken token = std::move(transfer->responseWaiter))
+        {
+            transfer->responded = true;
+            token->fail("network request failed: " + transfer->error);
+        }
+    }
+
+    wakeReader(*transfer, transfer);
+}
+
+static void closeTransfer(HttpTransfer& transfer)
+{
+    if (transfer.closed)
+        return;
+
+    transfer.closed = true;
+    transfer.chunks.clear();
+    transfer.buffered = 0;
+
+    if (CURL* easy = transfer.easy)
+    {
+        transfer.easy = nullptr;
+        transfer.client->cancel(easy);
+    }
+}
+
+static HttpTransferPtr& checkBody(lua_State* L, int idx)
+{
+    return *(HttpTransferPtr*)luaL_checkudata(L, idx, kResponseBodyType);
+}
+
+static int pushChunk(lua_State* L, HttpTransfer& transfer)
+{
+    if (transfer.chunks.empty())
+    {
+        lua_pushnil(L);
+        return 1;
+    }
+
+    std::vector<char> chunk = std::move(transfer.chunks.front());
+    transfer.chunks.pop_front();
+    transfer.buffered -= chunk.size();
+
+    void* buffer = lua_newbuffer(L, chunk.size());
+    memcpy(buffer, chunk.data(), chunk.size());
+
+    // Resuming can deliver the paused data right away, it is queued behind the chunk we took
+    if (transfer.recvPaused && transfer.buffered < kMaxBufferedBody)
+    {
+        transfer.recvPaused = false;
+        updatePause(transfer);
+    }
+
+    return 1;
+}
+
+// Pushes the next chunk when it doesn't have to be waited for, returns -1 otherwise
+static int pushReadyChunk(lua_State* L, HttpTransfer& transfer)
+{
+    if (transfer.reader)
+        luaL_error(L, "response body is already being read by another coroutine");
+
+    if (!transfer.chunks.empty())
+        return pushChunk(L, transfer);
+
+    if (!transfer.error.empty())
+        luaL_error(L, "network request failed: %s", transfer.error.c_str());
+
+    if (transfer.finished || transfer.closed)
+    {
+        lua_pushnil(L);
+        return 1;
+    }
+
+    return -1;
+}
+
+static int bodyRead(lua_State* L)
+{
+    HttpTransferPtr& transfer = checkBody(L, 1);
+
+    int results = pushReadyChunk(L, *transfer);
+
+    if (results >= 0)
+        return results;
+
+    transfer->reader = getResumeToken(L);
+    return lua_yield(L, 0);
+}
+
+static int chunksIterator(lua_State* L)
+{
+    HttpTransferPtr& transfer = checkBody(L, lua_upvalueindex(1));
+
+    // Iterators can't yield, so the loop is driven from here until the next chunk arrives
+    // Other coroutines made ready meanwhile run once the iteration yields or returns to the scheduler
+    while (transfer->chunks.empty() && !transfer->finished && !transfer->closed && !transfer->reader)
+        uv_run(transfer->loop, UV_RUN_ONCE);
+
+    return pushReadyChunk(L, *transfer);
+}
+
+static int bodyChunks(lua_State* L)
+{
+    checkBody(L, 1);
+
+    lua_pushvalue(L, 1);
+    lua_pushcclosure(L, chunksIterator, "chunks", 1);
+    return 1;
+}
+
+static int bodyClose(lua_State* L)
+{
+    HttpTransferPtr& transfer = checkBody(L, 1);
+
+    closeTransfer(*transfer);
+
+    // A coroutine still waiting on the body gets the end of it
+    wakeReader(*transfer, transfer);
+
+    return 0;
+}
+
+static void pushSeconds(lua_State* L, const char* name, uint64_t micros)
+{
+    lua_pushnumber(L, double(micros) / 1e6);
+    lua_setfield(L, -2, name);
+}
+
+static int bodyStats(lua_State* L)
+{
+    HttpTransferPtr& transfer = checkBody(L, 1);
+
+    TransferStats stats = transfer->easy && transfer->client->running(transfer->easy) ? TransferStats::get(transfer->easy) : transfer->stats;
+
+    lua_createtable(L, 0, 8);
+
+    pushSeconds(L, "namelookup", stats.namelookup);
+    pushSeconds(L, "connect", stats.connect);
+    pushSeconds(L, "appconnect", stats.appconnect);
+    pushSeconds(L, "starttransfer", stats.starttransfer);
+    pushSeconds(L, "total", stats.total);
+
+    lua_pushnumber(L, double(stats.bytesSent));
+    lua_setfield(L, -2, "bytessent");
+
+    lua_pushnumber(L, double(stats.bytesReceived));
+    lua_setfield(L, -2, "bytesreceived");
+
+    lua_pushboolean(L, stats.reused);
+    lua_setfield(L, -2, "reused");
+
+    return 1;
+}
+
+static void pushResponseBodyMetatable(lua_State* L)
+{
+    if (luaL_newmetatable(L, kResponseBodyType))
+    {
+        lua_createtable(L, 0, 4);
+
+        lua_pushcfunction(L, bodyRead, "read");
+        lua_setfield(L, -2, "read");
+
+        lua_pushcfunction(L, bodyChunks, "chunks");
+        lua_setfield(L, -2, "chunks");
+
+        lua_pushcfunction(L, bodyClose, "close");
+        lua_setfield(L, -2, "close");
+
+        lua_pushcfunction(L, bodyStats, "stats");
+        lua_setfield(L, -2, "stats");
+
+        lua_setreadonly(L, -1, 1);
+        lua_setfield(L, -2, "__index");
+
+        lua_pushstring(L, kResponseBodyType);
+        lua_setfield(L, -2, "__type");
+
+        lua_setreadonly(L, -1, 1);
+    }
+}
+
+static void pushResponse(lua_State* L, const HttpTransferPtr& transfer)
+{
+    lua_createtable(L, 0, 5);
+
+    lua_pushnumber(L, double(transfer->status));
+    lua_setfield(L, -2, "status");
+
+    const TransferStats& stats = transfer->stats;
+
+    lua_createtable(L, 0, 4);
+
+    pushSeconds(L, "namelookup", stats.namelookup);
+    pushSeconds(L, "connect", stats.connect);
+    pushSeconds(L, "appconnect", stats.appconnect);
+    pushSeconds(L, "starttransfer", stats.starttransfer);
+
+    lua_setfield(L, -2, "timing");
+
+    lua_pushboolean(L, stats.reused);
+    lua_setfield(L, -2, "reused");
+
+    lua_createtable(L, 0, int(transfer->headers.size()));
+
+    for (auto& [name, value] : transfer->headers)
+    {
+        // Repeated headers are combined like a single header with a list of values
+        lua_getfield(L, -1, name.c_str());
+
+        if (lua_isstring(L, -1))
+        {
+            std::string combined = lua_tostring(L, -1);
+            combined += ", " + value;
+
+            lua_pushlstring(L, combined.data(), combined.size());
+        }
+        else
+        {
+            lua_pushlstring(L, value.data(), value.size());
+        }
+
+        lua_setfield(L, -3, name.c_str());
+        lua_pop(L, 1);
+    }
+
+    transfer->headers = {};
+
+    lua_setfield(L, -2, "headers");
+
+    HttpTransferPtr* body = (HttpTransferPtr*)lua_newuserdatadtor(L, sizeof(HttpTransferPtr), [](void* userdata) {
+        HttpTransferPtr& transfer = *(HttpTransferPtr*)userdata;
+
+        closeTransfer(*transfer);
+
+        transfer.~HttpTransferPtr();
+    });
+
+    new (body) HttpTransferPtr(transfer);
+
+    pushResponseBodyMetatable(L);
+    lua_setmetatable(L, -2);
+
+    lua_setfield(L, -2, "body");
+}
+
+static void setBody(lua_State* L, HttpTransfer& transfer, CURL* easy, int idx)
+{
+    if (lua_isbuffer(L, idx) || lua_type(L, idx) == LUA_TSTRING)
+    {
+        size_t size = 0;
+        const char* data = lua_isbuffer(L, idx) ? (const char*)lua_tobuffer(L, idx, &size) : lua_tolstring(L, idx, &size);
+
+        transfer.pinned = std::make_shared<Ref>(L, idx);
+
+        curl_easy_setopt(easy, CURLOPT_POSTFIELDSIZE_LARGE, curl_off_t(size));
+        curl_easy_setopt(easy, CURLOPT_POSTFIELDS, data);
+        return;
+    }
+
+    int fd = fs::toFileDescriptor(L, idx);
+
+    if (fd < 0)
+        luaL_error(L, "body must be a string, a buffer or a file handle");
+
+#ifdef _WIN32
+    int64_t position = _lseeki64(fd, 0, SEEK_CUR);
+#else
+    int64_t position = lseek(fd, 0, SEEK_CUR);
+#endif
+
+    uv_fs_t req;
+    int err = uv_fs_fstat(nullptr, &req, fd, nullptr);
+    int64_t size = int64_t(req.statbuf.st_size);
+    uv_fs_req_cleanup(&req);
+
+    if (err < 0 || position < 0)
+        luaL_error(L, "network request failed: reading the body: %s", uv_strerror(err < 0 ? err : UV_ESPIPE));
+
+    // The descriptor belongs to the handle, which must not be collected and closed while the upload reads from it
+    transfer.pinned = std::make_shared<Ref>(L, idx);
+
+    transfer.uploadFile = uv_file(fd);
+    transfer.uploadOffset = position;
+    transfer.uploadRemaining = std::max(size - position, int64_t(0));
+
+    curl_easy_setopt(easy, CURLOPT_POST, 1L);
+    curl_easy_setopt(easy, CURLOPT_POSTFIELDSIZE_LARGE, curl_off_t(transfer.uploadRemaining));
+    curl_easy_setopt(easy, CURLOPT_READFUNCTION, onUpload);
+    curl_easy_setopt(easy, CURLOPT_READDATA, &transfer);
+}
+
+static void setHeaders(lua_State* L, HttpTransfer& transfer, int idx)
+{
+    luaL_checktype(L, idx, LUA_TTABLE);
+
+    bool hasExpect = false;
+
+    lua_pushnil(L);
+
+    while (lua_next(L, idx))
+    {
+        if (lua_type(L, -2) != LUA_TSTRING || !lua_isstring(L, -1))
+            luaL_error(L, "headers must map names to strings");
+
+        std::string name = lua_tostring(L, -2);
+        std::string line = name + ": " + lua_tostring(L, -1);
+
+        std::transform(name.begin(), name.end(), name.begin(), [](unsigned char c) {
+            return char(tolower(c));
+        });
+
+        hasExpect |= name == "expect";
+
+        transfer.headerList = curl_slist_append(transfer.headerList, line.c_str());
+        lua_pop(L, 1);
+    }
+
+    // Without this curl waits for a '100 Continue' before sending large bodies, a round trip most servers never answer
+    if (!hasExpect)
+        transfer.headerList = curl_slist_append(transfer.headerList, "Expect:");
+}
+
+int request(lua_State* L)
+{
+    luaL_checktype(L, 1, LUA_TTABLE);
+
+    lua_getfield(L, 1, "url");
+    std::string url = luaL_checkstring(L, -1);
+    lua_pop(L, 1);
+
+    lua_getfield(L, 1, "body");
+    bool hasBody = !lua_isnil(L, -1);
+    lua_pop(L, 1);
+
+    lua_getfield(L, 1, "method");
+    std::string method = lua_isnil(L, -1) ? (hasBody ? "POST" : "GET") : luaL_checkstring(L, -1);
+    lua_pop(L, 1);
+
+    std::transform(method.begin(), method.end(), method.begin(), [](unsigned char c) {
+        return char(toupper(c));
+    });
+
+    HttpClient& client = HttpClient::get(L);
+
+    auto transfer = std::make_shared<HttpTransfer>();
+    transfer->client = client.shared_from_this();
+    transfer->loop = &getRuntime(L)->loop;
+
+    CURL* easy = client.acquire();
+
+    if (!easy)
+        luaL_error(L, "network request failed: failed to initialize");
+
+    // Options are checked with the handle taken, it goes back to the pool if they are rejected
+    struct Guard
+    {
+        HttpClient& client;
+        CURL* easy;
+
+        ~Guard()
+        {
+            if (easy)
+                client.release(easy);
+        }
+    } guard{client, easy};
+
+    curl_easy_setopt(easy, CURLOPT_URL, url.c_str());
+    curl_easy_setopt(easy, CURLOPT_FOLLOWLOCATION, 1L);
+    curl_easy_setopt(easy, CURLOPT_SSL_VERIFYPEER, 0L);
+
+    if (hasBody)
+    {
+        lua_getfield(L, 1, "body");
+        setBody(L, *transfer, easy, lua_gettop(L));
+        lua_pop(L, 1);
+    }
+
+    if (method == "HEAD")
+        curl_easy_setopt(easy, CURLOPT_NOBODY, 1L);
+    else if (method != "GET" || hasBody)
+        curl_easy_setopt(easy, CURLOPT_CUSTOMREQUEST, method.c_str());
+
+    lua_getfield(L, 1, "headers");
+    if (!lua_isnil(L, -1))
+        setHeaders(L, *transfer, lua_gettop(L));
+    lua_pop(L, 1);
+
+    if (transfer->headerList)
+        curl_easy_setopt(easy, CURLOPT_HTTPHEADER, transfer->headerList);
+
+    lua_getfield(L, 1, "timeout");
+    if (!lua_isnil(L, -1))
+    {
+        double timeout = luaL_checknumber(L, -1);
+        luaL_argcheck(L, timeout > 0, 1, "timeout must be positive");
+
+        curl_easy_setopt(easy, CURLOPT_TIMEOUT_MS, long(std::max(timeout * 1000.0, 1.0)));
+    }
+    lua_pop(L, 1);
+
+    curl_easy_setopt(easy, CURLOPT_HEADERFUNCTION, onHeader);
+    curl_easy_setopt(easy, CURLOPT_HEADERDATA, transfer.get());
+    curl_easy_setopt(easy, CURLOPT_WRITEFUNCTION, onBody);
+    curl_easy_setopt(easy, CURLOPT_WRITEDATA, transfer.get());
+
+    guard.easy = nullptr;
+
+    transfer->easy = easy;
+    transfer->responseWaiter = getResumeToken(L);
+
+    client.perform(easy, url, [transfer](CURL* easy, CURLcode result) {
+        finishTransfer(transfer, easy, result);
+    });
+
+    return lua_yield(L, 0);
+}
+
+} // namespace net
@@ -0,0 +1,1022 @@
+#include "lute/server.h"
+
+#include "lute/options.h"
+#include "lute/ref.h"
+#include "lute/runtime.h"
+
+#include "Luau/Compiler.h"
+
+#include "lua.h"
+#include "lualib.h"
+#include "uv.h"
+
+#include <algorithm>
+#include <cctype>
+#include <cstring>
+#include <deque>
+#include <memory>
+#include <string>
+#include <string_view>
+#include <unordered_set>
+#include <utility>
+#include <vector>
+
+namespace net
+{
+
+static const char* kHttpServerType = "HttpServer";
+static const char* kDispatchKey = "net.dispatch";
+
+// Runs the handler of a request in its coroutine, errors are caught so they turn into a response instead of stopping the runtime
+static const char* kDispatchSource = R"(
+local handler, request, respond = ...
+respond(pcall(handler, request))
+)";
+
+constexpr size_t kMaxHeaderSize = 64 * 1024;
+constexpr size_t kMaxBodySize = 64 * 1024 * 1024;
+// Requests of a connection waiting for their response before no more are read from it
+constexpr size_t kMaxPipelined = 64;
+constexpr size_t kReadSize = 64 * 1024;
+// Bytes of responses the client hasn't taken yet before no more requests are read from it
+constexpr size_t kWriteHighWater = 1024 * 1024;
+
+struct Connection;
+
+// Response to a request, responses are written in the order their requests arrived in
+struct PendingResponse
+{
+    // Cleared when the connection is closed before the handler is done
+    Connection* connection = nullptr;
+
+    bool ready = false;
+    bool head = false;
+    bool keepAlive = true;
+    bool http10 = false;
+
+    std::string header;
+
+    // The body is written straight from the Luau string or buffer, which is pinned until the write is done
+    std::shared_ptr<Ref> pinned;
+    const char* body = nullptr;
+    size_t bodySize = 0;
+};
+
+using PendingResponsePtr = std::shared_ptr<PendingResponse>;
+
+struct HttpServer;
+
+struct Connection
+{
+    uv_tcp_t handle;
+    HttpServer* server = nullptr;
+
+    // Requests are parsed in place, 'consumed' is where the first request which hasn't been dispatched yet starts
+    std::vector<char> input;
+    size_t used = 0;
+    size_t consumed = 0;
+
+    std::deque<PendingResponsePtr> pending;
+    size_t writes = 0;
+
+    bool reading = false;
+    // The request being read asked for a 100 Continue, which goes out once the responses before it are written
+    bool continueWanted = false;
+    bool continueSent = false;
+    // Set after a request which doesn't keep the connection alive, it is closed once the responses are written
+    bool lastRequest = false;
+    bool closing = false;
+};
+
+struct HttpServer
+{
+    Runtime* runtime = nullptr;
+    uv_tcp_t* listener = nullptr;
+    std::shared_ptr<Ref> handler;
+
+    std::unordered_set<Connection*> connections;
+
+    int port = 0;
+    bool closed = false;
+};
+
+using HttpServerPtr = std::shared_ptr<HttpServer>;
+
+struct ResponseWrite
+{
+    uv_write_t req;
+    std::vector<PendingResponsePtr> responses;
+};
+
+struct RequestHead
+{
+    std::string_view method;
+    std::string_view target;
+    std::vector<std::pair<std::string_view, std::string_view>> headers;
+
+    size_t contentLength = 0;
+    bool hasContentLength = false;
+    bool chunked = false;
+    bool http10 = false;
+    bool keepAlive = true;
+    bool expectContinue = false;
+};
+
+static const char* reasonPhrase(int status)
+{
+    switch (status)
+    {
+    case 100:
+        return "Continue";
+    case 200:
+        return "OK";
+    case 201:
+        return "Created";
+    case 202:
+        return "Accepted";
+    case 204:
+        return "No Content";
+    case 206:
+        return "Partial Content";
+    case 301:
+        return "Moved Permanently";
+    case 302:
+        return "Found";
+    case 303:
+        return "See Other";
+    case 304:
+        return "Not Modified";
+    case 307:
+        return "Temporary Redirect";
+    case 308:
+        return "Permanent Redirect";
+    case 400:
+        return "Bad Request";
+    case 401:
+        return "Unauthorized";
+    case 403:
+        return "Forbidden";
+    case 404:
+        return "Not Found";
+    case 405:
+        return "Method Not Allowed";
+    case 409:
+        return "Conflict";
+    case 413:
+        return "Content Too Large";
+    case 429:
+        return "Too Many Requests";
+    case 431:
+        return "Request Header Fields Too Large";
+    case 500:
+        return "Internal Server Error";
+    case 501:
+        return "Not Implemented";
+    case 502:
+        return "Bad Gateway";
+    case 503:
+        return "Service Unavailable";
+    case 504:
+        return "Gateway Timeout";
+    default:
+        return "";
+    }
+}
+
+static bool equalsIgnoreCase(std::string_view a, std::string_view b)
+{
+    return a.size() == b.size() && std::equal(a.begin(), a.end(), b.begin(), [](char x, char y) {
+        return tolower((unsigned char)x) == tolower((unsigned char)y);
+    });
+}
+
+static bool containsIgnoreCase(std::string_view haystack, std::string_view needle)
+{
+    return std::search(haystack.begin(), haystack.end(), needle.begin(), needle.end(), [](char x, char y) {
+        return tolower((unsigned char)x) == tolower((unsigned char)y);
+    }) != haystack.end();
+}
+
+// Header names are tokens, see RFC 9110 section 5.6.2
+static bool isToken(std::string_view name)
+{
+    if (name.empty())
+        return false;
+
+    for (char c : name)
+    {
+        if (!isalnum((unsigned char)c) && std::string_view("!#$%&'*+-.^_`|~").find(c) == std::string_view::npos)
+            return false;
+    }
+
+    return true;
+}
+
+// Values with line breaks would let a handler end the header early and write its own
+static bool isFieldValue(std::string_view value)
+{
+    return value.find_first_of(std::string_view("\r\n\0", 3)) == std::string_view::npos;
+}
+
+static std::string_view trim(std::string_view value)
+{
+    while (!value.empty() && (value.front() == ' ' || value.front() == '\t'))
+        value.remove_prefix(1);
+
+    while (!value.empty() && (value.back() == ' ' || value.back() == '\t'))
+        value.remove_suffix(1);
+
+    return value;
+}
+
+// Parses the request line and headers, which end with the "\r\n" of the last header line
+static bool parseHead(std::string_view data, RequestHead& head)
+{
+    size_t lineEnd = data.find("\r\n");
+    std::string_view line = data.substr(0, lineEnd);
+
+    size_t methodEnd = line.find(' ');
+    size_t targetEnd = methodEnd == std::string_view::npos ? methodEnd : line.find(' ', methodEnd + 1);
+
+    if (methodEnd == 0 || targetEnd == std::string_view::npos || targetEnd == methodEnd + 1)
+        return false;
+
+    head.method = line.substr(0, methodEnd);
+    head.target = line.substr(methodEnd + 1, targetEnd - methodEnd - 1);
+
+    std::string_view version = line.substr(targetEnd + 1);
+
+    if (version.size() != 8 || version.substr(0, 7) != "HTTP/1.")
+        return false;
+
+    // HTTP/1.0 only keeps connections alive when asked to
+    head.http10 = version[7] == '0';
+    head.keepAlive = !head.http10;
+
+    size_t pos = lineEnd + 2;
+
+    while (pos < data.size())
+    {
+        lineEnd = data.find("\r\n", pos);
+        line = data.substr(pos, lineEnd - pos);
+        pos = lineEnd + 2;
+
+        // Folded lines and names with whitespace before the colon would hide framing headers from the checks below
+        // while a proxy in front of the server might still honor them, so they are rejected
+        size_t colon = line.find(':');
+
+        if (colon == std::string_view::npos || !isToken(line.substr(0, colon)))
+            return false;
+
+        std::string_view name = line.substr(0, colon);
+        std::string_view value = trim(line.substr(colon + 1));
+
+        if (equalsIgnoreCase(name, "content-length"))
+        {
+            if (value.empty() || value.size() > 18)
+                return false;
+
+            size_t length = 0;
+
+            for (char c : value)
+            {
+                if (c < '0' || c > '9')
+                    return false;
+
+                length = length * 10 + (c - '0');
+            }
+
+            // Repeated lengths which disagree leave the end of the body ambiguous
+            if (head.hasContentLength && length != head.contentLength)
+                return false;
+
+            head.contentLength = length;
+            head.hasContentLength = true;
+        }
+        else if (equalsIgnoreCase(name, "transfer-encoding"))
+        {
+            head.chunked = true;
+        }
+        else if (equalsIgnoreCase(name, "connection"))
+        {
+            if (containsIgnoreCase(value, "close"))
+                head.keepAlive = false;
+            else if (containsIgnoreCase(value, "keep-alive"))
+                head.keepAlive = true;
+        }
+        else if (equalsIgnoreCase(name, "expect"))
+        {
+            head.expectContinue = equalsIgnoreCase(value, "100-continue");
+        }
+
+        head.headers.emplace_back(name, value);
+    }
+
+    return true;
+}
+
+static void parseRequests(Connection* connection);
+
+static void closeConnection(Connection* connection)
+{
+    if (connection->closing)
+        return;
+
+    connection->closing = true;
+
+    // Handlers still running for this connection have nowhere to send their responses anymore
+    for (PendingResponsePtr& response : connection->pending)
+        response->connection = nullptr;
+
+    connection->pending.clear();
+    connection->server->connections.erase(connection);
+
+    uv_close((uv_handle_t*)&connection->handle, [](uv_handle_t* handle) {
+        delete (Connection*)handle->data;
+    });
+}
+
+static void startReading(Connection* connection);
+
+static void onWrite(uv_write_t* req, int status)
+{
+    ResponseWrite* write = (ResponseWrite*)req->data;
+    Connection* connection = (Connection*)req->handle->data;
+
+    delete write;
+
+    connection->writes--;
+
+    if (connection->closing)
+        return;
+
+    if (status < 0)
+    {
+        closeConnection(connection);
+        return;
+    }
+
+    if (connection->lastRequest)
+    {
+        if (connection->pending.empty() && connection->writes == 0)
+            closeConnection(connection);
+
+        return;
+    }
+
+    // A full pipeline or a client which doesn't take its responses stopped reading, requests which arrived meanwhile
+    // may already be waiting in the input
+    if (!connection->reading && connection->pending.size() < kMaxPipelined &&
+        connection->handle.write_queue_size <= kWriteHighWater)
+    {
+        // Parsing goes second, so it can stop reading again when the buffered requests fill the pipeline
+        startReading(connection);
+        parseRequests(connection);
+    }
+}
+
+// Sends the 100 Continue asked for by the request being read, after the final responses to the requests before it
+static void sendContinue(Connection* connection)
+{
+    if (!connection->continueWanted || connection->continueSent || connection->closing || !connection->pending.empty())
+        return;
+
+    static char kContinue[] = "HTTP/1.1 100 Continue\r\n\r\n";
+
+    ResponseWrite* write = new ResponseWrite();
+    write->req.data = write;
+
+    uv_buf_t buf = uv_buf_init(kContinue, unsigned(sizeof(kContinue) - 1));
+
+    if (uv_write(&write->req, (uv_stream_t*)&connection->handle, &buf, 1, onWrite) < 0)
+    {
+        delete write;
+        closeConnection(connection);
+        return;
+    }
+
+    connection->writes++;
+    connection->continueSent = true;
+}
+
+// Writes out the responses at the front of the pipeline which are ready, all in one write
+static void flushResponses(Connection* connection)
+{
+    if (connection->closing || connection->pending.empty() || !connection->pending.front()->ready)
+        return;
+
+    ResponseWrite* write = new ResponseWrite();
+    write->req.data = write;
+
+    std::vector<uv_buf_t> bufs;
+
+    while (!connection->pending.empty() && connection->pending.front()->ready)
+    {
+        PendingResponsePtr response = std::move(connection->pending.front());
+        connection->pending.pop_front();
+
+        bufs.push_back(uv_buf_init(response->header.data(), unsigned(response->header.size())));
+
+        if (!response->head && response->bodySize != 0)
+            bufs.push_back(uv_buf_init(const_cast<char*>(response->body), unsigned(response->bodySize)));
+
+        write->responses.push_back(std::move(response));
+    }
+
+    int err = uv_write(&write->req, (uv_stream_t*)&connection->handle, bufs.data(), unsigned(bufs.size()), onWrite);
+
+    if (err < 0)
+    {
+        delete write;
+        closeConnection(connection);
+        return;
+    }
+
+    connection->writes++;
+
+    sendContinue(connection);
+}
+
+// Answers a request which can't be handled and closes the connection after it
+static void rejectRequest(Connection* connection, int status)
+{
+    auto response = std::make_shared<PendingResponse>();
+    response->connection = connection;
+    response->ready = true;
+    response->keepAlive = false;
+    response->header = "HTTP/1.1 " + std::to_string(status) + " " + reasonPhrase(status) +
+                       "\r\ncontent-length: 0\r\nconnection: close\r\n\r\n";
+
+    connection->pending.push_back(std::move(response));
+    connection->lastRequest = true;
+
+    flushResponses(connection);
+}
+
+static void pushDispatch(lua_State* L)
+{
+    lua_getfield(L, LUA_REGISTRYINDEX, kDispatchKey);
+
+    if (!lua_isnil(L, -1))
+        return;
+
+    lua_pop(L, 1);
+
+    static const std::string bytecode = Luau::compile(kDispatchSource, copts());
+
+    luau_load(L, "=net.serve", bytecode.data(), bytecode.size(), 0);
+
+    lua_pushvalue(L, -1);
+    lua_setfield(L, LUA_REGISTRYINDEX, kDispatchKey);
+}
+
+static void pushRequest(lua_State* L, const RequestHead& head, std::string_view body)
+{
+    lua_createtable(L, 0, 5);
+
+    lua_pushlstring(L, head.method.data(), head.method.size());
+    lua_setfield(L, -2, "method");
+
+    size_t queryStart = head.target.find('?');
+
+    std::string_view path = head.target.substr(0, queryStart);
+    lua_pushlstring(L, path.data(), path.size());
+    lua_setfield(L, -2, "path");
+
+    if (queryStart != std::string_view::npos)
+    {
+        std::string_view query = head.target.substr(queryStart + 1);
+        lua_pushlstring(L, query.data(), query.size());
+        lua_setfield(L, -2, "query");
+    }
+
+    lua_createtable(L, 0, int(head.headers.size()));
+
+    std::string name;
+
+    for (auto& [rawName, value] : head.headers)
+    {
+        name.assign(rawName);
+        std::transform(name.begin(), name.end(), name.begin(), [](unsigned char c) {
+            return char(tolower(c));
+        });
+
+        // Repeated headers are combined like a single header with a list of values
+        lua_getfield(L, -1, name.c_str());
+
+        if (lua_isstring(L, -1))
+        {
+            std::string combined = lua_tostring(L, -1);
+            combined += ", ";
+            combined += value;
+
+            lua_pushlstring(L, combined.data(), combined.size());
+        }
+        else
+        {
+            lua_pushlstring(L, value.data(), value.size());
+        }
+
+        lua_setfield(L, -3, name.c_str());
+        lua_pop(L, 1);
+    }
+
+    lua_setfield(L, -2, "headers");
+
+    lua_pushlstring(L, body.data(), body.size());
+    lua_setfield(L, -2, "body");
+}
+
+// Takes the results of pcall(handler, request)
+static int respond(lua_State* L)
+{
+    PendingResponse& response = **(PendingResponsePtr*)lua_touserdata(L, lua_upvalueindex(1));
+    Connection* connection = response.connection;
+
+    if (!connection || response.ready)
+        return 0;
+
+    int status = 200;
+    std::string headers;
+    const char* error = nullptr;
+
+    int bodyIdx = 0;
+
+    if (!lua_toboolean(L, 1))
+    {
+        error = lua_isstring(L, 2) ? lua_tostring(L, 2) : "error object is not a string";
+    }
+    else if (lua_type(L, 2) == LUA_TSTRING || lua_isbuffer(L, 2))
+    {
+        bodyIdx = 2;
+    }
+    else if (lua_istable(L, 2))
+    {
+        lua_getfield(L, 2, "status");
+        if (lua_isnumber(L, -1))
+            status = int(lua_tonumber(L, -1));
+        else if (!lua_isnil(L, -1))
+            error = "response status must be a number";
+        lua_pop(L, 1);
+
+        lua_getfield(L, 2, "headers");
+        if (lua_istable(L, -1))
+        {
+            lua_pushnil(L);
+
+            while (lua_next(L, -2))
+            {
+                if (lua_type(L, -2) == LUA_TSTRING && lua_isstring(L, -1))
+                {
+                    size_t nameLength = 0;
+                    const char* nameData = lua_tolstring(L, -2, &nameLength);
+                    std::string_view name(nameData, nameLength);
+
+                    size_t valueLength = 0;
+                    const char* valueData = lua_tolstring(L, -1, &valueLength);
+                    std::string_view value(valueData, valueLength);
+
+                    if (!isToken(name))
+                    {
+                        error = "response header names must be valid tokens";
+                    }
+                    else if (!isFieldValue(value))
+                    {
+                        error = "response header values must not contain CR, LF or NUL";
+                    }
+                    // The framing of the response is decided here
+                    else if (!equalsIgnoreCase(name, "content-length") && !equalsIgnoreCase(name, "transfer-encoding") &&
+                             !equalsIgnoreCase(name, "connection"))
+                    {
+                        headers += name;
+                        headers += ": ";
+                        headers += value;
+                        headers += "\r\n";
+                    }
+                }
+                else
+                {
+                    error = "response headers must map names to strings";
+                }
+
+                lua_pop(L, 1);
+            }
+        }
+        else if (!lua_isnil(L, -1))
+        {
+            error = "response headers must be a table";
+        }
+        lua_pop(L, 1);
+
+        lua_getfield(L, 2, "body");
+        if (lua_type(L, -1) == LUA_TSTRING || lua_isbuffer(L, -1))
+            bodyIdx = lua_gettop(L);
+        else if (!lua_isnil(L, -1))
+            error = "response body must be a string or a buffer";
+    }
+    else if (!lua_isnil(L, 2))
+    {
+        error = "handler must return a string, a buffer or a response table";
+    }
+
+    if (status < 100 || status > 999)
+        error = "response status must be between 100 and 999";
+
+    if (error)
+    {
+        fprintf(stderr, "net.serve: %s\n", error);
+
+        status = 500;
+        headers.clear();
+        bodyIdx = 0;
+    }
+
+    if (bodyIdx != 0)
+    {
+        size_t size = 0;
+        response.body = lua_isbuffer(L, bodyIdx) ? (const char*)lua_tobuffer(L, bodyIdx, &size) : lua_tolstring(L, bodyIdx, &size);
+        response.bodySize = size;
+        response.pinned = std::make_shared<Ref>(L, bodyIdx);
+    }
+
+    bool noContent = status == 204 || status == 304 || status < 200;
+
+    if (noContent)
+        response.bodySize = 0;
+
+    response.header.reserve(64 + headers.size());
+
+    response.header = "HTTP/1.1 ";
+    response.header += std::to_string(status);
+    response.header += " ";
+    response.header += reasonPhrase(status);
+    response.header += "\r\n";
+    response.header += headers;
+
+    if (!noContent)
+    {
+        response.header += "content-length: ";
+        response.header += std::to_string(response.bodySize);
+        response.header += "\r\n";
+    }
+
+    if (!response.keepAlive)
+        response.header += "connection: close\r\n";
+    else if (response.http10)
+        response.header += "connection: keep-alive\r\n";
+
+    response.header += "\r\n";
+
+    response.ready = true;
+
+    flushResponses(connection);
+
+    return 0;
+}
+
+// Starts the handler coroutine of a request, it runs once the scheduler comes around
+static void dispatchRequest(Connection* connection, const RequestHead& head, std::string_view body)
+{
+    auto response = std::make_shared<PendingResponse>();
+    response->connection = connection;
+    response->head = head.method == "HEAD";
+    response->keepAlive = head.keepAlive;
+    response->http10 = head.http10;
+
+    connection->pending.push_back(response);
+
+    if (!head.keepAlive)
+        connection->lastRequest = true;
+
+    HttpServer& server = *connection->server;
+    lua_State* GL = server.runtime->GL;
+
+    lua_State* L = lua_newthread(GL);
+
+    pushDispatch(L);
+    server.handler->push(L);
+    pushRequest(L, head, body);
+
+    PendingResponsePtr* upvalue = (PendingResponsePtr*)lua_newuserdatadtor(L, sizeof(PendingResponsePtr), [](void* userdata) {
+        ((PendingResponsePtr*)userdata)->~PendingResponsePtr();
+    });
+
+    new (upvalue) PendingResponsePtr(std::move(response));
+
+    lua_pushcclosure(L, respond, "respond", 1);
+
+    server.runtime->runningThreads.push_back({ true, getRefForThread(L), 3 });
+
+    lua_pop(GL, 1);
+}
+
+static void parseRequests(Connection* connection)
+{
+    while (!connection->closing && !connection->lastRequest && connection->pending.size() < kMaxPipelined &&
+           connection->handle.write_queue_size <= kWriteHighWater)
+    {
+        std::string_view data(connection->input.data() + connection->consumed, connection->used - connection->consumed);
+
+        size_t headEnd = data.find("\r\n\r\n");
+
+        if (headEnd == std::string_view::npos)
+        {
+            if (data.size() > kMaxHeaderSize)
+                rejectRequest(connection, 431);
+
+            break;
+        }
+
+        RequestHead head;
+
+        if (!parseHead(data.substr(0, headEnd + 2), head))
+        {
+            rejectRequest(connection, 400);
+            break;
+        }
+
+        if (head.chunked)
+        {
+            rejectRequest(connection, 501);
+            break;
+        }
+
+        if (head.contentLength > kMaxBodySize)
+        {
+            rejectRequest(connection, 413);
+            break;
+        }
+
+        size_t total = headEnd + 4 + head.contentLength;
+
+        if (data.size() < total)
+        {
+            // Large bodies are read in one go into space made for them
+            if (connection->input.size() < connection->consumed + total)
+                connection->input.resize(connection->consumed + total);
+
+            if (head.expectContinue)
+            {
+                connection->continueWanted = true;
+                sendContinue(connection);
+            }
+
+            break;
+        }
+
+        dispatchRequest(connection, head, data.substr(headEnd + 4, head.contentLength));
+
+        connection->consumed += total;
+        connection->continueWanted = false;
+        connection->continueSent = false;
+    }
+
+    // Whatever is left of the input is moved to the front, it is at most a partial request
+    if (connection->consumed == connection->used)
+    {
+        connection->consumed = 0;
+        connection->used = 0;
+    }
+    else if (connection->consumed != 0)
+    {
+        memmove(connection->input.data(), connection->input.data() + connection->consumed, connection->used - connection->consumed);
+
+        connection->used -= connection->consumed;
+        connection->consumed = 0;
+    }
+
+    if (connection->reading && !connection->closing &&
+        (connection->lastRequest || connection->pending.size() >= kMaxPipelined ||
+         connection->handle.write_queue_size > kWriteHighWater))
+    {
+        uv_read_stop((uv_stream_t*)&connection->handle);
+        connection->reading = false;
+    }
+}
+
+static void startReading(Connection* connection)
+{
+    if (connection->reading || connection->closing || connection->lastRequest)
+        return;
+
+    auto onAlloc = [](uv_handle_t* handle, size_t, uv_buf_t* buf) {
+        Connection* connection = (Connection*)handle->data;
+
+        if (connection->input.size() - connection->used < kReadSize / 4)
+            connection->input.resize(connection->used + kReadSize);
+
+        *buf = uv_buf_init(connection->input.data() + connection->used, unsigned(connection->input.size() - connection->used));
+    };
+
+    auto onRead = [](uv_stream_t* stream, ssize_t nread, const uv_buf_t*) {
+        Connection* connection = (Connection*)stream->data;
+
+        if (nread < 0)
+        {
+            // Responses to requests which were already read still go out when the client only closed its side
+            if (nread == UV_EOF && (!connection->pending.empty() || connection->writes != 0))
+            {
+                connection->lastRequest = true;
+
+                uv_read_stop(stream);
+                connection->reading = false;
+            }
+            else
+            {
+                closeConnection(connection);
+            }
+
+            return;
+        }
+
+        connection->used += nread;
+
+        parseRequests(connection);
+    };
+
+    if (uv_read_start((uv_stream_t*)&connection->handle, onAlloc, onRead) == 0)
+        connection->reading = true;
+    else
+        closeConnection(connection);
+}
+
+// Stops accepting connections, open ones are closed once the requests read from them are answered unless 'force' is set
+static void closeServer(HttpServer& server, bool force)
+{
+    if (server.closed)
+        return;
+
+    server.closed = true;
+
+    uv_close((uv_handle_t*)server.listener, [](uv_handle_t* handle) {
+        delete (uv_tcp_t*)handle;
+    });
+
+    std::vector<Connection*> connections(server.connections.begin(), server.connections.end());
+
+    for (Connection* connection : connections)
+    {
+        if (force || (connection->pending.empty() && connection->writes == 0))
+        {
+            closeConnection(connection);
+            continue;
+        }
+
+        connection->lastRequest = true;
+
+        if (connection->reading)
+        {
+            uv_read_stop((uv_stream_t*)&connection->handle);
+            connection->reading = false;
+        }
+    }
+
+    server.handler.reset();
+
+    // The server kept the runtime running until now
+    server.runtime->releasePendingToken();
+}
+
+static HttpServerPtr& checkServer(lua_State* L, int idx)
+{
+    return *(HttpServerPtr*)luaL_checkudata(L, idx, kHttpServerType);
+}
+
+static int serverClose(lua_State* L)
+{
+    closeServer(*checkServer(L, 1), false);
+    return 0;
+}
+
+static int serverPort(lua_State* L)
+{
+    lua_pushinteger(L, checkServer(L, 1)->port);
+    return 1;
+}
+
+static void pushHttpServerMetatable(lua_State* L)
+{
+    if (luaL_newmetatable(L, kHttpServerType))
+    {
+        lua_createtable(L, 0, 2);
+
+        lua_pushcfunction(L, serverClose, "close");
+        lua_setfield(L, -2, "close");
+
+        lua_pushcfunction(L, serverPort, "port");
+        lua_setfield(L, -2, "port");
+
+        lua_setreadonly(L, -1, 1);
+        lua_setfield(L, -2, "__index");
+
+        lua_pushstring(L, kHttpServerType);
+        lua_setfield(L, -2, "__type");
+
+        lua_setreadonly(L, -1, 1);
+    }
+}
+
+int serve(lua_State* L)
+{
+    luaL_checktype(L, 1, LUA_TTABLE);
+
+    lua_getfield(L, 1, "port");
+    int port = luaL_checkinteger(L, -1);
+    lua_pop(L, 1);
+
+    luaL_argcheck(L, port >= 0 && port <= 65535, 1, "port must be between 0 and 65535");
+
+    lua_getfield(L, 1, "hostname");
+    std::string hostname = lua_isnil(L, -1) ? "0.0.0.0" : luaL_checkstring(L, -1);
+    lua_pop(L, 1);
+
+    lua_getfield(L, 1, "reuseport");
+    bool reusePort = lua_toboolean(L, -1);
+    lua_pop(L, 1);
+
+    lua_getfield(L, 1, "handler");
+    luaL_checktype(L, -1, LUA_TFUNCTION);
+    int handlerIdx = lua_gettop(L);
+
+    sockaddr_storage addr = {};
+
+    if (uv_ip4_addr(hostname.c_str(), port, (sockaddr_in*)&addr) != 0 && uv_ip6_addr(hostname.c_str(), port, (sockaddr_in6*)&addr) != 0)
+        luaL_error(L, "invalid hostname %s", hostname.c_str());
+
+    auto server = std::make_shared<HttpServer>();
+    server->runtime = getRuntime(L);
+
+    server->listener = new uv_tcp_t();
+    server->listener->data = server.get();
+    uv_tcp_init(&server->runtime->loop, server->listener);
+
+    int err = uv_tcp_bind(server->listener, (const sockaddr*)&addr, reusePort ? UV_TCP_REUSEPORT : 0);
+
+    if (err == 0)
+    {
+        err = uv_listen((uv_stream_t*)server->listener, SOMAXCONN, [](uv_stream_t* listener, int status) {
+            HttpServer& server = *(HttpServer*)listener->data;
+
+            if (status < 0)
+                return;
+
+            Connection* connection = new Connection();
+            connection->server = &server;
+            connection->handle.data = connection;
+
+            uv_tcp_init(listener->loop, &connection->handle);
+
+            if (uv_accept(listener, (uv_stream_t*)&connection->handle) != 0)
+            {
+                uv_close((uv_handle_t*)&connection->handle, [](uv_handle_t* handle) {
+                    delete (Connection*)handle->data;
+                });
+
+                return;
+            }
+
+            // Responses are written whole, waiting to fill up a packet only adds latency
+            uv_tcp_nodelay(&connection->handle, 1);
+
+            server.connections.insert(connection);
+
+            startReading(connection);
+        });
+    }
+
+    if (err < 0)
+    {
+        uv_close((uv_handle_t*)server->listener, [](uv_handle_t* handle) {
+            delete (uv_tcp_t*)handle;
+        });
+
+        luaL_error(L, "Error listening on %s:%d: %s", hostname.c_str(), port, uv_strerror(err));
+    }
+
+    sockaddr_storage bound = {};
+    int boundSize = sizeof(bound);
+
+    if (uv_tcp_getsockname(server->listener, (sockaddr*)&bound, &boundSize) == 0)
+        server->port = ntohs(bound.ss_family == AF_INET6 ? ((sockaddr_in6*)&bound)->sin6_port : ((sockaddr_in*)&bound)->sin_port);
+
+    server->handler = std::make_shared<Ref>(L, handlerIdx);
+
+    // The runtime keeps running while the server is open, it is closed before the loop if the script ends otherwise
+    server->runtime->addPendingToken();
+    server->runtime->addShutdownHook([server] {
+        closeServer(*server, true);
+    });
+
+    HttpServerPtr* result = (HttpServerPtr*)lua_newuserdatadtor(L, sizeof(HttpServerPtr), [](void* userdata) {
+        ((HttpServerPtr*)userdata)->~HttpServerPtr();
+    });
+
+    new (result) HttpServerPtr(std::move(server));
+
+    pushHttpServerMetatable(L);
+    lua_setmetatable(L, -2);
+
+    return 1;
+}
+
+} // namespace net
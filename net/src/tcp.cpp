@@ -0,0 +1,786 @@
+#include "lute/tcp.h"
+
+#include "lute/ref.h"
+#include "lute/runtime.h"
+
+#include "uv.h"
+
+#include <cstring>
+#include <deque>
+#include <memory>
+#include <string>
+#include <utility>
+#include <vector>
+
+namespace net
+{
+namespace tcp
+{
+
+static const char* kTcpSocketType = "TcpSocket";
+static const char* kTcpListenerType = "TcpListener";
+static const char* kReadPoolKey = "net.readpool";
+
+constexpr size_t kReadBlockSize = 64 * 1024;
+// Idle blocks kept by the pool of a runtime
+constexpr size_t kMaxPooledBlocks = 64;
+// Data read ahead of the reader, and data waiting to be sent, before the socket pauses
+constexpr size_t kHighWater = 1024 * 1024;
+
+// Fixed size blocks socket reads land in, they go back to the pool once the reader has taken the data
+struct ReadPool
+{
+    std::vector<std::unique_ptr<char[]>> blocks;
+
+    std::unique_ptr<char[]> acquire()
+    {
+        if (blocks.empty())
+            return std::unique_ptr<char[]>(new char[kReadBlockSize]);
+
+        std::unique_ptr<char[]> block = std::move(blocks.back());
+        blocks.pop_back();
+
+        return block;
+    }
+
+    void release(std::unique_ptr<char[]> block)
+    {
+        if (blocks.size() < kMaxPooledBlocks)
+            blocks.push_back(std::move(block));
+    }
+};
+
+using ReadPoolPtr = std::shared_ptr<ReadPool>;
+
+struct ReadChunk
+{
+    std::unique_ptr<char[]> block;
+    size_t size = 0;
+};
+
+struct TcpSocket
+{
+    uv_tcp_t* handle = nullptr;
+    ReadPoolPtr pool;
+
+    std::deque<ReadChunk> chunks;
+    size_t buffered = 0;
+
+    bool reading = false;
+    bool eof = false;
+    bool closed = false;
+    std::string error;
+
+    ResumeToken reader;
+    ResumeToken writer;
+};
+
+using TcpSocketPtr = std::shared_ptr<TcpSocket>;
+
+struct WriteRequest
+{
+    uv_write_t req;
+    TcpSocketPtr socket;
+
+    // What is left of a string is sent from the pinned string, buffers are copied as they can change after write returns
+    std::shared_ptr<Ref> pinned;
+    std::vector<char> copy;
+};
+
+struct TcpListener
+{
+    uv_tcp_t* handle = nullptr;
+    ReadPoolPtr pool;
+
+    int pendingConnections = 0;
+    int port = 0;
+    bool closed = false;
+    std::string error;
+
+    // Coroutine waiting for a connection, resumed with the listener passed back in
+    ResumeToken acceptor;
+    std::shared_ptr<Ref> acceptorSelf;
+};
+
+using TcpListenerPtr = std::shared_ptr<TcpListener>;
+
+static ReadPoolPtr getReadPool(lua_State* L)
+{
+    lua_getfield(L, LUA_REGISTRYINDEX, kReadPoolKey);
+
+    if (lua_isnil(L, -1))
+    {
+        lua_pop(L, 1);
+
+        ReadPoolPtr* pool = (ReadPoolPtr*)lua_newuserdatadtor(L, sizeof(ReadPoolPtr), [](void* userdata) {
+            ((ReadPoolPtr*)userdata)->~ReadPoolPtr();
+        });
+
+        new (pool) ReadPoolPtr(std::make_shared<ReadPool>());
+
+        lua_pushvalue(L, -1);
+        lua_setfield(L, LUA_REGISTRYINDEX, kReadPoolKey);
+    }
+
+    ReadPoolPtr pool = *(ReadPoolPtr*)lua_touserdata(L, -1);
+    lua_pop(L, 1);
+
+    return pool;
+}
+
+// Closes a handle owned by a collected object, the handle might have been closed along with the loop already
+static void closeHandle(uv_handle_t* handle)
+{
+    if (uv_is_closing(handle))
+    {
+        delete (uv_tcp_t*)handle;
+        return;
+    }
+
+    uv_close(handle, [](uv_handle_t* handle) {
+        delete (uv_tcp_t*)handle;
+    });
+}
+
+static void startReading(TcpSocket& socket);
+
+static int pushChunk(lua_State* L, TcpSocket& socket)
+{
+    if (socket.chunks.empty())
+    {
+        lua_pushnil(L);
+        return 1;
+    }
+
+    ReadChunk chunk = std::move(socket.chunks.front());
+    socket.chunks.pop_front();
+    socket.buffered -= chunk.size;
+
+    void* buffer = lua_newbuffer(L, chunk.size);
+    memcpy(buffer, chunk.block.get(), chunk.size);
+
+    socket.pool->release(std::move(chunk.block));
+
+    // The reader caught up, the socket was paused once it got too far ahead
+    if (!socket.reading && !socket.eof && !socket.closed && socket.error.empty() && socket.buffered < kHighWater)
+        startReading(socket);
+
+    return 1;
+}
+
+static void wakeReader(TcpSocket& socket, const TcpSocketPtr& self)
+{
+    ResumeToken token = std::move(socket.reader);
+
+    if (!token)
+        return;
+
+    if (!socket.error.empty() && socket.chunks.empty())
+    {
+        token->fail(socket.error);
+        return;
+    }
+
+    token->complete([self](lua_State* L) {
+        return pushChunk(L, *self);
+    });
+}
+
+static void wakeWriter(TcpSocket& socket)
+{
+    ResumeToken token = std::move(socket.writer);
+
+    if (!token)
+        return;
+
+    if (!socket.error.empty())
+    {
+        token->fail(socket.error);
+        return;
+    }
+
+    token->complete([](lua_State*) {
+        return 0;
+    });
+}
+
+static void closeSocket(TcpSocket& socket, const TcpSocketPtr& self)
+{
+    if (socket.closed)
+        return;
+
+    socket.closed = true;
+    socket.reading = false;
+
+    socket.chunks.clear();
+    socket.buffered = 0;
+
+    closeHandle((uv_handle_t*)socket.handle);
+    socket.handle = nullptr;
+
+    wakeReader(socket, self);
+    wakeWriter(socket);
+}
+
+// The socket state is held by its userdata, which is kept alive by a coroutine waiting on it, so the handle callbacks can
+// refer to it directly; the handle is closed before the state goes away
+static void startReading(TcpSocket& socket)
+{
+    auto onAlloc = [](uv_handle_t* handle, size_t, uv_buf_t* buf) {
+        TcpSocket& socket = *(TcpSocket*)handle->data;
+
+        *buf = uv_buf_init(socket.pool->acquire().release(), unsigned(kReadBlockSize));
+    };
+
+    auto onRead = [](uv_stream_t* stream, ssize_t nread, const uv_buf_t* buf) {
+        TcpSocket& socket = *(TcpSocket*)stream->data;
+
+        std::unique_ptr<char[]> block(buf->base);
+
+        if (nread > 0)
+        {
+            // Short reads are merged into the last block while it has room, so a peer sending tiny segments can't hold
+            // a whole block per segment and the pause below bounds the memory, not only the data
+            ReadChunk* tail = socket.chunks.empty() ? nullptr : &socket.chunks.back();
+
+            if (tail && kReadBlockSize - tail->size >= size_t(nread))
+            {
+                memcpy(tail->block.get() + tail->size, block.get(), nread);
+                tail->size += nread;
+
+                socket.pool->release(std::move(block));
+            }
+            else
+            {
+                socket.chunks.push_back({std::move(block), size_t(nread)});
+            }
+
+            socket.buffered += nread;
+
+            if (socket.buffered >= kHighWater)
+            {
+                uv_read_stop(stream);
+                socket.reading = false;
+            }
+        }
+        else
+        {
+            if (block)
+                socket.pool->release(std::move(block));
+
+            if (nread == 0)
+                return;
+
+            if (nread == UV_EOF)
+                socket.eof = true;
+            else
+                socket.error = std::string("Error reading from socket: ") + uv_strerror(int(nread));
+
+            uv_read_stop(stream);
+            socket.reading = false;
+        }
+
+        if (socket.reader)
+        {
+            // The reader's token keeps the state alive until the coroutine is resumed with the data
+            ResumeToken token = std::move(socket.reader);
+            TcpSocket* state = &socket;
+
+            if (!socket.error.empty() && socket.chunks.empty())
+                token->fail(socket.error);
+            else
+                token->complete([state](lua_State* L) {
+                    return pushChunk(L, *state);
+                });
+        }
+    };
+
+    if (uv_read_start((uv_stream_t*)socket.handle, onAlloc, onRead) == 0)
+        socket.reading = true;
+}
+
+static TcpSocketPtr& checkSocket(lua_State* L, int idx)
+{
+    return *(TcpSocketPtr*)luaL_checkudata(L, idx, kTcpSocketType);
+}
+
+static int socketRead(lua_State* L)
+{
+    TcpSocketPtr& socket = checkSocket(L, 1);
+
+    if (socket->reader)
+        luaL_error(L, "socket is already being read by another coroutine");
+
+    if (!socket->chunks.empty())
+        return pushChunk(L, *socket);
+
+    if (!socket->error.empty())
+        luaL_error(L, "%s", socket->error.c_str());
+
+    if (socket->eof || socket->closed)
+    {
+        lua_pushnil(L);
+        return 1;
+    }
+
+    socket->reader = getResumeToken(L);
+    return lua_yield(L, 0);
+}
+
+static int socketWrite(lua_State* L)
+{
+    TcpSocketPtr& socket = checkSocket(L, 1);
+
+    size_t size = 0;
+    const char* data = lua_isbuffer(L, 2) ? (const char*)lua_tobuffer(L, 2, &size) : luaL_checklstring(L, 2, &size);
+
+    if (socket->closed)
+        luaL_error(L, "socket is closed");
+
+    if (!socket->error.empty())
+        luaL_error(L, "%s", socket->error.c_str());
+
+    if (socket->writer)
+        luaL_error(L, "socket is already being written to by another coroutine");
+
+    if (size == 0)
+        return 0;
+
+    uv_stream_t* stream = (uv_stream_t*)socket->handle;
+
+    // Most writes go out right away, only what the kernel doesn't take is queued
+    uv_buf_t buf = uv_buf_init(const_cast<char*>(data), unsigned(size));
+    int written = uv_try_write(stream, &buf, 1);
+
+    if (written < 0 && written != UV_EAGAIN)
+        luaL_error(L, "Error writing to socket: %s", uv_strerror(written));
+
+    size_t sent = written > 0 ? size_t(written) : 0;
+
+    if (sent == size)
+        return 0;
+
+    WriteRequest* write = new WriteRequest();
+    write->req.data = write;
+    write->socket = socket;
+
+    if (lua_isbuffer(L, 2))
+    {
+        write->copy.assign(data + sent, data + size);
+        buf = uv_buf_init(write->copy.data(), unsigned(write->copy.size()));
+    }
+    else
+    {
+        write->pinned = std::make_shared<Ref>(L, 2);
+        buf = uv_buf_init(const_cast<char*>(data) + sent, unsigned(size - sent));
+    }
+
+    int err = uv_write(&write->req, stream, &buf, 1, [](uv_write_t* req, int status) {
+        WriteRequest* write = (WriteRequest*)req->data;
+        TcpSocketPtr socket = std::move(write->socket);
+
+        delete write;
+
+        if (status < 0 && status != UV_ECANCELED && socket->error.empty())
+            socket->error = std::string("Error writing to socket: ") + uv_strerror(status);
+
+        if (socket->writer && (socket->closed || !socket->error.empty() || socket->handle->write_queue_size < kHighWater))
+            wakeWriter(*socket);
+    });
+
+    if (err < 0)
+    {
+        delete write;
+        luaL_error(L, "Error writing to socket: %s", uv_strerror(err));
+    }
+
+    if (stream->write_queue_size < kHighWater)
+        return 0;
+
+    socket->writer = getResumeToken(L);
+    return lua_yield(L, 0);
+}
+
+static int socketClose(lua_State* L)
+{
+    TcpSocketPtr& socket = checkSocket(L, 1);
+
+    closeSocket(*socket, socket);
+
+    return 0;
+}
+
+static void pushTcpSocketMetatable(lua_State* L)
+{
+    if (luaL_newmetatable(L, kTcpSocketType))
+    {
+        lua_createtable(L, 0, 3);
+
+        lua_pushcfunction(L, socketRead, "read");
+        lua_setfield(L, -2, "read");
+
+        lua_pushcfunction(L, socketWrite, "write");
+        lua_setfield(L, -2, "write");
+
+        lua_pushcfunction(L, socketClose, "close");
+        lua_setfield(L, -2, "close");
+
+        lua_setreadonly(L, -1, 1);
+        lua_setfield(L, -2, "__index");
+
+        lua_pushstring(L, kTcpSocketType);
+        lua_setfield(L, -2, "__type");
+
+        lua_setreadonly(L, -1, 1);
+    }
+}
+
+// Takes over a connected handle and starts reading from it
+static void pushSocket(lua_State* L, uv_tcp_t* handle, ReadPoolPtr pool)
+{
+    auto socket = std::make_shared<TcpSocket>();
+    socket->handle = handle;
+    socket->pool = std::move(pool);
+
+    handle->data = socket.get();
+
+    uv_tcp_nodelay(handle, 1);
+
+    startReading(*socket);
+
+    TcpSocketPtr* result = (TcpSocketPtr*)lua_newuserdatadtor(L, sizeof(TcpSocketPtr), [](void* userdata) {
+        TcpSocketPtr& socket = *(TcpSocketPtr*)userdata;
+
+        closeSocket(*socket, socket);
+
+        socket.~TcpSocketPtr();
+    });
+
+    new (result) TcpSocketPtr(std::move(socket));
+
+    pushTcpSocketMetatable(L);
+    lua_setmetatable(L, -2);
+}
+
+struct ConnectRequest
+{
+    uv_getaddrinfo_t resolve;
+    uv_connect_t connect;
+
+    uv_tcp_t* handle = nullptr;
+    ReadPoolPtr pool;
+    ResumeToken token;
+
+    std::string host;
+
+    // Resolved addresses, tried in order until one of them accepts the connection
+    addrinfo* addresses = nullptr;
+    addrinfo* next = nullptr;
+};
+
+static void closeConnectHandle(ConnectRequest* request)
+{
+    if (!request->handle)
+        return;
+
+    uv_close((uv_handle_t*)request->handle, [](uv_handle_t* handle) {
+        delete (uv_tcp_t*)handle;
+    });
+
+    request->handle = nullptr;
+}
+
+static void failConnect(ConnectRequest* request, const char* action, int err)
+{
+    request->token->fail(std::string("Error ") + action + " " + request->host + ": " + uv_strerror(err));
+
+    closeConnectHandle(request);
+    uv_freeaddrinfo(request->addresses);
+
+    delete request;
+}
+
+// A host like localhost can resolve to an address nothing listens on first, so a failed attempt moves on to the next one
+static void connectNext(ConnectRequest* request, int err)
+{
+    while (request->next)
+    {
+        addrinfo* address = request->next;
+        request->next = address->ai_next;
+
+        // A handle is not reused after a failed connect
+        closeConnectHandle(request);
+
+        request->handle = new uv_tcp_t();
+        uv_tcp_init(request->resolve.loop, request->handle);
+
+        err = uv_tcp_connect(&request->connect, request->handle, address->ai_addr, [](uv_connect_t* connect, int status) {
+            ConnectRequest* request = (ConnectRequest*)connect->data;
+
+            if (status < 0)
+                return connectNext(request, status);
+
+            request->token->complete([handle = request->handle, pool = std::move(request->pool)](lua_State* L) {
+                pushSocket(L, handle, pool);
+                return 1;
+            });
+
+            uv_freeaddrinfo(request->addresses);
+            delete request;
+        });
+
+        if (err == 0)
+            return;
+    }
+
+    failConnect(request, "connecting to", err);
+}
+
+int connect(lua_State* L)
+{
+    const char* host = luaL_checkstring(L, 1);
+    int port = luaL_checkinteger(L, 2);
+
+    luaL_argcheck(L, port > 0 && port <= 65535, 2, "port must be between 1 and 65535");
+
+    ConnectRequest* request = new ConnectRequest();
+    request->resolve.data = request;
+    request->connect.data = request;
+    request->pool = getReadPool(L);
+    request->host = host;
+
+    std::string service = std::to_string(port);
+
+    addrinfo hints = {};
+    hints.ai_family = AF_UNSPEC;
+    hints.ai_socktype = SOCK_STREAM;
+
+    uv_loop_t* loop = &getRuntime(L)->loop;
+
+    int err = uv_getaddrinfo(loop, &request->resolve, [](uv_getaddrinfo_t* resolve, int status, addrinfo* result) {
+        ConnectRequest* request = (ConnectRequest*)resolve->data;
+
+        request->addresses = result;
+        request->next = result;
+
+        if (status < 0)
+            return failConnect(request, "resolving", status);
+
+        connectNext(request, UV_EAI_NONAME);
+    }, host, service.c_str(), &hints);
+
+    if (err < 0)
+    {
+        delete request;
+        luaL_error(L, "Error resolving %s: %s", host, uv_strerror(err));
+    }
+
+    request->token = getResumeToken(L);
+    return lua_yield(L, 0);
+}
+
+static TcpListenerPtr& checkListener(lua_State* L, int idx)
+{
+    return *(TcpListenerPtr*)luaL_checkudata(L, idx, kTcpListenerType);
+}
+
+static int acceptConnection(lua_State* L, TcpListener& listener)
+{
+    // The listener can be closed between a connection arriving and the waiting coroutine being resumed
+    if (listener.closed)
+        luaL_error(L, "listener is closed");
+
+    uv_tcp_t* handle = new uv_tcp_t();
+    uv_tcp_init(listener.handle->loop, handle);
+
+    int err = uv_accept((uv_stream_t*)listener.handle, (uv_stream_t*)handle);
+
+    listener.pendingConnections--;
+
+    if (err < 0)
+    {
+        uv_close((uv_handle_t*)handle, [](uv_handle_t* handle) {
+            delete (uv_tcp_t*)handle;
+        });
+
+        luaL_error(L, "Error accepting a connection: %s", uv_strerror(err));
+    }
+
+    pushSocket(L, handle, listener.pool);
+    return 1;
+}
+
+static void closeListener(TcpListener& listener)
+{
+    if (listener.closed)
+        return;
+
+    listener.closed = true;
+
+    closeHandle((uv_handle_t*)listener.handle);
+    listener.handle = nullptr;
+
+    listener.acceptorSelf.reset();
+
+    if (ResumeToken token = std::move(listener.acceptor))
+        token->fail("listener was closed");
+}
+
+static int listenerAccept(lua_State* L)
+{
+    TcpListenerPtr& listener = checkListener(L, 1);
+
+    if (listener->closed)
+        luaL_error(L, "listener is closed");
+
+    if (!listener->error.empty())
+        luaL_error(L, "%s", listener->error.c_str());
+
+    if (listener->acceptor)
+        luaL_error(L, "listener is already being accepted from by another coroutine");
+
+    if (listener->pendingConnections > 0)
+        return acceptConnection(L, *listener);
+
+    listener->acceptor = getResumeToken(L);
+    listener->acceptorSelf = std::make_shared<Ref>(L, 1);
+
+    return lua_yield(L, 0);
+}
+
+static int listenerAcceptCont(lua_State* L, int status)
+{
+    // The connection is taken once the coroutine runs, errors raised from here go to the coroutine
+    return acceptConnection(L, *checkListener(L, 1));
+}
+
+static int listenerPort(lua_State* L)
+{
+    lua_pushinteger(L, checkListener(L, 1)->port);
+    return 1;
+}
+
+static int listenerClose(lua_State* L)
+{
+    closeListener(*checkListener(L, 1));
+    return 0;
+}
+
+static void pushTcpListenerMetatable(lua_State* L)
+{
+    if (luaL_newmetatable(L, kTcpListenerType))
+    {
+        lua_createtable(L, 0, 3);
+
+        lua_pushcclosurek(L, listenerAccept, "accept", 0, listenerAcceptCont);
+        lua_setfield(L, -2, "accept");
+
+        lua_pushcfunction(L, listenerPort, "port");
+        lua_setfield(L, -2, "port");
+
+        lua_pushcfunction(L, listenerClose, "close");
+        lua_setfield(L, -2, "close");
+
+        lua_setreadonly(L, -1, 1);
+        lua_setfield(L, -2, "__index");
+
+        lua_pushstring(L, kTcpListenerType);
+        lua_setfield(L, -2, "__type");
+
+        lua_setreadonly(L, -1, 1);
+    }
+}
+
+int listen(lua_State* L)
+{
+    luaL_checktype(L, 1, LUA_TTABLE);
+
+    lua_getfield(L, 1, "port");
+    int port = luaL_checkinteger(L, -1);
+    lua_pop(L, 1);
+
+    luaL_argcheck(L, port >= 0 && port <= 65535, 1, "port must be between 0 and 65535");
+
+    lua_getfield(L, 1, "hostname");
+    std::string hostname = lua_isnil(L, -1) ? "0.0.0.0" : luaL_checkstring(L, -1);
+    lua_pop(L, 1);
+
+    lua_getfield(L, 1, "backlog");
+    int backlog = lua_isnil(L, -1) ? SOMAXCONN : luaL_checkinteger(L, -1);
+    lua_pop(L, 1);
+
+    sockaddr_storage addr = {};
+
+    if (uv_ip4_addr(hostname.c_str(), port, (sockaddr_in*)&addr) != 0 && uv_ip6_addr(hostname.c_str(), port, (sockaddr_in6*)&addr) != 0)
+        luaL_error(L, "invalid hostname %s", hostname.c_str());
+
+    auto listener = std::make_shared<TcpListener>();
+    listener->pool = getReadPool(L);
+
+    listener->handle = new uv_tcp_t();
+    listener->handle->data = listener.get();
+    uv_tcp_init(&getRuntime(L)->loop, listener->handle);
+
+    int err = uv_tcp_bind(listener->handle, (const sockaddr*)&addr, 0);
+
+    if (err == 0)
+    {
+        // libuv holds on to one accepted connection and stops accepting until it is taken
+        err = uv_listen((uv_stream_t*)listener->handle, backlog, [](uv_stream_t* handle, int status) {
+            TcpListener& listener = *(TcpListener*)handle->data;
+
+            if (status < 0)
+            {
+                listener.error = std::string("Error accepting a connection: ") + uv_strerror(status);
+                listener.acceptorSelf.reset();
+
+                if (ResumeToken token = std::move(listener.acceptor))
+                    token->fail(listener.error);
+
+                return;
+            }
+
+            listener.pendingConnections++;
+
+            if (ResumeToken token = std::move(listener.acceptor))
+            {
+                std::shared_ptr<Ref> self = std::move(listener.acceptorSelf);
+
+                token->complete([self = std::move(self)](lua_State* L) {
+                    self->push(L);
+                    return 1;
+                });
+            }
+        });
+    }
+
+    if (err < 0)
+    {
+        closeListener(*listener);
+        luaL_error(L, "Error listening on %s:%d: %s", hostname.c_str(), port, uv_strerror(err));
+    }
+
+    sockaddr_storage bound = {};
+    int boundSize = sizeof(bound);
+
+    if (uv_tcp_getsockname(listener->handle, (sockaddr*)&bound, &boundSize) == 0)
+        listener->port = ntohs(bound.ss_family == AF_INET6 ? ((sockaddr_in6*)&bound)->sin6_port : ((sockaddr_in*)&bound)->sin_port);
+
+    TcpListenerPtr* result = (TcpListenerPtr*)lua_newuserdatadtor(L, sizeof(TcpListenerPtr), [](void* userdata) {
+        TcpListenerPtr& listener = *(TcpListenerPtr*)userdata;
+
+        closeListener(*listener);
+
+        listener.~TcpListenerPtr();
+    });
+
+    new (result) TcpListenerPtr(std::move(listener));
+
+    pushTcpListenerMetatable(L);
+    lua_setmetatable(L, -2);
+
+    return 1;
+}
+
+} // namespace tcp
+} // namespace net
@@ -0,0 +1,429 @@
+#include "lute/udp.h"
+
+#include "lute/runtime.h"
+
+#include "uv.h"
+
+#include <cstring>
+#include <deque>
+#include <memory>
+#include <string>
+#include <vector>
+
+namespace net
+{
+namespace udp
+{
+
+static const char* kUdpSocketType = "UdpSocket";
+
+constexpr size_t kMaxDatagramSize = 64 * 1024;
+// Datagrams read by a single recvmmsg call
+constexpr size_t kBatchSize = 20;
+constexpr size_t kMaxQueuedDatagrams = 1024;
+// Data waiting to be sent before send starts yielding
+constexpr size_t kHighWater = 1024 * 1024;
+
+struct Datagram
+{
+    std::vector<char> data;
+    sockaddr_storage addr;
+};
+
+struct UdpSocket
+{
+    uv_udp_t* handle = nullptr;
+
+    // libuv splits one allocation into kBatchSize datagrams when receiving with recvmmsg, they are copied out in the
+    // receive callback so the same buffer serves every batch
+    std::unique_ptr<char[]> batch;
+
+    std::deque<Datagram> datagrams;
+
+    bool receiving = false;
+    bool closed = false;
+    int port = 0;
+    std::string error;
+
+    ResumeToken receiver;
+    ResumeToken sender;
+};
+
+using UdpSocketPtr = std::shared_ptr<UdpSocket>;
+
+struct SendRequest
+{
+    uv_udp_send_t req;
+    UdpSocketPtr socket;
+    std::vector<char> data;
+};
+
+static void startReceiving(UdpSocket& socket);
+
+static int pushDatagram(lua_State* L, UdpSocket& socket)
+{
+    if (socket.datagrams.empty())
+    {
+        lua_pushnil(L);
+        return 1;
+    }
+
+    Datagram datagram = std::move(socket.datagrams.front());
+    socket.datagrams.pop_front();
+
+    void* buffer = lua_newbuffer(L, datagram.data.size());
+
+    if (!datagram.data.empty())
+        memcpy(buffer, datagram.data.data(), datagram.data.size());
+
+    char host[INET6_ADDRSTRLEN] = {};
+    int port = 0;
+
+    if (datagram.addr.ss_family == AF_INET6)
+    {
+        sockaddr_in6* addr = (sockaddr_in6*)&datagram.addr;
+        uv_ip6_name(addr, host, sizeof(host));
+        port = ntohs(addr->sin6_port);
+    }
+    else
+    {
+        sockaddr_in* addr = (sockaddr_in*)&datagram.addr;
+        uv_ip4_name(addr, host, sizeof(host));
+        port = ntohs(addr->sin_port);
+    }
+
+    lua_pushstring(L, host);
+    lua_pushinteger(L, port);
+
+    // The reader caught up, receiving was paused once too many datagrams were waiting
+    if (!socket.receiving && !socket.closed && socket.error.empty() && socket.datagrams.size() < kMaxQueuedDatagrams)
+        startReceiving(socket);
+
+    return 3;
+}
+
+static void wakeReceiver(UdpSocket& socket)
+{
+    ResumeToken token = std::move(socket.receiver);
+
+    if (!token)
+        return;
+
+    if (!socket.error.empty())
+    {
+        token->fail(socket.error);
+        return;
+    }
+
+    // A coroutine waiting in recv keeps the socket userdata, and with it the state, alive until it is resumed
+    UdpSocket* state = &socket;
+
+    token->complete([state](lua_State* L) {
+        return pushDatagram(L, *state);
+    });
+}
+
+static void wakeSender(UdpSocket& socket)
+{
+    ResumeToken token = std::move(socket.sender);
+
+    if (!token)
+        return;
+
+    if (!socket.error.empty())
+    {
+        token->fail(socket.error);
+        return;
+    }
+
+    token->complete([](lua_State*) {
+        return 0;
+    });
+}
+
+static void startReceiving(UdpSocket& socket)
+{
+    auto onAlloc = [](uv_handle_t* handle, size_t, uv_buf_t* buf) {
+        UdpSocket& socket = *(UdpSocket*)handle->data;
+
+        if (!socket.batch)
+            socket.batch.reset(new char[kMaxDatagramSize * kBatchSize]);
+
+        *buf = uv_buf_init(socket.batch.get(), unsigned(kMaxDatagramSize * kBatchSize));
+    };
+
+    auto onRecv = [](uv_udp_t* handle, ssize_t nread, const uv_buf_t* buf, const sockaddr* addr, unsigned) {
+        UdpSocket& socket = *(UdpSocket*)handle->data;
+
+        if (nread < 0)
+        {
+            socket.error = std::string("Error receiving from socket: ") + uv_strerror(int(nread));
+
+            uv_udp_recv_stop(handle);
+            socket.receiving = false;
+
+            wakeReceiver(socket);
+            return;
+        }
+
+        // Nothing more to read, or the end of a batch reported one datagram at a time with UV_UDP_MMSG_CHUNK
+        if (addr == nullptr)
+            return;
+
+        Datagram datagram;
+        datagram.data.assign(buf->base, buf->base + nread);
+        memcpy(&datagram.addr, addr, addr->sa_family == AF_INET6 ? sizeof(sockaddr_in6) : sizeof(sockaddr_in));
+
+        socket.datagrams.push_back(std::move(datagram));
+
+        if (socket.datagrams.size() >= kMaxQueuedDatagrams)
+        {
+            uv_udp_recv_stop(handle);
+            socket.receiving = false;
+        }
+
+        wakeReceiver(socket);
+    };
+
+    if (uv_udp_recv_start(socket.handle, onAlloc, onRecv) == 0)
+        socket.receiving = true;
+}
+
+static void closeSocket(UdpSocket& socket)
+{
+    if (socket.closed)
+        return;
+
+    socket.closed = true;
+    socket.receiving = false;
+    socket.datagrams.clear();
+
+    uv_handle_t* handle = (uv_handle_t*)socket.handle;
+    socket.handle = nullptr;
+
+    // The close callback frees the handle, after the loop is closed there is nothing left to wait for
+    if (uv_is_closing(handle))
+        delete (uv_udp_t*)handle;
+    else
+        uv_close(handle, [](uv_handle_t* handle) {
+            delete (uv_udp_t*)handle;
+        });
+
+    wakeReceiver(socket);
+    wakeSender(socket);
+}
+
+static UdpSocketPtr& checkSocket(lua_State* L, int idx)
+{
+    return *(UdpSocketPtr*)luaL_checkudata(L, idx, kUdpSocketType);
+}
+
+static int socketSend(lua_State* L)
+{
+    UdpSocketPtr& socket = checkSocket(L, 1);
+
+    size_t size = 0;
+    const char* data = lua_isbuffer(L, 2) ? (const char*)lua_tobuffer(L, 2, &size) : luaL_checklstring(L, 2, &size);
+
+    const char* host = luaL_checkstring(L, 3);
+    int port = luaL_checkinteger(L, 4);
+
+    luaL_argcheck(L, port > 0 && port <= 65535, 4, "port must be between 1 and 65535");
+
+    if (socket->closed)
+        luaL_error(L, "socket is closed");
+
+    if (socket->sender)
+        luaL_error(L, "socket is already being sent on by another coroutine");
+
+    sockaddr_storage addr = {};
+
+    if (uv_ip4_addr(host, port, (sockaddr_in*)&addr) != 0 && uv_ip6_addr(host, port, (sockaddr_in6*)&addr) != 0)
+        luaL_error(L, "host must be an IP address, got %s", host);
+
+    uv_buf_t buf = uv_buf_init(const_cast<char*>(data), unsigned(size));
+
+    // Datagrams go out right away unless the kernel buffer is full, only then is the data copied and queued
+    int err = uv_udp_try_send(socket->handle, &buf, 1, (const sockaddr*)&addr);
+
+    if (err >= 0)
+        return 0;
+
+    if (err != UV_EAGAIN)
+        luaL_error(L, "Error sending to %s:%d: %s", host, port, uv_strerror(err));
+
+    SendRequest* send = new SendRequest();
+    send->req.data = send;
+    send->socket = socket;
+    send->data.assign(data, data + size);
+
+    buf = uv_buf_init(send->data.data(), unsigned(send->data.size()));
+
+    err = uv_udp_send(&send->req, socket->handle, &buf, 1, (const sockaddr*)&addr, [](uv_udp_send_t* req, int status) {
+        SendRequest* send = (SendRequest*)req->data;
+        UdpSocketPtr socket = std::move(send->socket);
+
+        delete send;
+
+        // Datagrams are unreliable anyway, a failed send is only reported to a coroutine waiting for the queue to drain
+        if (status < 0 && status != UV_ECANCELED && socket->sender)
+        {
+            ResumeToken token = std::move(socket->sender);
+            return token->fail(std::string("Error sending datagram: ") + uv_strerror(status));
+        }
+
+        if (socket->sender && (socket->closed || socket->handle->send_queue_size < kHighWater))
+            wakeSender(*socket);
+    });
+
+    if (err < 0)
+    {
+        delete send;
+        luaL_error(L, "Error sending to %s:%d: %s", host, port, uv_strerror(err));
+    }
+
+    if (socket->handle->send_queue_size < kHighWater)
+        return 0;
+
+    socket->sender = getResumeToken(L);
+    return lua_yield(L, 0);
+}
+
+static int socketRecv(lua_State* L)
+{
+    UdpSocketPtr& socket = checkSocket(L, 1);
+
+    if (socket->receiver)
+        luaL_error(L, "socket is already being received from by another coroutine");
+
+    if (!socket->datagrams.empty())
+        return pushDatagram(L, *socket);
+
+    if (!socket->error.empty())
+        luaL_error(L, "%s", socket->error.c_str());
+
+    if (socket->closed)
+    {
+        lua_pushnil(L);
+        return 1;
+    }
+
+    // Receiving starts with the first recv, so a socket that only sends never buffers anything
+    if (!socket->receiving)
+        startReceiving(*socket);
+
+    socket->receiver = getResumeToken(L);
+    return lua_yield(L, 0);
+}
+
+static int socketPort(lua_State* L)
+{
+    lua_pushinteger(L, checkSocket(L, 1)->port);
+    return 1;
+}
+
+static int socketClose(lua_State* L)
+{
+    closeSocket(*checkSocket(L, 1));
+    return 0;
+}
+
+static void pushUdpSocketMetatable(lua_State* L)
+{
+    if (luaL_newmetatable(L, kUdpSocketType))
+    {
+        lua_createtable(L, 0, 4);
+
+        lua_pushcfunction(L, socketSend, "send");
+        lua_setfield(L, -2, "send");
+
+        lua_pushcfunction(L, socketRecv, "recv");
+        lua_setfield(L, -2, "recv");
+
+        lua_pushcfunction(L, socketPort, "port");
+        lua_setfield(L, -2, "port");
+
+        lua_pushcfunction(L, socketClose, "close");
+        lua_setfield(L, -2, "close");
+
+        lua_setreadonly(L, -1, 1);
+        lua_setfield(L, -2, "__index");
+
+        lua_pushstring(L, kUdpSocketType);
+        lua_setfield(L, -2, "__type");
+
+        lua_setreadonly(L, -1, 1);
+    }
+}
+
+int bind(lua_State* L)
+{
+    int port = 0;
+    std::string hostname = "0.0.0.0";
+
+    if (!lua_isnoneornil(L, 1))
+    {
+        luaL_checktype(L, 1, LUA_TTABLE);
+
+        lua_getfield(L, 1, "port");
+        if (!lua_isnil(L, -1))
+            port = luaL_checkinteger(L, -1);
+        lua_pop(L, 1);
+
+        lua_getfield(L, 1, "hostname");
+        if (!lua_isnil(L, -1))
+            hostname = luaL_checkstring(L, -1);
+        lua_pop(L, 1);
+    }
+
+    luaL_argcheck(L, port >= 0 && port <= 65535, 1, "port must be between 0 and 65535");
+
+    sockaddr_storage addr = {};
+
+    if (uv_ip4_addr(hostname.c_str(), port, (sockaddr_in*)&addr) != 0 && uv_ip6_addr(hostname.c_str(), port, (sockaddr_in6*)&addr) != 0)
+        luaL_error(L, "invalid hostname %s", hostname.c_str());
+
+    auto socket = std::make_shared<UdpSocket>();
+
+    socket->handle = new uv_udp_t();
+    socket->handle->data = socket.get();
+
+    unsigned int flags = AF_UNSPEC;
+#ifdef __linux__
+    flags |= UV_UDP_RECVMMSG;
+#endif
+
+    uv_udp_init_ex(&getRuntime(L)->loop, socket->handle, flags);
+
+    int err = uv_udp_bind(socket->handle, (const sockaddr*)&addr, 0);
+
+    if (err < 0)
+    {
+        closeSocket(*socket);
+        luaL_error(L, "Error binding to %s:%d: %s", hostname.c_str(), port, uv_strerror(err));
+    }
+
+    sockaddr_storage bound = {};
+    int boundSize = sizeof(bound);
+
+    if (uv_udp_getsockname(socket->handle, (sockaddr*)&bound, &boundSize) == 0)
+        socket->port = ntohs(bound.ss_family == AF_INET6 ? ((sockaddr_in6*)&bound)->sin6_port : ((sockaddr_in*)&bound)->sin_port);
+
+    UdpSocketPtr* result = (UdpSocketPtr*)lua_newuserdatadtor(L, sizeof(UdpSocketPtr), [](void* userdata) {
+        UdpSocketPtr& socket = *(UdpSocketPtr*)userdata;
+
+        closeSocket(*socket);
+
+        socket.~UdpSocketPtr();
+    });
+
+    new (result) UdpSocketPtr(std::move(socket));
+
+    pushUdpSocketMetatable(L);
+    lua_setmetatable(L, -2);
+
+    return 1;
+}
+
+} // namespace udp
+} // namespace net
@@ -0,0 +1,94 @@
+#pragma once
+
+#include <atomic>
+#include <cstdint>
+#include <mutex>
+#include <string>
+#include <vector>
+
+struct Runtime;
+
+// Power-of-two latency histogram in microseconds, safe to record from one thread while others read it
+struct LatencyHistogram
+{
+    // Bucket 'i' counts samples in [2^(i-1), 2^i) microseconds, the last bucket also holds everything above it
+    static constexpr int kBuckets = 25;
+
+    void record(uint64_t micros);
+
+    // Approximate percentile (0-100) taken as the upper bound of the bucket containing it
+    uint64_t percentile(double p) const;
+
+    std::atomic<uint64_t> buckets[kBuckets] = {};
+    std::atomic<uint64_t> count{0};
+    std::atomic<uint64_t> total{0};
+    std::atomic<uint64_t> max{0};
+};
+
+struct RuntimeMetrics
+{
+    // Time between a continuation being scheduled and the runtime thread getting to run it
+    LatencyHistogram loopLag;
+
+    std::atomic<uint64_t> loopIterations{0};
+    std::atomic<uint64_t> resumes{0};
+
+    // Coroutines ready to run, published by the runtime thread on every iteration
+    std::atomic<uint64_t> readyQueue{0};
+
+    // Work items submitted through 'runInWorkQueue' that are waiting for or running on a threadpool thread
+    std::atomic<int64_t> workQueued{0};
+    std::atomic<int64_t> workRunning{0};
+
+    // State used to compute rates between consecutive snapshots
+    std::mutex rateMutex;
+    uint64_t lastSnapshotTime = 0;
+    uint64_t lastResumes = 0;
+};
+
+struct MetricsSnapshot
+{
+    std::string name;
+
+    uint64_t lagCount = 0;
+    double lagMean = 0.0;
+    uint64_t lagMax = 0;
+    uint64_t lagP50 = 0;
+    uint64_t lagP90 = 0;
+    uint64_t lagP99 = 0;
+    std::vector<uint64_t> lagBuckets;
+
+    double idleTime = 0.0; // seconds
+    uint64_t loopIterations = 0;
+
+    uint64_t readyQueue = 0;
+    uint64_t continuationQueue = 0;
+    int pendingTokens = 0;
+    int64_t workQueued = 0;
+    int64_t workRunning = 0;
+
+    uint64_t resumes = 0;
+    double resumesPerSecond = 0.0;
+};
+
+namespace metrics
+{
+
+// Runtimes register themselves on construction so that all of them can be reported on
+void registerRuntime(Runtime* runtime);
+void unregisterRuntime(Runtime* runtime);
+
+// Captures the current metrics of a runtime, can be called from any thread
+MetricsSnapshot snapshot(Runtime& runtime);
+
+// Captures the metrics of every live runtime (main runtime and child VMs)
+std::vector<MetricsSnapshot> snapshotAll();
+
+// Formats a snapshot as a single-line JSON object
+std::string toJson(const MetricsSnapshot& snapshot);
+
+// Prints metrics of all runtimes to stderr as JSON lines every 'intervalMs' milliseconds until stopped
+void startPeriodicDump(int intervalMs);
+void stopPeriodicDump();
+
+} // namespace metrics
@@ -1,9 +1,14 @@
 #pragma once
 
+#include "lute/metrics.h"
 #include "lute/ref.h"
 
+#include "uv.h"
+
 #include <atomic>
 #include <condition_variable>
+#include <cstdint>
+#include <deque>
 #include <functional>
 #include <memory>
 #include <mutex>
@@ -17,33 +22,56 @@ struct ThreadToContinue
     std::shared_ptr<Ref> ref;
     int argumentCount = 0;
     std::function<void()> cont;
+
+    // Async trace event id of the token which made this thread ready to run
+    uint64_t traceId = 0;
 };
 
 struct Runtime
 {
-    Runtime();
+    // 'name' is set before the runtime is registered for metrics, which reads it from other threads
+    explicit Runtime(std::string name = "vm");
     ~Runtime();
 
+    // Makes the loops of runtimes created afterwards submit their fs requests through io_uring on Linux
+    static void enableIoUring();
+
     bool runToCompletion();
 
     // For child runtimes, run a thread waiting for work
     void runContinuously();
 
     bool hasContinuations();
+    size_t continuationCount();
 
     void schedule(std::function<void()> f);
 
     // Resume thread with the specified error
-    void scheduleLuauError(std::shared_ptr<Ref> ref, std::string error);
+    void scheduleLuauError(std::shared_ptr<Ref> ref, std::string error, uint64_t traceId = 0);
 
     // Resume thread with the results computed by the continuation
-    void scheduleLuauResume(std::shared_ptr<Ref> ref, std::function<int(lua_State*)> cont);
+    void scheduleLuauResume(std::shared_ptr<Ref> ref, std::function<int(lua_State*)> cont, uint64_t traceId = 0);
 
     // Run 'f' in a libuv work queue
     void runInWorkQueue(std::function<void()> f);
 
+    // Run 'f' when the runtime is destroyed, before its handles are closed, to release anything tied to the loop
+    void addShutdownHook(std::function<void()> f);
+
     void addPendingToken();
     void releasePendingToken();
+    int pendingTokenCount();
+
+    // Event loop of this runtime, only driven from the runtime thread
+    uv_loop_t loop;
+
+    // Name used when reporting metrics and traces
+    const std::string name;
+
+    // Whether fs requests made on 'loop' go through io_uring instead of the threadpool
+    bool ioUring = false;
+
+    RuntimeMetrics metrics;
 
     // VM for this runtime
     std::unique_ptr<lua_State, void (*)(lua_State*)> globalState;
@@ -54,11 +82,22 @@ struct Runtime
     std::mutex dataCopyMutex;
     std::unique_ptr<lua_State, void (*)(lua_State*)> dataCopy;
 
-    std::vector<ThreadToContinue> runningThreads;
+    std::deque<ThreadToContinue> runningThreads;
 
 private:
+    struct Continuation
+    {
+        std::function<void()> f;
+        uint64_t scheduledAt = 0;
+    };
+
+    void pushContinuation(std::function<void()> f);
+
     std::mutex continuationMutex;
-    std::vector<std::function<void()>> continuations;
+    std::vector<Continuation> continuations;
+
+    // Wakes up the event loop when work is scheduled from another thread
+    uv_async_t wakeup;
 
     // TODO: can this be handled by libuv?
     std::atomic<bool> stop;
@@ -66,6 +105,8 @@ private:
     std::thread runLoopThread;
 
     std::atomic<int> activeTokens;
+
+    std::vector<std::function<void()>> shutdownHooks;
 };
 
 Runtime* getRuntime(lua_State* L);
@@ -83,6 +124,10 @@ struct ResumeTokenData
     Runtime* runtime = nullptr;
     std::shared_ptr<Ref> ref;
     bool completed = false;
+
+    // Async trace event id and the name of the function which requested the token, only set while tracing
+    uint64_t traceId = 0;
+    std::string traceName;
 };
 
 ResumeToken getResumeToken(lua_State* L);
@@ -0,0 +1,78 @@
+#pragma once
+
+#include <atomic>
+#include <cstdint>
+#include <string>
+
+// Chrome/Perfetto trace-event recording for the runtime.
+// Events are buffered in memory while tracing is enabled and written out as a single JSON document on 'stop'.
+namespace trace
+{
+
+extern std::atomic<bool> active;
+
+inline bool enabled()
+{
+    return active.load(std::memory_order_relaxed);
+}
+
+// Start recording events, the trace will be written to 'path' when 'stop' is called
+bool start(const std::string& path);
+
+// Stop recording and write out the trace file
+void stop();
+
+// Microseconds since tracing started
+uint64_t now();
+
+// Unique id for async events (tokens, cross-VM calls)
+uint64_t nextId();
+
+// Name the track of the calling thread
+void setThreadName(const std::string& name);
+
+// Complete event ('X') on the calling thread's track
+void complete(const char* name, const char* category, uint64_t start, uint64_t duration, std::string args = {});
+
+// Async events ('b'/'e') which are allowed to start and finish on different threads
+void asyncBegin(const char* name, const char* category, uint64_t id, std::string args = {});
+void asyncEnd(const char* name, const char* category, uint64_t id, std::string args = {});
+
+// Instant event ('i') on the calling thread's track
+void instant(const char* name, const char* category, std::string args = {});
+
+// Formats a JSON object with a single key for the 'args' of an event
+std::string arg(const char* key, const std::string& value);
+std::string arg(const char* key, int64_t value);
+
+// Records a complete event covering the lifetime of the scope
+struct Scope
+{
+    Scope(const char* name, const char* category)
+        : name(name)
+        , category(category)
+        , startTime(enabled() ? now() : 0)
+        , recording(enabled())
+    {
+    }
+
+    ~Scope()
+    {
+        if (recording && enabled())
+        {
+            uint64_t end = now();
+            complete(name, category, startTime, end - startTime, std::move(args));
+        }
+    }
+
+    Scope(const Scope&) = delete;
+    Scope& operator=(const Scope&) = delete;
+
+    const char* name;
+    const char* category;
+    uint64_t startTime;
+    bool recording;
+    std::string args;
+};
+
+} // namespace trace
@@ -0,0 +1,202 @@
+#include "lute/metrics.h"
+
+#include "lute/runtime.h"
+
+#include "uv.h"
+
+#include <algorithm>
+#include <chrono>
+#include <condition_variable>
+#include <cstdio>
+#include <thread>
+
+void LatencyHistogram::record(uint64_t micros)
+{
+    int bucket = 0;
+
+    while (bucket < kBuckets - 1 && (uint64_t(1) << bucket) <= micros)
+        bucket++;
+
+    buckets[bucket].fetch_add(1, std::memory_order_relaxed);
+    count.fetch_add(1, std::memory_order_relaxed);
+    total.fetch_add(micros, std::memory_order_relaxed);
+
+    uint64_t previous = max.load(std::memory_order_relaxed);
+    while (previous < micros && !max.compare_exchange_weak(previous, micros, std::memory_order_relaxed))
+    {
+    }
+}
+
+uint64_t LatencyHistogram::percentile(double p) const
+{
+    uint64_t samples = count.load(std::memory_order_relaxed);
+
+    if (samples == 0)
+        return 0;
+
+    uint64_t target = uint64_t(double(samples) * p / 100.0);
+    uint64_t seen = 0;
+    uint64_t largest = max.load(std::memory_order_relaxed);
+
+    for (int i = 0; i < kBuckets - 1; i++)
+    {
+        seen += buckets[i].load(std::memory_order_relaxed);
+
+        if (seen > target)
+            return std::min(uint64_t(1) << i, largest);
+    }
+
+    return largest;
+}
+
+namespace metrics
+{
+
+static std::mutex registryMutex;
+static std::vector<Runtime*> runtimes;
+
+void registerRuntime(Runtime* runtime)
+{
+    std::unique_lock lock(registryMutex);
+    runtimes.push_back(runtime);
+}
+
+void unregisterRuntime(Runtime* runtime)
+{
+    std::unique_lock lock(registryMutex);
+    runtimes.erase(std::remove(runtimes.begin(), runtimes.end(), runtime), runtimes.end());
+}
+
+MetricsSnapshot snapshot(Runtime& runtime)
+{
+    RuntimeMetrics& m = runtime.metrics;
+
+    MetricsSnapshot result;
+    result.name = runtime.name;
+
+    result.lagCount = m.loopLag.count.load();
+    result.lagMean = result.lagCount ? double(m.loopLag.total.load()) / double(result.lagCount) : 0.0;
+    result.lagMax = m.loopLag.max.load();
+    result.lagP50 = m.loopLag.percentile(50);
+    result.lagP90 = m.loopLag.percentile(90);
+    result.lagP99 = m.loopLag.percentile(99);
+
+    for (int i = 0; i < LatencyHistogram::kBuckets; i++)
+        result.lagBuckets.push_back(m.loopLag.buckets[i].load());
+
+    result.idleTime = double(uv_metrics_idle_time(&runtime.loop)) / 1e9;
+    result.loopIterations = m.loopIterations.load();
+
+    result.readyQueue = m.readyQueue.load();
+    result.continuationQueue = runtime.continuationCount();
+    result.pendingTokens = runtime.pendingTokenCount();
+    result.workQueued = m.workQueued.load();
+    result.workRunning = m.workRunning.load();
+
+    result.resumes = m.resumes.load();
+
+    {
+        std::unique_lock lock(m.rateMutex);
+
+        uint64_t now = uv_hrtime();
+
+        if (m.lastSnapshotTime != 0 && now > m.lastSnapshotTime)
+            result.resumesPerSecond = double(result.resumes - m.lastResumes) * 1e9 / double(now - m.lastSnapshotTime);
+
+        m.lastSnapshotTime = now;
+        m.lastResumes = result.resumes;
+    }
+
+    return result;
+}
+
+std::vector<MetricsSnapshot> snapshotAll()
+{
+    std::unique_lock lock(registryMutex);
+
+    std::vector<MetricsSnapshot> result;
+
+    for (Runtime* runtime : runtimes)
+        result.push_back(snapshot(*runtime));
+
+    return result;
+}
+
+std::string toJson(const MetricsSnapshot& s)
+{
+    std::string out = "{\"runtime\":\"";
+
+    for (char c : s.name)
+    {
+        if (c == '"' || c == '\\')
+            out += '\\';
+
+        if ((unsigned char)c >= 0x20)
+            out += c;
+    }
+
+    char buf[512];
+    snprintf(
+        buf,
+        sizeof(buf),
+        "\",\"loopLag\":{\"count\":%llu,\"meanUs\":%.1f,\"maxUs\":%llu,\"p50Us\":%llu,\"p90Us\":%llu,\"p99Us\":%llu},"
+        "\"idleTime\":%.6f,\"loopIterations\":%llu,\"readyQueue\":%llu,\"continuationQueue\":%llu,\"pendingTokens\":%d,"
+        "\"workQueued\":%lld,\"workRunning\":%lld,\"resumes\":%llu,\"resumesPerSec\":%.1f}",
+        (unsigned long long)s.lagCount,
+        s.lagMean,
+        (unsigned long long)s.lagMax,
+        (unsigned long long)s.lagP50,
+        (unsigned long long)s.lagP90,
+        (unsigned long long)s.lagP99,
+        s.idleTime,
+        (unsigned long long)s.loopIterations,
+        (unsigned long long)s.readyQueue,
+        (unsigned long long)s.continuationQueue,
+        s.pendingTokens,
+        (long long)s.workQueued,
+        (long long)s.workRunning,
+        (unsigned long long)s.resumes,
+        s.resumesPerSecond
+    );
+
+    out += buf;
+    return out;
+}
+
+static std::mutex dumpMutex;
+static std::condition_variable dumpCv;
+static std::thread dumpThread;
+static bool dumpStop = false;
+
+void startPeriodicDump(int intervalMs)
+{
+    stopPeriodicDump();
+
+    dumpStop = false;
+
+    dumpThread = std::thread([intervalMs] {
+        std::unique_lock lock(dumpMutex);
+
+        while (!dumpCv.wait_for(lock, std::chrono::milliseconds(intervalMs), [] {
+            return dumpStop;
+        }))
+        {
+            for (const MetricsSnapshot& s : snapshotAll())
+                fprintf(stderr, "%s\n", toJson(s).c_str());
+        }
+    });
+}
+
+void stopPeriodicDump()
+{
+    {
+        std::unique_lock lock(dumpMutex);
+        dumpStop = true;
+        dumpCv.notify_one();
+    }
+
+    if (dumpThread.joinable())
+        dumpThread.join();
+}
+
+} // namespace metrics
@@ -1,11 +1,18 @@
 #include "lute/runtime.h"
 
+#include "lute/trace.h"
+
 #include "lua.h"
 
 #include "uv.h"
 
+#include <atomic>
 #include <string>
+#include <utility>
 #include <assert.h>
+#include <stdlib.h>
+
+static std::atomic<bool> ioUringRequested = false;
 
 static void lua_close_checked(lua_State* L)
 {
@@ -13,16 +20,33 @@ static void lua_close_checked(lua_State* L)
         lua_close(L);
 }
 
-Runtime::Runtime()
-    : globalState(nullptr, lua_close_checked)
+Runtime::Runtime(std::string name)
+    : name(std::move(name))
+    , globalState(nullptr, lua_close_checked)
     , dataCopy(nullptr, lua_close_checked)
 {
     stop.store(false);
     activeTokens.store(0);
+
+    uv_loop_init(&loop);
+    uv_loop_configure(&loop, UV_METRICS_IDLE_TIME);
+
+#ifdef __linux__
+    // libuv only uses its fs ring on loops which opt in, it is created when the first request is submitted
+    if (ioUringRequested.load())
+        ioUring = uv_loop_configure(&loop, UV_LOOP_USE_IO_URING_SQPOLL) == 0;
+#endif
+
+    uv_async_init(&loop, &wakeup, nullptr);
+
+    metrics.lastSnapshotTime = uv_hrtime();
+    metrics::registerRuntime(this);
 }
 
 Runtime::~Runtime()
 {
+    metrics::unregisterRuntime(this);
+
     {
         std::unique_lock lock(continuationMutex);
 
@@ -33,6 +57,28 @@ Runtime::~Runtime()
 
     if (runLoopThread.joinable())
         runLoopThread.join();
+
+    for (auto& hook : shutdownHooks)
+        hook();
+
+    // Close any handles left behind by a failed script and let in-flight work finish, it still refers to this runtime
+    uv_walk(&loop, [](uv_handle_t* handle, void*) {
+        if (!uv_is_closing(handle))
+            uv_close(handle, nullptr);
+    }, nullptr);
+
+    uv_run(&loop, UV_RUN_DEFAULT);
+    uv_loop_close(&loop);
+}
+
+void Runtime::enableIoUring()
+{
+#ifdef __linux__
+    // libuv checks this once, and only enables io_uring by itself on kernels it trusts
+    setenv("UV_USE_IO_URING", "1", 1);
+#endif
+
+    ioUringRequested.store(true);
 }
 
 bool Runtime::runToCompletion()
@@ -40,10 +86,18 @@ bool Runtime::runToCompletion()
     // While there is some C++ or Luau code left to run (waiting for something to happen?)
     while (!runningThreads.empty() || hasContinuations() || activeTokens.load() != 0)
     {
-        uv_run(uv_default_loop(), UV_RUN_DEFAULT);
+        metrics.loopIterations.fetch_add(1, std::memory_order_relaxed);
+        metrics.readyQueue.store(runningThreads.size(), std::memory_order_relaxed);
+
+        {
+            trace::Scope scope("loop", "scheduler");
+
+            // Only block waiting for events when there is nothing else to run, a wakeup is signalled when work is scheduled
+            uv_run(&loop, runningThreads.empty() && !hasContinuations() ? UV_RUN_ONCE : UV_RUN_NOWAIT);
+        }
 
         // Complete all C++ continuations
-        std::vector<std::function<void()>> copy;
+        std::vector<Continuation> copy;
 
         {
             std::unique_lock lock(continuationMutex);
@@ -51,14 +105,27 @@ bool Runtime::runToCompletion()
             continuations.clear();
         }
 
-        for (auto&& continuation : copy)
-            continuation();
+        if (!copy.empty())
+        {
+            trace::Scope scope("continuations", "scheduler");
+
+            if (scope.recording)
+                scope.args = trace::arg("count", int64_t(copy.size()));
+
+            uint64_t now = uv_hrtime();
+
+            for (auto&& continuation : copy)
+            {
+                metrics.loopLag.record(now > continuation.scheduledAt ? (now - continuation.scheduledAt) / 1000 : 0);
+                continuation.f();
+            }
+        }
 
         if (runningThreads.empty())
             continue;
 
         auto next = std::move(runningThreads.front());
-        runningThreads.erase(runningThreads.begin());
+        runningThreads.pop_front();
 
         next.ref->push(GL);
         lua_State* L = lua_tothread(GL, -1);
@@ -72,6 +139,13 @@ bool Runtime::runToCompletion()
         // We still have 'next' on stack to hold on to thread we are about to run
         lua_pop(GL, 1);
 
+        if (next.traceId != 0)
+            trace::asyncEnd("ready", "scheduler", next.traceId);
+
+        trace::Scope scope("resume", "luau");
+
+        metrics.resumes.fetch_add(1, std::memory_order_relaxed);
+
         int status = LUA_OK;
 
         if (!next.success)
@@ -79,6 +153,9 @@ bool Runtime::runToCompletion()
         else
             status = lua_resume(L, nullptr, next.argumentCount);
 
+        if (scope.recording)
+            scope.args = trace::arg("status", status == LUA_YIELD ? "yield" : status == LUA_OK ? "finished" : "error");
+
         if (status == LUA_YIELD)
         {
             int results = lua_gettop(L);
@@ -118,8 +195,9 @@ bool Runtime::runToCompletion()
 
 void Runtime::runContinuously()
 {
-    // TODO: another place for libuv
     runLoopThread = std::thread([this] {
+        trace::setThreadName("runtime (" + name + ")");
+
         while (!stop)
         {
             // Block to wait on event
@@ -142,56 +220,82 @@ bool Runtime::hasContinuations()
     return !continuations.empty();
 }
 
-void Runtime::schedule(std::function<void()> f)
+size_t Runtime::continuationCount()
+{
+    std::unique_lock lock(continuationMutex);
+    return continuations.size();
+}
+
+void Runtime::pushContinuation(std::function<void()> f)
 {
     std::unique_lock lock(continuationMutex);
 
-    continuations.push_back(std::move(f));
+    continuations.push_back({std::move(f), uv_hrtime()});
 
     runLoopCv.notify_one();
+    uv_async_send(&wakeup);
 }
 
-void Runtime::scheduleLuauError(std::shared_ptr<Ref> ref, std::string error)
+void Runtime::schedule(std::function<void()> f)
 {
-    std::unique_lock lock(continuationMutex);
+    pushContinuation(std::move(f));
+}
 
-    continuations.push_back([this, ref, error = std::move(error)]() mutable {
+void Runtime::scheduleLuauError(std::shared_ptr<Ref> ref, std::string error, uint64_t traceId)
+{
+    pushContinuation([this, ref, error = std::move(error), traceId]() mutable {
         ref->push(GL);
         lua_State* L = lua_tothread(GL, -1);
         lua_pop(GL, 1);
 
         lua_pushlstring(L, error.data(), error.size());
-        runningThreads.push_back({ false, ref, lua_gettop(L) });
+        runningThreads.push_back({ false, ref, lua_gettop(L), {}, traceId });
     });
-
-    runLoopCv.notify_one();
 }
 
-void Runtime::scheduleLuauResume(std::shared_ptr<Ref> ref, std::function<int(lua_State*)> cont)
+void Runtime::scheduleLuauResume(std::shared_ptr<Ref> ref, std::function<int(lua_State*)> cont, uint64_t traceId)
 {
-    std::unique_lock lock(continuationMutex);
-
-    continuations.push_back([this, ref, cont = std::move(cont)]() mutable {
+    pushContinuation([this, ref, cont = std::move(cont), traceId]() mutable {
         ref->push(GL);
         lua_State* L = lua_tothread(GL, -1);
         lua_pop(GL, 1);
 
         int results = cont(L);
-        runningThreads.push_back({ true, ref, results });
+        runningThreads.push_back({ true, ref, results, {}, traceId });
     });
-
-    runLoopCv.notify_one();
 }
 
 void Runtime::runInWorkQueue(std::function<void()> f)
 {
-    auto loop = uv_default_loop();
+    metrics.workQueued.fetch_add(1, std::memory_order_relaxed);
+
+    f = [this, f = std::move(f)] {
+        metrics.workQueued.fetch_sub(1, std::memory_order_relaxed);
+        metrics.workRunning.fetch_add(1, std::memory_order_relaxed);
+
+        f();
+
+        metrics.workRunning.fetch_sub(1, std::memory_order_relaxed);
+    };
+
+    if (trace::enabled())
+    {
+        f = [f = std::move(f), queued = trace::now()] {
+            trace::setThreadName("threadpool");
+
+            trace::Scope scope("work", "threadpool");
+            scope.args = trace::arg("queued_us", int64_t(scope.startTime - queued));
+
+            f();
+        };
+    }
 
     uv_work_t* work = new uv_work_t();
     work->data = new decltype(f)(std::move(f));
 
-    uv_queue_work(loop, work, [](uv_work_t* req) {
-        auto task = *(decltype(f)*)req->data;
+    uv_queue_work(&loop, work, [](uv_work_t* req) {
+        // The task is only destroyed on the loop thread, so whatever it captures is released there
+        auto& task = *(decltype(f)*)req->data;
 
         task();
     }, [](uv_work_t* req, int status) {
@@ -200,6 +304,11 @@ void Runtime::runInWorkQueue(std::function<void()> f)
     });
 }
 
+void Runtime::addShutdownHook(std::function<void()> f)
+{
+    shutdownHooks.push_back(std::move(f));
+}
+
 void Runtime::addPendingToken()
 {
     activeTokens.fetch_add(1);
@@ -211,6 +320,11 @@ void Runtime::releasePendingToken()
     assert(before > 0);
 }
 
+int Runtime::pendingTokenCount()
+{
+    return activeTokens.load();
+}
+
 Runtime* getRuntime(lua_State* L)
 {
     return reinterpret_cast<Runtime*>(lua_getthreaddata(lua_mainthread(L)));
@@ -221,7 +335,13 @@ void ResumeTokenData::fail(std::string error)
     assert(!completed);
     completed = true;
 
-    runtime->scheduleLuauError(ref, std::move(error));
+    if (traceId != 0)
+    {
+        trace::asyncEnd(traceName.c_str(), "async", traceId, trace::arg("error", error));
+        trace::asyncBegin("ready", "scheduler", traceId);
+    }
+
+    runtime->scheduleLuauError(ref, std::move(error), traceId);
     runtime->releasePendingToken();
 }
 
@@ -230,7 +350,13 @@ void ResumeTokenData::complete(std::function<int(lua_State*)> cont)
     assert(!completed);
     completed = true;
 
-    runtime->scheduleLuauResume(ref, std::move(cont));
+    if (traceId != 0)
+    {
+        trace::asyncEnd(traceName.c_str(), "async", traceId);
+        trace::asyncBegin("ready", "scheduler", traceId);
+    }
+
+    runtime->scheduleLuauResume(ref, std::move(cont), traceId);
     runtime->releasePendingToken();
 }
 
@@ -243,5 +369,14 @@ ResumeToken getResumeToken(lua_State* L)
 
     token->runtime->addPendingToken();
 
+    if (trace::enabled())
+    {
+        lua_Debug ar;
+        token->traceName = lua_getinfo(L, 0, "n", &ar) && ar.name ? ar.name : "token";
+        token->traceId = trace::nextId();
+
+        trace::asyncBegin(token->traceName.c_str(), "async", token->traceId);
+    }
+
     return token;
 }
@@ -0,0 +1,274 @@
+#include "lute/trace.h"
+
+#include "uv.h"
+
+#include <cstdio>
+#include <map>
+#include <mutex>
+#include <string>
+#include <vector>
+
+namespace trace
+{
+
+std::atomic<bool> active{false};
+
+struct Event
+{
+    std::string name;
+    const char* category = nullptr;
+    char phase = 'X';
+    int tid = 0;
+    uint64_t ts = 0;
+    uint64_t dur = 0;
+    uint64_t id = 0;
+    std::string args;
+};
+
+static std::mutex traceMutex;
+static std::vector<Event> events;
+static std::map<int, std::string> threadNames;
+static std::string outputPath;
+static uint64_t startTime = 0;
+
+static std::atomic<int> nextTid{1};
+static std::atomic<uint64_t> nextAsyncId{1};
+
+static int currentTid()
+{
+    thread_local int tid = nextTid.fetch_add(1);
+    return tid;
+}
+
+static void escape(std::string& out, const char* str)
+{
+    for (const char* it = str; *it; ++it)
+    {
+        char c = *it;
+
+        switch (c)
+        {
+        case '"':
+            out += "\\\"";
+            break;
+        case '\\':
+            out += "\\\\";
+            break;
+        case '\n':
+            out += "\\n";
+            break;
+        case '\t':
+            out += "\\t";
+            break;
+        default:
+            if ((unsigned char)c < 0x20)
+            {
+                char buf[8];
+                snprintf(buf, sizeof(buf), "\\u%04x", c);
+                out += buf;
+            }
+            else
+            {
+                out += c;
+            }
+        }
+    }
+}
+
+static void record(Event&& event)
+{
+    event.tid = currentTid();
+
+    std::unique_lock lock(traceMutex);
+    events.push_back(std::move(event));
+}
+
+bool start(const std::string& path)
+{
+    FILE* file = fopen(path.c_str(), "w");
+
+    if (!file)
+        return false;
+
+    fclose(file);
+
+    std::unique_lock lock(traceMutex);
+
+    outputPath = path;
+    startTime = uv_hrtime();
+    active.store(true);
+
+    return true;
+}
+
+void stop()
+{
+    if (!active.exchange(false))
+        return;
+
+    std::unique_lock lock(traceMutex);
+
+    FILE* file = fopen(outputPath.c_str(), "w");
+
+    if (!file)
+    {
+        fprintf(stderr, "Failed to write trace to %s\n", outputPath.c_str());
+        return;
+    }
+
+    std::string out;
+    out.reserve(events.size() * 128);
+
+    out += "{\"traceEvents\":[\n";
+
+    bool first = true;
+
+    for (auto& [tid, name] : threadNames)
+    {
+        if (!first)
+            out += ",\n";
+        first = false;
+
+        out += "{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":1,\"tid\":" + std::to_string(tid) + ",\"args\":{\"name\":\"";
+        escape(out, name.c_str());
+        out += "\"}}";
+    }
+
+    for (const Event& event : events)
+    {
+        if (!first)
+            out += ",\n";
+        first = false;
+
+        out += "{\"name\":\"";
+        escape(out, event.name.c_str());
+        out += "\",\"cat\":\"";
+        escape(out, event.category);
+        out += "\",\"ph\":\"";
+        out += event.phase;
+        out += "\",\"pid\":1,\"tid\":" + std::to_string(event.tid) + ",\"ts\":" + std::to_string(event.ts);
+
+        if (event.phase == 'X')
+            out += ",\"dur\":" + std::to_string(event.dur);
+
+        if (event.phase == 'b' || event.phase == 'e')
+            out += ",\"id\":\"" + std::to_string(event.id) + "\"";
+
+        if (event.phase == 'i')
+            out += ",\"s\":\"t\"";
+
+        if (!event.args.empty())
+            out += ",\"args\":" + event.args;
+
+        out += "}";
+    }
+
+    out += "\n],\"displayTimeUnit\":\"ms\"}\n";
+
+    fwrite(out.data(), 1, out.size(), file);
+    fclose(file);
+
+    events.clear();
+    threadNames.clear();
+}
+
+uint64_t now()
+{
+    return (uv_hrtime() - startTime) / 1000;
+}
+
+uint64_t nextId()
+{
+    return nextAsyncId.fetch_add(1);
+}
+
+void setThreadName(const std::string& name)
+{
+    int tid = currentTid();
+
+    std::unique_lock lock(traceMutex);
+    threadNames[tid] = name;
+}
+
+void complete(const char* name, const char* category, uint64_t start, uint64_t duration, std::string args)
+{
+    if (!enabled())
+        return;
+
+    Event event;
+    event.name = name;
+    event.category = category;
+    event.phase = 'X';
+    event.ts = start;
+    event.dur = duration;
+    event.args = std::move(args);
+
+    record(std::move(event));
+}
+
+void asyncBegin(const char* name, const char* category, uint64_t id, std::string args)
+{
+    if (!enabled())
+        return;
+
+    Event event;
+    event.name = name;
+    event.category = category;
+    event.phase = 'b';
+    event.ts = now();
+    event.id = id;
+    event.args = std::move(args);
+
+    record(std::move(event));
+}
+
+void asyncEnd(const char* name, const char* category, uint64_t id, std::string args)
+{
+    if (!enabled())
+        return;
+
+    Event event;
+    event.name = name;
+    event.category = category;
+    event.phase = 'e';
+    event.ts = now();
+    event.id = id;
+    event.args = std::move(args);
+
+    record(std::move(event));
+}
+
+void instant(const char* name, const char* category, std::string args)
+{
+    if (!enabled())
+        return;
+
+    Event event;
+    event.name = name;
+    event.category = category;
+    event.phase = 'i';
+    event.ts = now();
+    event.args = std::move(args);
+
+    record(std::move(event));
+}
+
+std::string arg(const char* key, const std::string& value)
+{
+    std::string out = "{\"";
+    escape(out, key);
+    out += "\":\"";
+    escape(out, value.c_str());
+    out += "\"}";
+    return out;
+}
+
+std::string arg(const char* key, int64_t value)
+{
+    std::string out = "{\"";
+    escape(out, key);
+    out += "\":" + std::to_string(value) + "}";
+    return out;
+}
+
+} // namespace trace
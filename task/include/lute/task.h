@@ -13,8 +13,16 @@ namespace task
 
 int lua_defer(lua_State* L);
 
+/* Returns scheduler metrics of the current runtime as a table */
+int lua_metrics(lua_State* L);
+
+/* Returns an array of scheduler metrics for the main runtime and every child VM */
+int lua_allmetrics(lua_State* L);
+
 static const luaL_Reg lib[] = {
     {"defer", lua_defer},
+    {"metrics", lua_metrics},
+    {"allmetrics", lua_allmetrics},
     {nullptr, nullptr},
 };
 
@@ -1,7 +1,62 @@
 #include "lute/task.h"
 
+#include "lute/metrics.h"
 #include "lute/runtime.h"
 
+static void pushMetrics(lua_State* L, const MetricsSnapshot& s)
+{
+    lua_createtable(L, 0, 12);
+
+    lua_pushlstring(L, s.name.data(), s.name.size());
+    lua_setfield(L, -2, "runtime");
+
+    // latencies are reported in seconds, like the rest of the time values
+    lua_createtable(L, 0, 7);
+
+    lua_pushnumber(L, double(s.lagCount));
+    lua_setfield(L, -2, "count");
+    lua_pushnumber(L, s.lagMean / 1e6);
+    lua_setfield(L, -2, "mean");
+    lua_pushnumber(L, double(s.lagMax) / 1e6);
+    lua_setfield(L, -2, "max");
+    lua_pushnumber(L, double(s.lagP50) / 1e6);
+    lua_setfield(L, -2, "p50");
+    lua_pushnumber(L, double(s.lagP90) / 1e6);
+    lua_setfield(L, -2, "p90");
+    lua_pushnumber(L, double(s.lagP99) / 1e6);
+    lua_setfield(L, -2, "p99");
+
+    // bucket i counts lags below 2^i microseconds
+    lua_createtable(L, int(s.lagBuckets.size()), 0);
+    for (size_t i = 0; i < s.lagBuckets.size(); i++)
+    {
+        lua_pushnumber(L, double(s.lagBuckets[i]));
+        lua_rawseti(L, -2, int(i + 1));
+    }
+    lua_setfield(L, -2, "buckets");
+
+    lua_setfield(L, -2, "looplag");
+
+    lua_pushnumber(L, s.idleTime);
+    lua_setfield(L, -2, "idletime");
+    lua_pushnumber(L, double(s.loopIterations));
+    lua_setfield(L, -2, "loopiterations");
+    lua_pushnumber(L, double(s.readyQueue));
+    lua_setfield(L, -2, "readyqueue");
+    lua_pushnumber(L, double(s.continuationQueue));
+    lua_setfield(L, -2, "continuationqueue");
+    lua_pushnumber(L, s.pendingTokens);
+    lua_setfield(L, -2, "pendingtokens");
+    lua_pushnumber(L, double(s.workQueued));
+    lua_setfield(L, -2, "workqueued");
+    lua_pushnumber(L, double(s.workRunning));
+    lua_setfield(L, -2, "workrunning");
+    lua_pushnumber(L, double(s.resumes));
+    lua_setfield(L, -2, "resumes");
+    lua_pushnumber(L, s.resumesPerSecond);
+    lua_setfield(L, -2, "resumespersec");
+}
+
 namespace task
 {
     int lua_defer(lua_State* L)
@@ -11,6 +66,27 @@ namespace task
         runtime->runningThreads.push_back({ true, getRefForThread(L), 0 });
         return lua_yield(L, 0);
     }
+
+    int lua_metrics(lua_State* L)
+    {
+        pushMetrics(L, metrics::snapshot(*getRuntime(L)));
+        return 1;
+    }
+
+    int lua_allmetrics(lua_State* L)
+    {
+        std::vector<MetricsSnapshot> all = metrics::snapshotAll();
+
+        lua_createtable(L, int(all.size()), 0);
+
+        for (size_t i = 0; i < all.size(); i++)
+        {
+            pushMetrics(L, all[i]);
+            lua_rawseti(L, -2, int(i + 1));
+        }
+
+        return 1;
+    }
 } // namespace task
 
 int luaopen_task(lua_State* L)
@@ -2,6 +2,7 @@
 
 #include "lute/require.h"
 #include "lute/runtime.h"
+#include "lute/trace.h"
 
 #include <memory>
 
@@ -120,7 +121,12 @@ static int crossVmMarshall(lua_State* L)
 
     auto source = getResumeToken(L);
 
-    target.runtime->schedule([source, target = target, args] {
+    uint64_t callId = trace::enabled() ? trace::nextId() : 0;
+
+    if (callId != 0)
+        trace::asyncBegin("vm call", "vm", callId, trace::arg("function", source->traceName));
+
+    target.runtime->schedule([source, target = target, args, callId] {
         lua_State* L = lua_newthread(target.runtime->GL);
         luaL_sandboxthread(L);
 
@@ -131,13 +137,16 @@ static int crossVmMarshall(lua_State* L)
         auto co = getRefForThread(L);
         lua_pop(target.runtime->GL, 1);
 
-        target.runtime->runningThreads.push_back({ true, co, argCount, [source, target = target.runtime, co] {
+        target.runtime->runningThreads.push_back({ true, co, argCount, [source, target = target.runtime, co, callId] {
             co->push(target->GL);
             lua_State* L = lua_tothread(target->GL, -1);
             lua_pop(target->GL, 1);
 
             std::shared_ptr<Ref> rets = packStackValues(L, target);
 
+            if (callId != 0)
+                trace::asyncEnd("vm call", "vm", callId);
+
             source->complete([target, rets](lua_State* L) {
                 return unpackStackValue(target, L, rets);
             });
@@ -162,7 +171,7 @@ int lua_spawn(lua_State* L)
 {
     const char* file = luaL_checkstring(L, 1);
 
-    auto child = std::make_shared<Runtime>();
+    auto child = std::make_shared<Runtime>(file);
 
     setupState(*child);
 